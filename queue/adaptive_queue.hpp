@@ -0,0 +1,356 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_ADAPTIVE_QUEUE_HPP
+#define GUARUNTEED_MPMC_ADAPTIVE_QUEUE_HPP
+
+
+#include "queue.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+
+// When adaptive_queue switches between its single ring and its lanes.  Every sample_every'th operation of a thread is timed, only the attempt
+// that reserved and wrote (or read) its slot, so a push waiting on a full queue or a pop on an empty one isn't taken for contention, and the
+// sampled threads are counted.  Every window_samples samples the queue decides on its mode.
+struct adaptive_policy
+{
+	uint32_t sample_every = 64;
+	uint32_t window_samples = 256;
+
+	// Spread over the lanes when the mean sampled operation on the single ring takes longer than this.
+	std::chrono::nanoseconds contended_latency = std::chrono::nanoseconds(500);
+
+	// Back to the single ring when fewer threads than this fraction of those that were using the queue when it spread over the lanes are.
+	double quiet_fraction = 0.5;
+
+	// Windows spent in a mode before the queue can leave it again, so it doesn't flap around the thresholds.
+	uint32_t min_windows = 4;
+
+	// The thread count can miss a drop in load (a few threads that each run for a whole window look like one), so after this many windows in the
+	// lanes the queue tries the single ring again.  Each probe that finds it still contended doubles the interval, up to 64 times this.
+	uint32_t probe_windows = 16;
+};
+
+
+// Bounded MPMC queue that is a single queue (strict FIFO, the lowest latency) while it is lightly loaded, and spreads over lanes, a smaller queue
+// per thread, once the single queue's leading edges are contended.  Contention shows as the time an operation takes to get through the queue,
+// which is sampled (see adaptive_policy), so the hot paths only add a read of the mode and a thread local count.  The mode is read on every attempt,
+// so after a switch pushes go to the new mode at once, and pops take what was left in the mode switched away from first and look there again
+// whenever the current mode is empty (a push that read the mode just before the switch lands in the old one), no item is lost.
+//
+// Each thread pushes to and pops from its own lane first (threads are spread over the lanes in the order they first use a queue), so in the
+// sharded mode items stay FIFO per producer, but across a switch a producer's later items can be popped before its earlier ones.  A push blocks
+// while its own lane is full even if other lanes have room, and just after a switch the two modes together can hold up to twice the capacity.
+template <class T, class Traits = detail::queue_traits<>>
+class adaptive_queue
+{
+public:
+
+	typedef T value_type;
+	typedef detail::optional<T> optional_t;
+
+	// 0 lanes is one per hardware thread (at least 2).
+	adaptive_queue(size_t, size_t = 0, adaptive_policy = adaptive_policy());
+
+	void push(T&&);
+	bool try_push(T&, uint16_t);
+	T pop();
+	optional_t try_pop(uint16_t);
+
+	size_t size() const;
+	size_t empty() const;
+	size_t capacity() const;
+
+	size_t lane_count() const;
+	size_t lane_capacity() const;
+	bool sharded() const;
+	size_t switches() const;
+
+private:
+	typedef queue<T, Traits> ring_t;
+	typedef std::chrono::steady_clock clock;
+
+	static size_t thread_index();
+	size_t lane() const;
+	bool sampling() const;
+	bool try_push_once(T&);
+	bool try_pop_once(optional_t&);
+	bool take(bool, optional_t&);
+	void sample(clock::duration);
+	void decide();
+
+	adaptive_policy policy_;
+	ring_t single_;
+	std::vector<detail::aligned_ptr<ring_t>> lanes_;
+
+	// Read by every operation, only written on a switch.  draining_ is set by a switch until a pop finds the mode switched away from empty.
+	alignas(Traits::cache_line_size) std::atomic<bool> sharded_;
+	std::atomic<bool> draining_;
+
+	// The current decision window, written by sampled operations.  The sample that fills the window decides and opens the next one, so
+	// windows_in_mode_ and sharded_threads_ are only touched by one thread at a time.
+	alignas(Traits::cache_line_size) detail::rmw_atomic<uint32_t> window_samples_;
+	detail::rmw_atomic<uint64_t> window_ns_;
+	detail::rmw_atomic<uint64_t> window_threads_;   // A bit per sampled thread (modulo 64).
+	uint32_t windows_in_mode_;
+	uint32_t probe_windows_;
+	size_t sharded_threads_;
+	std::atomic_size_t switches_;
+};
+
+
+template <class T, class Traits>
+adaptive_queue<T, Traits>::adaptive_queue(size_t capacity, size_t lane_count, adaptive_policy policy)
+	: policy_(policy), single_(capacity), sharded_(false), draining_(false), window_samples_(0), window_ns_(0), window_threads_(0),
+	windows_in_mode_(0), probe_windows_(policy.probe_windows), sharded_threads_(0), switches_(0)
+{
+	if (policy_.sample_every == 0 || policy_.window_samples == 0)
+		throw std::invalid_argument("specified sampling is zero - an adaptive queue must sample operations");
+	else if (policy_.probe_windows < policy_.min_windows)
+		throw std::invalid_argument("specified probe windows is less than min windows");
+
+	if (lane_count == 0)
+		lane_count = std::max(2u, std::thread::hardware_concurrency());
+	size_t lane_capacity = (single_.capacity() + lane_count - 1) / lane_count;
+	for (size_t i = 0; i != lane_count; ++i)
+		lanes_.emplace_back(detail::make_aligned<ring_t>(lane_capacity));
+}
+
+template <class T, class Traits>
+void adaptive_queue<T, Traits>::push(T&& t)
+{
+	for (uint32_t wait_count = 0; !try_push_once(t); ++wait_count)
+	{
+		if ((wait_count % Traits::concurrency) + 1 == Traits::concurrency)
+			std::this_thread::yield(); // Deal with oversubscription...
+	}
+}
+
+template <class T, class Traits>
+bool adaptive_queue<T, Traits>::try_push(T &t, uint16_t attempts)
+{
+	for (uint16_t attempt = 0; !try_push_once(t); ++attempt)
+	{
+		if (attempt == attempts)
+			return false;
+	}
+	return true;
+}
+
+template <class T, class Traits>
+T adaptive_queue<T, Traits>::pop()
+{
+	optional_t ot;
+	for (uint32_t wait_count = 0; !try_pop_once(ot); ++wait_count)
+	{
+		if ((wait_count % Traits::concurrency) + 1 == Traits::concurrency)
+			std::this_thread::yield(); // Deal with oversubscription...
+	}
+	return ot.release();
+}
+
+template <class T, class Traits>
+typename adaptive_queue<T, Traits>::optional_t adaptive_queue<T, Traits>::try_pop(uint16_t attempts)
+{
+	optional_t ot;
+	for (uint16_t attempt = 0; !try_pop_once(ot); ++attempt)
+	{
+		if (attempt == attempts)
+			break;
+	}
+	return ot;
+}
+
+template <class T, class Traits>
+size_t adaptive_queue<T, Traits>::size() const
+{
+	size_t total = single_.size();
+	for (auto const &l : lanes_)
+		total += l->size();
+	return total;
+}
+
+template <class T, class Traits>
+size_t adaptive_queue<T, Traits>::empty() const
+{
+	return size() == 0;
+}
+
+template <class T, class Traits>
+size_t adaptive_queue<T, Traits>::capacity() const
+{
+	return single_.capacity();
+}
+
+template <class T, class Traits>
+size_t adaptive_queue<T, Traits>::lane_count() const
+{
+	return lanes_.size();
+}
+
+// While sharded a push blocks on its own lane, so this is all a single thread can count on pushing without a pop.
+template <class T, class Traits>
+size_t adaptive_queue<T, Traits>::lane_capacity() const
+{
+	return lanes_[0]->capacity();
+}
+
+template <class T, class Traits>
+bool adaptive_queue<T, Traits>::sharded() const
+{
+	return sharded_;
+}
+
+// Number of times the queue has changed mode.
+template <class T, class Traits>
+size_t adaptive_queue<T, Traits>::switches() const
+{
+	return switches_;
+}
+
+// Threads are numbered in the order they first use an adaptive_queue.
+template <class T, class Traits>
+size_t adaptive_queue<T, Traits>::thread_index()
+{
+	static std::atomic<size_t> next_thread(0);
+	static thread_local size_t index = next_thread.fetch_add(1);
+	return index;
+}
+
+template <class T, class Traits>
+size_t adaptive_queue<T, Traits>::lane() const
+{
+	return thread_index() % lanes_.size();
+}
+
+// Whether the calling thread times this operation, counted over every adaptive_queue it uses.
+template <class T, class Traits>
+bool adaptive_queue<T, Traits>::sampling() const
+{
+	static thread_local uint32_t count = 0;
+	return ++count % policy_.sample_every == 0;
+}
+
+template <class T, class Traits>
+bool adaptive_queue<T, Traits>::try_push_once(T &t)
+{
+	ring_t &ring = sharded_.load(std::memory_order_acquire) ? *lanes_[lane()] : single_;
+	if (!sampling())
+		return ring.try_push(t, 0);
+
+	clock::time_point t0 = clock::now();
+	if (!ring.try_push(t, 0))
+		return false;
+	sample(clock::now() - t0);
+	return true;
+}
+
+template <class T, class Traits>
+bool adaptive_queue<T, Traits>::try_pop_once(optional_t &ot)
+{
+	bool sharded = sharded_.load(std::memory_order_acquire);
+	if (draining_.load(std::memory_order_relaxed))
+	{
+		if (take(!sharded, ot))
+			return true;
+		draining_.store(false, std::memory_order_relaxed);
+	}
+
+	if (!sampling())
+	{
+		if (take(sharded, ot))
+			return true;
+	}
+	else
+	{
+		clock::time_point t0 = clock::now();
+		if (take(sharded, ot))
+		{
+			sample(clock::now() - t0);
+			return true;
+		}
+	}
+
+	// Late pushes to the mode switched away from.
+	return take(!sharded, ot);
+}
+
+// Pops from the single ring, or from the lanes starting with the calling thread's, checking for an item before paying for a try_pop.
+template <class T, class Traits>
+bool adaptive_queue<T, Traits>::take(bool sharded, optional_t &ot)
+{
+	if (!sharded)
+		return !single_.empty() && (ot = single_.try_pop(0));
+
+	size_t first = lane();
+	for (size_t i = 0; i != lanes_.size(); ++i)
+	{
+		ring_t &ring = *lanes_[(first + i) % lanes_.size()];
+		if (!ring.empty() && (ot = ring.try_pop(0)))
+			return true;
+	}
+	return false;
+}
+
+template <class T, class Traits>
+void adaptive_queue<T, Traits>::sample(clock::duration duration)
+{
+	uint32_t index = window_samples_.fetch_add(1);
+	if (index >= policy_.window_samples)
+		return; // The window is full and being decided on.
+
+	window_ns_.fetch_add(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()));
+	uint64_t bit = uint64_t(1) << (thread_index() % 64);
+	if ((window_threads_.load(std::memory_order_relaxed) & bit) == 0)
+		window_threads_.fetch_or(bit);
+	if (index + 1 == policy_.window_samples)
+		decide();
+}
+
+// Called by the sample that filled the window.  A single ring that is slow per operation is contended, lanes are given up once far fewer threads
+// use the queue than did when they were taken, or to probe the single ring (the lanes are fast whatever the load, their latency says nothing).
+template <class T, class Traits>
+void adaptive_queue<T, Traits>::decide()
+{
+	double mean_ns = static_cast<double>(window_ns_.exchange(0)) / static_cast<double>(policy_.window_samples);
+	size_t threads = std::bitset<64>(window_threads_.exchange(0)).count();
+
+	bool sharded = sharded_;
+	bool settled = ++windows_in_mode_ >= policy_.min_windows;
+	bool contended = mean_ns > static_cast<double>(policy_.contended_latency.count());
+	bool quiet = static_cast<double>(threads) < static_cast<double>(sharded_threads_) * policy_.quiet_fraction || windows_in_mode_ >= probe_windows_;
+	if (!sharded && !contended && windows_in_mode_ == policy_.min_windows)
+		probe_windows_ = policy_.probe_windows; // The last probe (or switch back) held.
+
+	if (settled && (sharded ? quiet : contended))
+	{
+		if (!sharded)
+		{
+			// Contended as soon as it could tell, whatever brought the queue back to the single ring was wrong, wait longer before the next probe.
+			if (windows_in_mode_ == policy_.min_windows && switches_ != 0)
+				probe_windows_ = std::min(probe_windows_ * 2, policy_.probe_windows * 64);
+			sharded_threads_ = threads;
+		}
+		windows_in_mode_ = 0;
+		draining_ = true;
+		sharded_ = !sharded;
+		++switches_;
+	}
+
+	window_samples_ = 0;
+}
+
+#endif // GUARUNTEED_MPMC_ADAPTIVE_QUEUE_HPP
@@ -0,0 +1,441 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_ASYNC_LOGGER_HPP
+#define GUARUNTEED_MPMC_ASYNC_LOGGER_HPP
+
+
+#include "queue.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <climits>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace detail
+{
+	// Keeps a log record at 72 bytes, arguments beyond this have to be folded into the format string by the caller.
+	static const size_t max_log_args = 6;
+
+	// Longest formatted line (including timestamp prefix and newline), longer lines are truncated.
+	static const size_t max_log_line = 256;
+
+#if defined(_WIN32)
+	struct io_vector
+	{
+		void *iov_base;
+		size_t iov_len;
+	};
+
+	// There is no writev on windows, fall back to one write per line.
+	inline bool write_vector(int fd, io_vector *iov, size_t count)
+	{
+		for (size_t i = 0; i != count; ++i)
+		{
+			char const *base = static_cast<char const*>(iov[i].iov_base);
+			for (size_t written = 0; written != iov[i].iov_len; )
+			{
+				int result = ::_write(fd, base + written, static_cast<unsigned int>(iov[i].iov_len - written));
+				if (result < 0)
+					return false;
+				written += static_cast<size_t>(result);
+			}
+		}
+		return true;
+	}
+#else
+	typedef ::iovec io_vector;
+
+	// Writes all count vectors, resuming after partial writes.
+	inline bool write_vector(int fd, io_vector *iov, size_t count)
+	{
+		while (count != 0)
+		{
+			int chunk = static_cast<int>(std::min<size_t>(count, IOV_MAX));
+			ssize_t result = ::writev(fd, iov, chunk);
+			if (result < 0)
+				return false;
+
+			size_t written = static_cast<size_t>(result);
+			while (count != 0 && written >= iov->iov_len)
+			{
+				written -= iov->iov_len;
+				++iov;
+				--count;
+			}
+			if (count != 0)
+			{
+				iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+				iov->iov_len -= written;
+			}
+		}
+		return true;
+	}
+#endif
+
+	enum class log_arg_type : uint8_t
+	{
+		signed_integer,
+		unsigned_integer,
+		floating_point,
+		character,
+		boolean,
+		string,
+		pointer
+	};
+
+	union log_arg_value
+	{
+		int64_t i;
+		uint64_t u;
+		double d;
+		char c;
+		bool b;
+		char const *s;
+		void const *p;
+	};
+
+	// A log record is trivially copyable, so the hot path is a handful of stores followed by a push.  Strings are captured by pointer, they must outlive
+	// the logger just like the format string (string literals are the intended use).  A record without a format string is a flush marker, its only
+	// argument points at the flag to raise once everything before it has been written.
+	struct log_record
+	{
+		char const *format;
+		int64_t timestamp;
+		uint8_t arg_count;
+		log_arg_type types[max_log_args];
+		log_arg_value args[max_log_args];
+	};
+
+	inline void encode_log_arg(log_record &r, size_t i, bool b)
+	{
+		r.types[i] = log_arg_type::boolean;
+		r.args[i].b = b;
+	}
+
+	inline void encode_log_arg(log_record &r, size_t i, char c)
+	{
+		r.types[i] = log_arg_type::character;
+		r.args[i].c = c;
+	}
+
+	inline void encode_log_arg(log_record &r, size_t i, char const *s)
+	{
+		r.types[i] = log_arg_type::string;
+		r.args[i].s = s;
+	}
+
+	inline void encode_log_arg(log_record &r, size_t i, char *s)
+	{
+		encode_log_arg(r, i, static_cast<char const*>(s));
+	}
+
+	template <class A>
+	inline typename std::enable_if<std::is_integral<A>::value && std::is_signed<A>::value>::type encode_log_arg(log_record &r, size_t i, A a)
+	{
+		r.types[i] = log_arg_type::signed_integer;
+		r.args[i].i = static_cast<int64_t>(a);
+	}
+
+	template <class A>
+	inline typename std::enable_if<std::is_integral<A>::value && std::is_unsigned<A>::value>::type encode_log_arg(log_record &r, size_t i, A a)
+	{
+		r.types[i] = log_arg_type::unsigned_integer;
+		r.args[i].u = static_cast<uint64_t>(a);
+	}
+
+	template <class A>
+	inline typename std::enable_if<std::is_floating_point<A>::value>::type encode_log_arg(log_record &r, size_t i, A a)
+	{
+		r.types[i] = log_arg_type::floating_point;
+		r.args[i].d = static_cast<double>(a);
+	}
+
+	template <class A>
+	inline void encode_log_arg(log_record &r, size_t i, A const *p)
+	{
+		r.types[i] = log_arg_type::pointer;
+		r.args[i].p = p;
+	}
+
+	inline void encode_log_args(log_record &, size_t)
+	{
+	}
+
+	template <class A, class... Args>
+	inline void encode_log_args(log_record &r, size_t i, A const &a, Args const&... args)
+	{
+		static_assert(std::is_trivially_copyable<A>::value, "log arguments must be trivially copyable");
+		encode_log_arg(r, i, a);
+		encode_log_args(r, i + 1, args...);
+	}
+
+	// Appends the formatted argument to out, returns the number of characters written (never more than size).
+	inline size_t format_log_arg(log_arg_type type, log_arg_value const &value, char *out, size_t size)
+	{
+		int result = 0;
+		switch (type)
+		{
+		case log_arg_type::signed_integer:
+			result = std::snprintf(out, size, "%lld", static_cast<long long>(value.i));
+			break;
+		case log_arg_type::unsigned_integer:
+			result = std::snprintf(out, size, "%llu", static_cast<unsigned long long>(value.u));
+			break;
+		case log_arg_type::floating_point:
+			result = std::snprintf(out, size, "%g", value.d);
+			break;
+		case log_arg_type::character:
+			result = std::snprintf(out, size, "%c", value.c);
+			break;
+		case log_arg_type::boolean:
+			result = std::snprintf(out, size, "%s", value.b ? "true" : "false");
+			break;
+		case log_arg_type::string:
+			result = std::snprintf(out, size, "%s", value.s != nullptr ? value.s : "(null)");
+			break;
+		case log_arg_type::pointer:
+			result = std::snprintf(out, size, "%p", value.p);
+			break;
+		}
+
+		if (result < 0)
+			return 0;
+		return std::min(static_cast<size_t>(result), size == 0 ? 0 : size - 1);
+	}
+}
+
+
+// What the hot thread does when the logger's ring is full.
+enum class log_full_policy
+{
+	block,          // Spin until there is room, nothing is lost.
+	drop,           // Discard the record.
+	count_drops     // Discard the record and count it, the background thread reports the count in the log.
+};
+
+
+// Asynchronous logger, hot threads push compact records (format string pointer plus trivially copyable arguments) into a MPSC ring built on queue, a
+// background thread formats them and writes them out in batches with writev.  Format strings use "{}" as the argument placeholder.
+class async_logger
+{
+public:
+	async_logger(int fd, size_t capacity, log_full_policy policy = log_full_policy::block, size_t batch_size = 64);
+	~async_logger();
+
+	async_logger(async_logger const&) = delete;
+	async_logger& operator=(async_logger const&) = delete;
+
+	template <class... Args>
+	bool log(char const *format, Args const&... args);
+
+	void flush();
+	size_t dropped() const;
+
+private:
+	typedef detail::log_record record_t;
+
+	void run();
+	size_t format(record_t const&, char*, size_t) const;
+	void flush_batch(std::vector<detail::io_vector>&, size_t);
+
+	queue<record_t> queue_;
+	log_full_policy policy_;
+	size_t batch_size_;
+	int fd_;
+
+	// Drops are counted by the hot threads, the background thread reports the difference since the last report.
+	alignas(detail::cache_line_size) std::atomic_size_t dropped_;
+	size_t reported_dropped_;
+
+	alignas(detail::cache_line_size) std::atomic_bool stop_;
+
+	std::thread worker_;
+};
+
+
+inline async_logger::async_logger(int fd, size_t capacity, log_full_policy policy, size_t batch_size)
+	: queue_(capacity), policy_(policy), batch_size_(batch_size), fd_(fd), dropped_(0), reported_dropped_(0), stop_(false)
+{
+	if (batch_size_ == 0)
+		throw std::invalid_argument("specified batch size is zero - logger must write at least one record per batch");
+
+	worker_ = std::thread(&async_logger::run, this);
+}
+
+inline async_logger::~async_logger()
+{
+	stop_ = true;
+	worker_.join();
+}
+
+template <class... Args>
+inline bool async_logger::log(char const *format, Args const&... args)
+{
+	static_assert(sizeof...(Args) <= detail::max_log_args, "too many log arguments");
+	assert(format != nullptr);
+
+	record_t r;
+	r.format = format;
+	r.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	r.arg_count = static_cast<uint8_t>(sizeof...(Args));
+	detail::encode_log_args(r, 0, args...);
+
+	if (policy_ == log_full_policy::block)
+	{
+		queue_.push(std::move(r));
+		return true;
+	}
+
+	if (queue_.try_push(r, 0))
+		return true;
+
+	if (policy_ == log_full_policy::count_drops)
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+// Blocks until every record logged by this thread before the call has been written.
+inline void async_logger::flush()
+{
+	std::atomic_bool done(false);
+
+	record_t marker;
+	marker.format = nullptr;
+	marker.timestamp = 0;
+	marker.arg_count = 1;
+	marker.types[0] = detail::log_arg_type::pointer;
+	marker.args[0].p = &done;
+
+	queue_.push(std::move(marker));
+	for (uint32_t wait_count = 0; !done; ++wait_count)
+	{
+		if ((wait_count % detail::concurrency) + 1 == detail::concurrency)
+			std::this_thread::yield();
+	}
+}
+
+inline size_t async_logger::dropped() const
+{
+	return dropped_.load(std::memory_order_relaxed);
+}
+
+inline void async_logger::run()
+{
+	// One extra line is reserved in each batch for the dropped record report.
+	std::vector<char> arena((batch_size_ + 1) * detail::max_log_line);
+	std::vector<detail::io_vector> iov(batch_size_ + 1);
+
+	for (uint32_t idle_count = 0; ; )
+	{
+		size_t count = 0;
+		std::atomic_bool *flushed = nullptr;
+		while (count != batch_size_)
+		{
+			queue<record_t>::optional_t r = queue_.try_pop(0);
+			if (!r)
+				break;
+
+			if (r->format == nullptr)
+			{
+				flushed = static_cast<std::atomic_bool*>(const_cast<void*>(r->args[0].p));
+				break;
+			}
+
+			char *line = &arena[count * detail::max_log_line];
+			iov[count].iov_base = line;
+			iov[count].iov_len = format(*r, line, detail::max_log_line);
+			++count;
+		}
+
+		if (policy_ == log_full_policy::count_drops)
+		{
+			size_t dropped = dropped_.load(std::memory_order_relaxed);
+			if (dropped != reported_dropped_)
+			{
+				char *line = &arena[count * detail::max_log_line];
+				int length = std::snprintf(line, detail::max_log_line, "async_logger dropped %llu records\n", static_cast<unsigned long long>(dropped - reported_dropped_));
+				iov[count].iov_base = line;
+				iov[count].iov_len = static_cast<size_t>(std::max(length, 0));
+				++count;
+				reported_dropped_ = dropped;
+			}
+		}
+
+		if (count != 0)
+		{
+			flush_batch(iov, count);
+			idle_count = 0;
+		}
+
+		if (flushed != nullptr)
+		{
+			*flushed = true;
+			continue;
+		}
+
+		if (count == 0)
+		{
+			if (stop_ && queue_.empty())
+				return;
+
+			// Nothing to do, spin for a while before backing off to sleep so an idle logger doesn't burn a core.
+			if (++idle_count < detail::concurrency)
+				std::this_thread::yield();
+			else
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+	}
+}
+
+// Formats "<seconds>.<microseconds> <message>\n", returns the length of the line.
+inline size_t async_logger::format(record_t const &r, char *out, size_t size) const
+{
+	int64_t seconds = r.timestamp / 1000000000;
+	int64_t micros = (r.timestamp % 1000000000) / 1000;
+	int prefix = std::snprintf(out, size, "%lld.%06lld ", static_cast<long long>(seconds), static_cast<long long>(micros));
+	size_t length = prefix < 0 ? 0 : static_cast<size_t>(prefix);
+
+	// Leave room for the trailing newline.
+	size_t limit = size - 1;
+	size_t arg = 0;
+	for (char const *f = r.format; *f != '\0' && length < limit; ++f)
+	{
+		if (f[0] == '{' && f[1] == '}' && arg < r.arg_count)
+		{
+			length += detail::format_log_arg(r.types[arg], r.args[arg], out + length, limit - length + 1);
+			++arg;
+			++f;
+		}
+		else
+		{
+			out[length++] = *f;
+		}
+	}
+
+	out[length++] = '\n';
+	return length;
+}
+
+inline void async_logger::flush_batch(std::vector<detail::io_vector> &iov, size_t count)
+{
+	// There is nobody to report a failed write to from the background thread, the records are lost.
+	detail::write_vector(fd_, iov.data(), count);
+}
+
+#endif // GUARUNTEED_MPMC_ASYNC_LOGGER_HPP
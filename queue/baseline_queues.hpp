@@ -0,0 +1,256 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_BASELINE_QUEUES_HPP
+#define GUARUNTEED_MPMC_BASELINE_QUEUES_HPP
+
+
+#include "queue.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+
+// The obvious lock based bounded queues, as reference points for the benchmarks.  Both have the same interface as queue so the same scenarios
+// run against them, attempts counts failed lock acquisitions plus full/empty checks the same way queue counts failed admissions.
+
+// std::mutex + std::deque, blocking push/pop spin (and yield) while the queue is full/empty.
+template <class T>
+class locked_queue
+{
+public:
+	typedef T value_type;
+	typedef detail::optional<T> optional_t;
+
+	locked_queue(size_t);
+
+	void push(T&&);
+	bool try_push(T&, uint16_t);
+	T pop();
+	optional_t try_pop(uint16_t);
+
+	size_t size() const;
+	size_t capacity() const;
+
+private:
+	size_t capacity_;
+	mutable std::mutex mutex_;
+	std::deque<T> items_;
+};
+
+
+// std::mutex + std::condition_variable, blocking push/pop sleep while the queue is full/empty.
+template <class T>
+class blocking_queue
+{
+public:
+	typedef T value_type;
+	typedef detail::optional<T> optional_t;
+
+	blocking_queue(size_t);
+
+	void push(T&&);
+	bool try_push(T&, uint16_t);
+	T pop();
+	optional_t try_pop(uint16_t);
+
+	size_t size() const;
+	size_t capacity() const;
+
+private:
+	size_t capacity_;
+	mutable std::mutex mutex_;
+	std::condition_variable not_full_;
+	std::condition_variable not_empty_;
+	std::deque<T> items_;
+};
+
+
+template <class T>
+locked_queue<T>::locked_queue(size_t capacity) : capacity_(capacity)
+{
+	if (capacity_ == 0)
+		throw std::invalid_argument("specified capacity is zero - queue must have non zero capacity");
+}
+
+template <class T>
+void locked_queue<T>::push(T&& t)
+{
+	for (uint32_t wait_count = 0; ; ++wait_count)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (items_.size() != capacity_)
+			{
+				items_.push_back(std::move(t));
+				return;
+			}
+		}
+		if ((wait_count % detail::concurrency) + 1 == detail::concurrency)
+			std::this_thread::yield();
+	}
+}
+
+template <class T>
+bool locked_queue<T>::try_push(T &t, uint16_t attempts)
+{
+	for (uint16_t attempt = 0; ; ++attempt)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (items_.size() != capacity_)
+			{
+				items_.push_back(std::move(t));
+				return true;
+			}
+		}
+		if (attempt == attempts)
+			return false;
+	}
+}
+
+template <class T>
+T locked_queue<T>::pop()
+{
+	for (uint32_t wait_count = 0; ; ++wait_count)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!items_.empty())
+			{
+				T t(std::move(items_.front()));
+				items_.pop_front();
+				return t;
+			}
+		}
+		if ((wait_count % detail::concurrency) + 1 == detail::concurrency)
+			std::this_thread::yield();
+	}
+}
+
+template <class T>
+typename locked_queue<T>::optional_t locked_queue<T>::try_pop(uint16_t attempts)
+{
+	for (uint16_t attempt = 0; ; ++attempt)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!items_.empty())
+			{
+				optional_t ot(std::move(items_.front()));
+				items_.pop_front();
+				return ot;
+			}
+		}
+		if (attempt == attempts)
+			return optional_t();
+	}
+}
+
+template <class T>
+size_t locked_queue<T>::size() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return items_.size();
+}
+
+template <class T>
+size_t locked_queue<T>::capacity() const
+{
+	return capacity_;
+}
+
+
+template <class T>
+blocking_queue<T>::blocking_queue(size_t capacity) : capacity_(capacity)
+{
+	if (capacity_ == 0)
+		throw std::invalid_argument("specified capacity is zero - queue must have non zero capacity");
+}
+
+template <class T>
+void blocking_queue<T>::push(T&& t)
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		not_full_.wait(lock, [this]() { return items_.size() != capacity_; });
+		items_.push_back(std::move(t));
+	}
+	not_empty_.notify_one();
+}
+
+// The condition variables are never waited on by the try operations, a try operation holding the lock is its only chance.
+template <class T>
+bool blocking_queue<T>::try_push(T &t, uint16_t attempts)
+{
+	for (uint16_t attempt = 0; ; ++attempt)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (items_.size() != capacity_)
+			{
+				items_.push_back(std::move(t));
+				lock.unlock();
+				not_empty_.notify_one();
+				return true;
+			}
+		}
+		if (attempt == attempts)
+			return false;
+	}
+}
+
+template <class T>
+T blocking_queue<T>::pop()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	not_empty_.wait(lock, [this]() { return !items_.empty(); });
+	T t(std::move(items_.front()));
+	items_.pop_front();
+	lock.unlock();
+	not_full_.notify_one();
+	return t;
+}
+
+template <class T>
+typename blocking_queue<T>::optional_t blocking_queue<T>::try_pop(uint16_t attempts)
+{
+	for (uint16_t attempt = 0; ; ++attempt)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (!items_.empty())
+			{
+				optional_t ot(std::move(items_.front()));
+				items_.pop_front();
+				lock.unlock();
+				not_full_.notify_one();
+				return ot;
+			}
+		}
+		if (attempt == attempts)
+			return optional_t();
+	}
+}
+
+template <class T>
+size_t blocking_queue<T>::size() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return items_.size();
+}
+
+template <class T>
+size_t blocking_queue<T>::capacity() const
+{
+	return capacity_;
+}
+
+#endif // GUARUNTEED_MPMC_BASELINE_QUEUES_HPP
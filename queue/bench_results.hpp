@@ -0,0 +1,201 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_BENCH_RESULTS_HPP
+#define GUARUNTEED_MPMC_BENCH_RESULTS_HPP
+
+
+#include <cmath>
+#include <istream>
+#include <limits>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+// Benchmark samples per scenario, stored as text so a results file can be checked in as the baseline for later runs.  One line per scenario:
+// the scenario name (no spaces) followed by its samples in items / second, lines starting with '#' are comments.
+class bench_results
+{
+public:
+	void add(std::string const&, double);
+
+	std::map<std::string, std::vector<double>> const& scenarios() const;
+
+	void write(std::ostream&) const;
+	static bench_results read(std::istream&);
+
+private:
+	std::map<std::string, std::vector<double>> scenarios_;
+};
+
+
+struct bench_comparison
+{
+	std::string scenario;
+	double baseline_mean;
+	double current_mean;
+	double change;          // Relative change of the mean, negative is slower.
+	double p_value;         // Two sided Welch's t-test, 1 when there are too few samples to tell.
+	bool regression;
+};
+
+
+namespace detail
+{
+	// Continued fraction for the regularized incomplete beta function (modified Lentz's method).
+	inline double incomplete_beta_fraction(double a, double b, double x)
+	{
+		const double tiny = 1e-300;
+		const double epsilon = 1e-12;
+
+		double c = 1.0;
+		double d = 1.0 - (a + b) * x / (a + 1.0);
+		d = 1.0 / (std::fabs(d) < tiny ? tiny : d);
+		double h = d;
+		for (int m = 1; m != 300; ++m)
+		{
+			double m2 = 2.0 * m;
+			double numerator = m * (b - m) * x / ((a + m2 - 1.0) * (a + m2));
+			d = 1.0 + numerator * d;
+			d = 1.0 / (std::fabs(d) < tiny ? tiny : d);
+			c = 1.0 + numerator / c;
+			c = std::fabs(c) < tiny ? tiny : c;
+			h *= d * c;
+
+			numerator = -(a + m) * (a + b + m) * x / ((a + m2) * (a + m2 + 1.0));
+			d = 1.0 + numerator * d;
+			d = 1.0 / (std::fabs(d) < tiny ? tiny : d);
+			c = 1.0 + numerator / c;
+			c = std::fabs(c) < tiny ? tiny : c;
+			double delta = d * c;
+			h *= delta;
+			if (std::fabs(delta - 1.0) < epsilon)
+				break;
+		}
+		return h;
+	}
+
+	inline double incomplete_beta(double a, double b, double x)
+	{
+		if (x <= 0.0)
+			return 0.0;
+		else if (x >= 1.0)
+			return 1.0;
+
+		double front = std::exp(std::lgamma(a + b) - std::lgamma(a) - std::lgamma(b) + a * std::log(x) + b * std::log(1.0 - x));
+		if (x < (a + 1.0) / (a + b + 2.0))
+			return front * incomplete_beta_fraction(a, b, x) / a;
+		return 1.0 - front * incomplete_beta_fraction(b, a, 1.0 - x) / b;
+	}
+
+	inline void mean_variance(std::vector<double> const &samples, double &mean, double &variance)
+	{
+		mean = 0.0;
+		for (double s : samples)
+			mean += s;
+		mean /= static_cast<double>(samples.size());
+
+		variance = 0.0;
+		for (double s : samples)
+			variance += (s - mean) * (s - mean);
+		variance = samples.size() > 1 ? variance / static_cast<double>(samples.size() - 1) : 0.0;
+	}
+
+	// Two sided p-value of Welch's t-test, samples don't need equal variances or counts.
+	inline double welch_p_value(std::vector<double> const &a, std::vector<double> const &b)
+	{
+		if (a.size() < 2 || b.size() < 2)
+			return 1.0;
+
+		double mean_a, variance_a, mean_b, variance_b;
+		mean_variance(a, mean_a, variance_a);
+		mean_variance(b, mean_b, variance_b);
+
+		double va = variance_a / static_cast<double>(a.size());
+		double vb = variance_b / static_cast<double>(b.size());
+		if (va + vb == 0.0)
+			return mean_a == mean_b ? 1.0 : 0.0;
+
+		double t = (mean_a - mean_b) / std::sqrt(va + vb);
+		double df = (va + vb) * (va + vb) / (va * va / static_cast<double>(a.size() - 1) + vb * vb / static_cast<double>(b.size() - 1));
+		return incomplete_beta(df / 2.0, 0.5, df / (df + t * t));
+	}
+}
+
+
+inline void bench_results::add(std::string const &scenario, double items_per_second)
+{
+	if (scenario.empty() || scenario.find_first_of(" \t\r\n") != std::string::npos)
+		throw std::invalid_argument("scenario name must be a single non empty word");
+	scenarios_[scenario].push_back(items_per_second);
+}
+
+inline std::map<std::string, std::vector<double>> const& bench_results::scenarios() const
+{
+	return scenarios_;
+}
+
+inline void bench_results::write(std::ostream &os) const
+{
+	os << "# scenario, then samples in items / second\n";
+	os.precision(std::numeric_limits<double>::digits10);
+	for (auto const &s : scenarios_)
+	{
+		os << s.first;
+		for (double sample : s.second)
+			os << ' ' << sample;
+		os << '\n';
+	}
+}
+
+inline bench_results bench_results::read(std::istream &is)
+{
+	bench_results results;
+	std::string line;
+	while (std::getline(is, line))
+	{
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		std::istringstream fields(line);
+		std::string scenario;
+		fields >> scenario;
+		for (double sample; fields >> sample; )
+			results.add(scenario, sample);
+	}
+	return results;
+}
+
+
+// Compares every scenario present in both runs.  A scenario regressed when its mean got slower by more than min_change (relative) and the difference
+// is significant at alpha, the threshold keeps large sample counts from flagging noise sized differences.
+inline std::vector<bench_comparison> compare_results(bench_results const &baseline, bench_results const &current, double alpha = 0.05, double min_change = 0.02)
+{
+	std::vector<bench_comparison> comparisons;
+	for (auto const &c : current.scenarios())
+	{
+		auto b = baseline.scenarios().find(c.first);
+		if (b == baseline.scenarios().end())
+			continue;
+
+		double variance;
+		bench_comparison r;
+		r.scenario = c.first;
+		detail::mean_variance(b->second, r.baseline_mean, variance);
+		detail::mean_variance(c.second, r.current_mean, variance);
+		r.change = r.baseline_mean != 0.0 ? (r.current_mean - r.baseline_mean) / r.baseline_mean : 0.0;
+		r.p_value = detail::welch_p_value(b->second, c.second);
+		r.regression = r.change < -min_change && r.p_value < alpha;
+		comparisons.push_back(r);
+	}
+	return comparisons;
+}
+
+#endif // GUARUNTEED_MPMC_BENCH_RESULTS_HPP
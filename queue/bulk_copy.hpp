@@ -0,0 +1,242 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_BULK_COPY_HPP
+#define GUARUNTEED_MPMC_BULK_COPY_HPP
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))) || (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86)))
+#include <immintrin.h>
+#define GUARUNTEED_MPMC_BULK_COPY_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+// msvc has the AVX-512 intrinsics from VS2017 15.3, earlier versions fall back to AVX2.
+#if defined(__GNUC__) || _MSC_VER >= 1911
+#define GUARUNTEED_MPMC_BULK_COPY_AVX512
+#endif
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define GUARUNTEED_MPMC_BULK_COPY_NEON
+#endif
+
+// Lets a kernel use instructions the rest of the build doesn't assume, msvc takes the intrinsics without it.
+#if defined(__GNUC__)
+#define GUARUNTEED_MPMC_TARGET(isa) __attribute__((target(isa)))
+#else
+#define GUARUNTEED_MPMC_TARGET(isa)
+#endif
+
+
+// Copy kernels for the batch operations of trivially copyable items, which the queue keeps as a plain array of T.  A batch is at most two runs of
+// the buffer (it can wrap), each copied with a loop of the widest vector loads and stores and one overlapping vector for the tail instead of a
+// byte loop.  On x86 the widest of AVX-512, AVX2 and SSE2 is picked at run time on first use, NEON is the baseline on ARM where it is present.
+
+enum class bulk_copy_isa
+{
+	generic,
+	sse2,
+	neon,
+	avx2,
+	avx512
+};
+
+
+namespace detail
+{
+	typedef void (*bulk_copy_kernel)(char*, char const*, size_t);
+
+	inline bulk_copy_isa detect_bulk_copy_isa()
+	{
+#if defined(GUARUNTEED_MPMC_BULK_COPY_X86) && defined(__GNUC__)
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+			return bulk_copy_isa::avx512;
+		else if (__builtin_cpu_supports("avx2"))
+			return bulk_copy_isa::avx2;
+		else if (__builtin_cpu_supports("sse2"))
+			return bulk_copy_isa::sse2;
+		return bulk_copy_isa::generic;
+#elif defined(GUARUNTEED_MPMC_BULK_COPY_X86)
+		// The CPU has to support the instructions and the OS has to save the registers (XCR0) they use.
+		int info[4];
+		__cpuid(info, 1);
+		if ((info[2] & (1 << 27)) == 0)
+			return (info[3] & (1 << 26)) != 0 ? bulk_copy_isa::sse2 : bulk_copy_isa::generic;
+		unsigned long long xcr0 = _xgetbv(0);
+		__cpuidex(info, 7, 0);
+#if defined(GUARUNTEED_MPMC_BULK_COPY_AVX512)
+		if ((info[1] & (1 << 16)) != 0 && (xcr0 & 0xe6) == 0xe6)
+			return bulk_copy_isa::avx512;
+#endif
+		if ((info[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6)
+			return bulk_copy_isa::avx2;
+		return bulk_copy_isa::sse2;
+#elif defined(GUARUNTEED_MPMC_BULK_COPY_NEON)
+		return bulk_copy_isa::neon;
+#else
+		return bulk_copy_isa::generic;
+#endif
+	}
+
+	inline bulk_copy_isa selected_bulk_copy_isa()
+	{
+		static const bulk_copy_isa isa = detect_bulk_copy_isa();
+		return isa;
+	}
+
+	inline void copy_bytes_generic(char *d, char const *s, size_t size)
+	{
+		std::memcpy(d, s, size);
+	}
+
+	// Runs shorter than a vector, what every kernel ends up with for a few small items.
+	inline void copy_short(char *d, char const *s, size_t size)
+	{
+		if (size >= 8)
+		{
+			uint64_t head, tail;
+			std::memcpy(&head, s, 8);
+			std::memcpy(&tail, s + size - 8, 8);
+			std::memcpy(d, &head, 8);
+			std::memcpy(d + size - 8, &tail, 8);
+		}
+		else
+		{
+			std::memcpy(d, s, size);
+		}
+	}
+
+#if defined(GUARUNTEED_MPMC_BULK_COPY_X86)
+	GUARUNTEED_MPMC_TARGET("sse2") inline void copy_bytes_sse2(char *d, char const *s, size_t size)
+	{
+		if (size < 16)
+			return copy_short(d, s, size);
+		for (size_t i = 0; i + 16 < size; i += 16)
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), _mm_loadu_si128(reinterpret_cast<__m128i const*>(s + i)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(d + size - 16), _mm_loadu_si128(reinterpret_cast<__m128i const*>(s + size - 16)));
+	}
+
+	GUARUNTEED_MPMC_TARGET("avx2") inline void copy_bytes_avx2(char *d, char const *s, size_t size)
+	{
+		if (size < 32)
+			return copy_bytes_sse2(d, s, size);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(d), _mm256_loadu_si256(reinterpret_cast<__m256i const*>(s)));
+		size_t i = 32 - reinterpret_cast<uintptr_t>(d) % 32;
+		for (; i + 128 <= size; i += 128)
+		{
+			__m256i v0 = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(s + i));
+			__m256i v1 = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(s + i + 32));
+			__m256i v2 = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(s + i + 64));
+			__m256i v3 = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(s + i + 96));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i), v0);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i + 32), v1);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i + 64), v2);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i + 96), v3);
+		}
+		for (; i + 32 < size; i += 32)
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i), _mm256_loadu_si256(reinterpret_cast<__m256i const*>(s + i)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(d + size - 32), _mm256_loadu_si256(reinterpret_cast<__m256i const*>(s + size - 32)));
+	}
+
+#if defined(GUARUNTEED_MPMC_BULK_COPY_AVX512)
+	GUARUNTEED_MPMC_TARGET("avx512f") inline void copy_bytes_avx512(char *d, char const *s, size_t size)
+	{
+		if (size < 64)
+			return copy_bytes_avx2(d, s, size);
+		// One unaligned vector for the head, the rest of the stores aligned so none of them splits a cache line.
+		_mm512_storeu_si512(d, _mm512_loadu_si512(s));
+		size_t i = 64 - reinterpret_cast<uintptr_t>(d) % 64;
+		for (; i + 256 <= size; i += 256)
+		{
+			__m512i v0 = _mm512_loadu_si512(s + i);
+			__m512i v1 = _mm512_loadu_si512(s + i + 64);
+			__m512i v2 = _mm512_loadu_si512(s + i + 128);
+			__m512i v3 = _mm512_loadu_si512(s + i + 192);
+			_mm512_storeu_si512(d + i, v0);
+			_mm512_storeu_si512(d + i + 64, v1);
+			_mm512_storeu_si512(d + i + 128, v2);
+			_mm512_storeu_si512(d + i + 192, v3);
+		}
+		for (; i + 64 < size; i += 64)
+			_mm512_storeu_si512(d + i, _mm512_loadu_si512(s + i));
+		_mm512_storeu_si512(d + size - 64, _mm512_loadu_si512(s + size - 64));
+	}
+#endif
+#endif
+
+#if defined(GUARUNTEED_MPMC_BULK_COPY_NEON)
+	inline void copy_bytes_neon(char *d, char const *s, size_t size)
+	{
+		if (size < 16)
+			return copy_short(d, s, size);
+		for (size_t i = 0; i + 16 < size; i += 16)
+			vst1q_u8(reinterpret_cast<uint8_t*>(d + i), vld1q_u8(reinterpret_cast<uint8_t const*>(s + i)));
+		vst1q_u8(reinterpret_cast<uint8_t*>(d + size - 16), vld1q_u8(reinterpret_cast<uint8_t const*>(s + size - 16)));
+	}
+#endif
+
+	inline bulk_copy_kernel select_bulk_copy_kernel()
+	{
+		switch (selected_bulk_copy_isa())
+		{
+#if defined(GUARUNTEED_MPMC_BULK_COPY_AVX512)
+		case bulk_copy_isa::avx512:
+			return &copy_bytes_avx512;
+#endif
+#if defined(GUARUNTEED_MPMC_BULK_COPY_X86)
+		case bulk_copy_isa::avx2:
+			return &copy_bytes_avx2;
+		case bulk_copy_isa::sse2:
+			return &copy_bytes_sse2;
+#endif
+#if defined(GUARUNTEED_MPMC_BULK_COPY_NEON)
+		case bulk_copy_isa::neon:
+			return &copy_bytes_neon;
+#endif
+		default:
+			return &copy_bytes_generic;
+		}
+	}
+
+	// Copies count items of a trivially copyable T, source and destination don't overlap.
+	template <class T>
+	inline void copy_items(T *destination, T const *source, size_t count)
+	{
+		static const bulk_copy_kernel kernel = select_bulk_copy_kernel();
+		kernel(reinterpret_cast<char*>(destination), reinterpret_cast<char const*>(source), count * sizeof(T));
+	}
+}
+
+
+inline char const* bulk_copy_isa_name(bulk_copy_isa isa)
+{
+	switch (isa)
+	{
+	case bulk_copy_isa::sse2:
+		return "SSE2";
+	case bulk_copy_isa::neon:
+		return "NEON";
+	case bulk_copy_isa::avx2:
+		return "AVX2";
+	case bulk_copy_isa::avx512:
+		return "AVX-512";
+	default:
+		return "generic";
+	}
+}
+
+// The kernels the batch operations use on this CPU.
+inline bulk_copy_isa bulk_copy_selected_isa()
+{
+	return detail::selected_bulk_copy_isa();
+}
+
+#endif // GUARUNTEED_MPMC_BULK_COPY_HPP
@@ -0,0 +1,310 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_FLAT_COMBINING_QUEUE_HPP
+#define GUARUNTEED_MPMC_FLAT_COMBINING_QUEUE_HPP
+
+
+#include "queue.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+
+// Bounded MPMC queue built by flat combining, for very high contention on small items.  A thread publishes its push or pop in its own record (a
+// cache line) and one thread at a time, the combiner, applies every published request to a plain ring: no atomic read-modify-write and no shared
+// counter per item, just a load of each record and a store when its request is done.  Whichever waiting thread takes the combiner lock next does
+// the next round, so the cost of the lock and of moving the ring's lines between cores is paid once per batch rather than once per item.
+//
+// A record per thread, claimed with a compare exchange on the thread's own record (threads are spread over the records in the order they first
+// use a queue, more threads than records share them).  A blocking push or pop that can't be satisfied stays published until a later round can,
+// a try operation fails in the round that finds the queue full or empty.  The combiner goes over the records in order, so the queue is FIFO per
+// producer but requests are served in record order within a round rather than in arrival order.
+template <class T, class Traits = detail::queue_traits<>>
+class flat_combining_queue
+{
+public:
+
+	typedef T value_type;
+	typedef detail::optional<T> optional_t;
+
+	// records is the number of threads that can have a request published at once.
+	flat_combining_queue(size_t, size_t = 256);
+
+	void push(T&&);
+	bool try_push(T&, uint16_t);
+	T pop();
+	optional_t try_pop(uint16_t);
+
+	size_t size() const;
+	size_t empty() const;
+	size_t capacity() const;
+
+	// Combining rounds that applied a request and the requests they applied, their ratio is the batch a round amortizes the lock over (a waiting
+	// pop also combines while the queue is empty, those rounds aren't counted).
+	uint64_t rounds() const;
+	uint64_t combined() const;
+
+private:
+	enum request : uint32_t
+	{
+		free_record,
+		idle,
+		push_request,
+		try_push_request,
+		pop_request,
+		try_pop_request,
+		done,
+		failed
+	};
+
+	struct record
+	{
+		alignas(Traits::cache_line_size) std::atomic<uint32_t> state{ free_record };
+		optional_t value;
+	};
+
+	size_t claim();
+	bool apply(size_t, request);
+	void combine();
+
+	std::vector<record, detail::aligned_allocator<record>> records_;
+	size_t record_count_;
+
+	// One past the highest record ever claimed, how far the combiner looks.
+	alignas(Traits::cache_line_size) std::atomic_size_t used_records_;
+
+	alignas(Traits::cache_line_size) std::atomic_bool combining_;
+
+	// Only touched by the combiner.
+	alignas(Traits::cache_line_size) std::vector<optional_t> buffer_;
+	size_t front_;
+	size_t back_;
+
+	// Written by the combiner (plain stores), read by anyone.
+	std::atomic_size_t size_;
+	std::atomic<uint64_t> rounds_;
+	std::atomic<uint64_t> combined_;
+};
+
+
+template <class T, class Traits>
+flat_combining_queue<T, Traits>::flat_combining_queue(size_t capacity, size_t record_count)
+	: records_(record_count), record_count_(record_count), used_records_(0), combining_(false), front_(0), back_(0), size_(0), rounds_(0), combined_(0)
+{
+	capacity = detail::queue_size<size_t>::round_up_to_power_of_2(capacity);
+	if (capacity > detail::queue_size<size_t>::max_capacity)
+		throw std::invalid_argument("specified capacity is larger than max allowable capacity of queue");
+	else if (capacity == 0)
+		throw std::invalid_argument("specified capacity is zero - queue must have non zero capacity");
+	else if (record_count == 0)
+		throw std::invalid_argument("specified record count is zero - a thread needs a record to publish requests");
+
+	buffer_.resize(capacity);
+}
+
+template <class T, class Traits>
+void flat_combining_queue<T, Traits>::push(T&& t)
+{
+	size_t index = claim();
+	record &r = records_[index];
+	r.value = std::move(t);
+	apply(index, push_request);
+	r.state.store(free_record, std::memory_order_release);
+}
+
+template <class T, class Traits>
+bool flat_combining_queue<T, Traits>::try_push(T &t, uint16_t attempts)
+{
+	size_t index = claim();
+	record &r = records_[index];
+	bool pushed = false;
+	for (uint16_t attempt = 0; !pushed && attempt <= attempts; ++attempt)
+	{
+		r.value = std::move(t);
+		pushed = apply(index, try_push_request);
+		if (!pushed)
+			t = r.value.release(); // Left in the record by the round that found the queue full.
+	}
+	r.state.store(free_record, std::memory_order_release);
+	return pushed;
+}
+
+template <class T, class Traits>
+T flat_combining_queue<T, Traits>::pop()
+{
+	size_t index = claim();
+	record &r = records_[index];
+	apply(index, pop_request);
+	T t = r.value.release();
+	r.state.store(free_record, std::memory_order_release);
+	return t;
+}
+
+template <class T, class Traits>
+typename flat_combining_queue<T, Traits>::optional_t flat_combining_queue<T, Traits>::try_pop(uint16_t attempts)
+{
+	size_t index = claim();
+	record &r = records_[index];
+	optional_t ot;
+	for (uint16_t attempt = 0; attempt <= attempts; ++attempt)
+	{
+		if (apply(index, try_pop_request))
+		{
+			ot = r.value.release();
+			break;
+		}
+	}
+	r.state.store(free_record, std::memory_order_release);
+	return ot;
+}
+
+template <class T, class Traits>
+size_t flat_combining_queue<T, Traits>::size() const
+{
+	return size_.load(std::memory_order_relaxed);
+}
+
+template <class T, class Traits>
+size_t flat_combining_queue<T, Traits>::empty() const
+{
+	return size() == 0;
+}
+
+template <class T, class Traits>
+size_t flat_combining_queue<T, Traits>::capacity() const
+{
+	return buffer_.size();
+}
+
+template <class T, class Traits>
+uint64_t flat_combining_queue<T, Traits>::rounds() const
+{
+	return rounds_.load(std::memory_order_relaxed);
+}
+
+template <class T, class Traits>
+uint64_t flat_combining_queue<T, Traits>::combined() const
+{
+	return combined_.load(std::memory_order_relaxed);
+}
+
+// Claims the calling thread's record (or the next free one after it), returns its index with the record idle.
+template <class T, class Traits>
+size_t flat_combining_queue<T, Traits>::claim()
+{
+	static std::atomic<size_t> next_thread(0);
+	static thread_local size_t thread_index = next_thread.fetch_add(1);
+
+	for (uint32_t wait_count = 0; ; ++wait_count)
+	{
+		for (size_t i = 0; i != record_count_; ++i)
+		{
+			size_t index = (thread_index + i) % record_count_;
+			uint32_t state = free_record;
+			if (records_[index].state.load(std::memory_order_relaxed) == free_record && records_[index].state.compare_exchange_strong(state, idle, std::memory_order_acquire))
+			{
+				// Let the combiner see this far.
+				for (size_t used = used_records_.load(std::memory_order_relaxed); used <= index && !used_records_.compare_exchange_weak(used, index + 1); )
+				{
+				}
+				return index;
+			}
+		}
+		if ((wait_count % Traits::concurrency) + 1 == Traits::concurrency)
+			std::this_thread::yield(); // Deal with oversubscription...
+	}
+}
+
+// Publishes a request in the claimed record and waits for a round to apply it, combining whenever no one else is.  Returns whether it was
+// applied, only a try request fails.  The caller still owns the record (to take a popped value) and frees it.
+template <class T, class Traits>
+bool flat_combining_queue<T, Traits>::apply(size_t index, request r)
+{
+	record &rec = records_[index];
+	rec.state.store(r, std::memory_order_release);
+
+	for (uint32_t wait_count = 0; ; ++wait_count)
+	{
+		uint32_t state = rec.state.load(std::memory_order_acquire);
+		if (state == done || state == failed)
+			return state == done;
+
+		if (!combining_.load(std::memory_order_relaxed) && !combining_.exchange(true, std::memory_order_acquire))
+		{
+			combine();
+			combining_.store(false, std::memory_order_release);
+			continue;
+		}
+		if ((wait_count % Traits::concurrency) + 1 == Traits::concurrency)
+			std::this_thread::yield(); // Deal with oversubscription...
+	}
+}
+
+// One combining round, a few passes over the records while they keep turning up requests.  Pops of the same round can make room for pushes
+// further on, and the other way round, hence more than one pass.
+template <class T, class Traits>
+void flat_combining_queue<T, Traits>::combine()
+{
+	size_t const mask = buffer_.size() - 1;
+	size_t used = used_records_.load(std::memory_order_acquire);
+	uint64_t applied = 0;
+
+	for (int pass = 0; pass != 3; ++pass)
+	{
+		uint64_t applied_in_pass = 0;
+		for (size_t i = 0; i != used; ++i)
+		{
+			record &rec = records_[i];
+			uint32_t state = rec.state.load(std::memory_order_acquire);
+			if (state == push_request || state == try_push_request)
+			{
+				if (back_ - front_ != buffer_.size())
+				{
+					buffer_[back_ & mask] = rec.value.release();
+					++back_;
+					rec.state.store(done, std::memory_order_release);
+					++applied_in_pass;
+				}
+				else if (state == try_push_request)
+				{
+					rec.state.store(failed, std::memory_order_release);
+				}
+			}
+			else if (state == pop_request || state == try_pop_request)
+			{
+				if (back_ != front_)
+				{
+					rec.value = buffer_[front_ & mask].release();
+					++front_;
+					rec.state.store(done, std::memory_order_release);
+					++applied_in_pass;
+				}
+				else if (state == try_pop_request)
+				{
+					rec.state.store(failed, std::memory_order_release);
+				}
+			}
+		}
+		applied += applied_in_pass;
+		if (applied_in_pass == 0)
+			break;
+	}
+
+	if (applied == 0)
+		return;
+	size_.store(back_ - front_, std::memory_order_relaxed);
+	rounds_.store(rounds_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	combined_.store(combined_.load(std::memory_order_relaxed) + applied, std::memory_order_relaxed);
+}
+
+#endif // GUARUNTEED_MPMC_FLAT_COMBINING_QUEUE_HPP
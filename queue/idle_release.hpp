@@ -0,0 +1,122 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_IDLE_RELEASE_HPP
+#define GUARUNTEED_MPMC_IDLE_RELEASE_HPP
+
+
+#include "queue.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+
+// When a queue counts as idle: its size sampled every sample_interval stayed at or below capacity * occupancy for idle_samples samples in a row.
+struct idle_release_policy
+{
+	std::chrono::milliseconds sample_interval = std::chrono::milliseconds(100);
+	size_t idle_samples = 50;
+	double occupancy = 1.0 / 16.0;
+};
+
+
+// Opt in release of an oversized queue's memory after a burst.  A background thread samples the queue's size (the hot paths are untouched) and
+// calls release_idle_memory once the queue has been idle per the policy.  It releases once per idle period, the queue has to be busier than the
+// threshold again before the next release.  While a release runs the queue takes no pushes, try_push fails and push waits as though it were
+// full (size() still reports the items in it).  The queue must outlive the releaser, and only one releaser may run per queue.
+template <class Queue>
+class idle_memory_releaser
+{
+public:
+	idle_memory_releaser(Queue&, idle_release_policy = idle_release_policy());
+	~idle_memory_releaser();
+
+	idle_memory_releaser(idle_memory_releaser const&) = delete;
+	idle_memory_releaser& operator=(idle_memory_releaser const&) = delete;
+
+	// Bytes returned to the system so far, and the number of releases.
+	size_t released_bytes() const;
+	size_t releases() const;
+
+private:
+	void run();
+
+	Queue &queue_;
+	idle_release_policy policy_;
+
+	std::atomic_size_t released_bytes_;
+	std::atomic_size_t releases_;
+
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	bool stop_;
+
+	std::thread worker_;
+};
+
+
+template <class Queue>
+idle_memory_releaser<Queue>::idle_memory_releaser(Queue &q, idle_release_policy policy)
+	: queue_(q), policy_(policy), released_bytes_(0), releases_(0), stop_(false)
+{
+	if (policy_.idle_samples == 0)
+		throw std::invalid_argument("specified idle samples is zero - a queue must be sampled idle at least once");
+
+	worker_ = std::thread(&idle_memory_releaser::run, this);
+}
+
+template <class Queue>
+idle_memory_releaser<Queue>::~idle_memory_releaser()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	wake_.notify_one();
+	worker_.join();
+}
+
+template <class Queue>
+size_t idle_memory_releaser<Queue>::released_bytes() const
+{
+	return released_bytes_;
+}
+
+template <class Queue>
+size_t idle_memory_releaser<Queue>::releases() const
+{
+	return releases_;
+}
+
+template <class Queue>
+void idle_memory_releaser<Queue>::run()
+{
+	size_t threshold = static_cast<size_t>(static_cast<double>(queue_.capacity()) * policy_.occupancy);
+	size_t idle_count = 0;
+	bool released = false;
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (!wake_.wait_for(lock, policy_.sample_interval, [this]() { return stop_; }))
+	{
+		if (queue_.size() > threshold)
+		{
+			idle_count = 0;
+			released = false;
+		}
+		else if (!released && ++idle_count >= policy_.idle_samples)
+		{
+			released_bytes_ += queue_.release_idle_memory();
+			++releases_;
+			released = true;
+		}
+	}
+}
+
+#endif // GUARUNTEED_MPMC_IDLE_RELEASE_HPP
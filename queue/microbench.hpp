@@ -0,0 +1,214 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_MICROBENCH_HPP
+#define GUARUNTEED_MPMC_MICROBENCH_HPP
+
+
+#include "queue_adapter.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+// Single thread, uncontended cost of queue operations, in time stamp counter cycles per operation.  The time stamp counter ticks at a constant
+// rate rather than the core clock, so it is cycles at the nominal frequency.  Where there is no time stamp counter nanoseconds stand in for cycles.
+
+enum class micro_scenario
+{
+	push_pop,           // Push one then pop it, the queue never holds more than one item.
+	alternating,        // Push and pop alternately with the queue half full, so operations walk the whole buffer.
+	fill_drain,         // Push until full, then pop until empty.
+	empty_try_pop       // try_pop (no retries) on an empty queue.
+};
+
+struct micro_result
+{
+	double cycles_per_op;
+	double rmw_per_op;      // Negative when the implementation doesn't count its read-modify-writes (or counting is compiled out).
+};
+
+// Payload of a given size, constructible from the size_t the scenarios push and converting back to it for the checks.
+template <size_t Bytes>
+struct micro_payload
+{
+	static_assert(Bytes >= sizeof(size_t) && Bytes % sizeof(size_t) == 0, "payload must be a whole number of size_t");
+
+	micro_payload() {}
+	micro_payload(size_t v)
+	{
+		for (size_t &w : words)
+			w = v;
+	}
+
+	explicit operator size_t() const
+	{
+		return words[0];
+	}
+
+	size_t words[Bytes / sizeof(size_t)];
+};
+
+
+namespace detail
+{
+	inline uint64_t read_cycle_counter()
+	{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		return __rdtsc();
+#elif defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+	}
+
+#if defined(GUARUNTEED_MPMC_COUNT_RMW)
+	static const bool counting_rmw = true;
+#else
+	static const bool counting_rmw = false;
+#endif
+
+	inline uint64_t rmw_counter()
+	{
+#if defined(GUARUNTEED_MPMC_COUNT_RMW)
+		return rmw_count();
+#else
+		return 0;
+#endif
+	}
+
+	// Keeps the compiler from discarding popped values.
+	static volatile unsigned char micro_sink = 0;
+
+	template <class T>
+	inline void micro_consume(T const &t)
+	{
+		micro_sink = reinterpret_cast<unsigned char const&>(t);
+	}
+
+	struct micro_pass_result
+	{
+		uint64_t cycles;
+		uint64_t ops;
+		uint64_t rmw;
+	};
+
+	// One timed pass, set up and tear down (filling the queue half way for alternating) are outside the timed and counted part.
+	template <class Queue>
+	micro_pass_result micro_pass(Queue &q, micro_scenario scenario, size_t capacity, size_t iterations)
+	{
+		typedef queue_adapter<Queue> adapter;
+		typedef typename adapter::value_type value_type;
+
+		// Queues split into lanes block a single thread once its own lane is full.
+		capacity = adapter::single_thread_capacity(q, capacity);
+
+		value_type v(0);
+		micro_pass_result r = {};
+		uint64_t t0 = 0;
+		uint64_t t1 = 0;
+		uint64_t rmw0 = 0;
+		uint64_t rmw1 = 0;
+		switch (scenario)
+		{
+		case micro_scenario::push_pop:
+			rmw0 = rmw_counter();
+			t0 = read_cycle_counter();
+			for (size_t i = 0; i != iterations; ++i)
+			{
+				adapter::push(q, value_type(i));
+				micro_consume(adapter::pop(q));
+			}
+			t1 = read_cycle_counter();
+			rmw1 = rmw_counter();
+			r.ops = 2 * iterations;
+			break;
+
+		case micro_scenario::alternating:
+			for (size_t i = 0; i != capacity / 2; ++i)
+				adapter::push(q, value_type(i));
+			rmw0 = rmw_counter();
+			t0 = read_cycle_counter();
+			for (size_t i = 0; i != iterations; ++i)
+			{
+				adapter::push(q, value_type(i));
+				micro_consume(adapter::pop(q));
+			}
+			t1 = read_cycle_counter();
+			rmw1 = rmw_counter();
+			for (size_t i = 0; i != capacity / 2; ++i)
+				adapter::pop(q);
+			r.ops = 2 * iterations;
+			break;
+
+		case micro_scenario::fill_drain:
+			rmw0 = rmw_counter();
+			t0 = read_cycle_counter();
+			for (size_t i = 0; i != capacity; ++i)
+				adapter::push(q, value_type(i));
+			for (size_t i = 0; i != capacity; ++i)
+				micro_consume(adapter::pop(q));
+			t1 = read_cycle_counter();
+			rmw1 = rmw_counter();
+			r.ops = 2 * capacity;
+			break;
+
+		case micro_scenario::empty_try_pop:
+			rmw0 = rmw_counter();
+			t0 = read_cycle_counter();
+			for (size_t i = 0; i != iterations; ++i)
+			{
+				if (adapter::try_pop(q, v, 0))
+					micro_consume(v);
+			}
+			t1 = read_cycle_counter();
+			rmw1 = rmw_counter();
+			r.ops = iterations;
+			break;
+		}
+		r.cycles = t1 - t0;
+		r.rmw = rmw1 - rmw0;
+		return r;
+	}
+}
+
+
+// Runs a scenario for repetitions passes after a warm up pass, the cycles per operation are the median over the passes.  Capacity is what the
+// queue was constructed with (fill_drain fills it, alternating keeps it half full, both only as far as one thread can fill it).
+template <class Queue>
+micro_result run_micro(micro_scenario scenario, size_t capacity, size_t iterations = 100000, size_t repetitions = 9)
+{
+	Queue q(capacity);
+	detail::micro_pass(q, scenario, capacity, iterations);
+
+	std::vector<double> cycles;
+	uint64_t ops = 0;
+	uint64_t rmw = 0;
+	for (size_t i = 0; i != repetitions; ++i)
+	{
+		detail::micro_pass_result pass = detail::micro_pass(q, scenario, capacity, iterations);
+		cycles.push_back(static_cast<double>(pass.cycles) / static_cast<double>(pass.ops));
+		ops += pass.ops;
+		rmw += pass.rmw;
+	}
+	std::sort(cycles.begin(), cycles.end());
+
+	micro_result r;
+	r.cycles_per_op = cycles[cycles.size() / 2];
+	r.rmw_per_op = queue_adapter<Queue>::counts_rmw && detail::counting_rmw ? static_cast<double>(rmw) / static_cast<double>(ops) : -1.0;
+	return r;
+}
+
+#endif // GUARUNTEED_MPMC_MICROBENCH_HPP
@@ -0,0 +1,419 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_NUMA_QUEUE_HPP
+#define GUARUNTEED_MPMC_NUMA_QUEUE_HPP
+
+
+#include "queue.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+
+namespace detail
+{
+	// The NUMA nodes with CPUs, numbered densely in the order of their ids, and the node of each CPU.  A single node where there is no topology
+	// to read.
+	struct numa_topology
+	{
+		std::vector<std::vector<int>> node_cpus;
+		std::vector<uint32_t> cpu_node;
+	};
+
+	// A sysfs cpulist, such as "0-3,8-11".
+	inline std::vector<int> parse_cpu_list(std::string const &list)
+	{
+		std::vector<int> cpus;
+		std::istringstream is(list);
+		std::string range;
+		while (std::getline(is, range, ','))
+		{
+			int first = 0, last = 0;
+			int fields = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+			if (fields == 1)
+				last = first;
+			for (int cpu = first; fields >= 1 && cpu <= last; ++cpu)
+				cpus.push_back(cpu);
+		}
+		return cpus;
+	}
+
+	inline numa_topology read_numa_topology()
+	{
+		numa_topology topology;
+#if defined(__linux__)
+		std::vector<int> ids;
+		if (DIR *dir = opendir("/sys/devices/system/node"))
+		{
+			while (dirent *entry = readdir(dir))
+			{
+				int id;
+				char rest;
+				if (std::sscanf(entry->d_name, "node%d%c", &id, &rest) == 1)
+					ids.push_back(id);
+			}
+			closedir(dir);
+		}
+		std::sort(begin(ids), end(ids));
+
+		// Memory only nodes have no CPUs, and so no threads to serve.
+		for (int id : ids)
+		{
+			std::ifstream is("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+			std::string list;
+			std::getline(is, list);
+			std::vector<int> cpus = parse_cpu_list(list);
+			if (cpus.empty())
+				continue;
+			for (int cpu : cpus)
+			{
+				if (static_cast<size_t>(cpu) >= topology.cpu_node.size())
+					topology.cpu_node.resize(cpu + 1, 0);
+				topology.cpu_node[cpu] = static_cast<uint32_t>(topology.node_cpus.size());
+			}
+			topology.node_cpus.push_back(std::move(cpus));
+		}
+#endif
+		if (topology.node_cpus.empty())
+			topology.node_cpus.resize(1);
+		return topology;
+	}
+
+	inline numa_topology const& numa_nodes()
+	{
+		static const numa_topology topology = read_numa_topology();
+		return topology;
+	}
+}
+
+
+// Bounded MPMC queue split into a queue per NUMA node, so the control counters (and slots) a producer and consumer on the same node share stay
+// in that node's caches.  A push goes to its own node's queue.  A pop takes from its own node's queue, and only when that is empty moves a batch
+// from another node: one try_pop_batch on the remote queue, one item for the caller and the rest into its own node's queue, so the pops after it
+// are local again.  Cross node traffic is then one batch rather than a transfer of the remote control lines per item.  The batch is limited to
+// the room in the local queue, and if producers fill it anyway the surplus waits in the node's spill list rather than for room, a pop never
+// waits on a push.  Pops take from their node's spill list before its queue, and steal from other nodes' spill lists before their queues.
+//
+// Each node's queue is allocated from a thread bound to that node's CPUs, so it is first touched (and placed) there.  A push blocks while its
+// own node's queue is full, consumers on the other nodes make room by taking batches.  Items are FIFO within a node but there is no order between
+// nodes, or for the items of a batch that was moved.
+template <class T, class Traits = detail::queue_traits<>>
+class numa_queue
+{
+public:
+
+	typedef T value_type;
+	typedef detail::optional<T> optional_t;
+
+	// 0 nodes is the machine's.  Any other number simulates that many nodes by spreading threads over them in the order they first use a queue,
+	// for trying the queue out on a single node machine.
+	numa_queue(size_t, size_t = 0, size_t = 32);
+
+	void push(T&&);
+	bool try_push(T&, uint16_t);
+	T pop();
+	optional_t try_pop(uint16_t);
+
+	size_t size() const;
+	size_t empty() const;
+	size_t capacity() const;
+
+	size_t node_count() const;
+	size_t node_capacity() const;
+	uint64_t steals() const;
+	uint64_t stolen_items() const;
+
+private:
+	typedef queue<T, Traits> ring_t;
+
+	struct node
+	{
+		detail::aligned_ptr<ring_t> local;
+
+		// Stolen items that didn't fit in local, under spill_mutex.  spill_size lets pops pass an empty list without the lock.
+		alignas(Traits::cache_line_size) std::atomic_size_t spill_size{ 0 };
+		std::mutex spill_mutex;
+		std::deque<T> spill;
+
+		// Batches (and the items in them) the node's consumers moved from other nodes.
+		alignas(Traits::cache_line_size) std::atomic<uint64_t> steals{ 0 };
+		std::atomic<uint64_t> stolen_items{ 0 };
+	};
+
+	size_t current_node() const;
+	bool try_pop_once(optional_t&);
+	bool take_spill(node&, optional_t&);
+	bool steal(size_t, optional_t&);
+
+	bool simulated_;
+	size_t steal_batch_;
+	std::vector<detail::aligned_ptr<node>> nodes_;
+};
+
+
+template <class T, class Traits>
+numa_queue<T, Traits>::numa_queue(size_t capacity, size_t node_count, size_t steal_batch) : simulated_(false), steal_batch_(steal_batch)
+{
+	detail::numa_topology const &topology = detail::numa_nodes();
+	simulated_ = node_count != 0 && node_count != topology.node_cpus.size();
+	if (node_count == 0)
+		node_count = topology.node_cpus.size();
+
+	if (capacity == 0)
+		throw std::invalid_argument("specified capacity is zero - queue must have non zero capacity");
+	else if (steal_batch == 0)
+		throw std::invalid_argument("specified steal batch is zero - a steal must move at least one item");
+
+	size_t node_capacity = (capacity + node_count - 1) / node_count;
+	for (size_t i = 0; i != node_count; ++i)
+	{
+		nodes_.emplace_back();
+		auto allocate = [&]()
+		{
+			nodes_.back() = detail::make_aligned<node>();
+			nodes_.back()->local = detail::make_aligned<ring_t>(node_capacity);
+		};
+
+#if defined(__linux__)
+		if (!simulated_ && node_count > 1)
+		{
+			std::exception_ptr error;
+			std::thread([&]()
+			{
+				cpu_set_t set;
+				CPU_ZERO(&set);
+				for (int cpu : topology.node_cpus[i])
+					CPU_SET(cpu, &set);
+				pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+				try
+				{
+					allocate();
+				}
+				catch (...)
+				{
+					error = std::current_exception();
+				}
+			}).join();
+			if (error)
+				std::rethrow_exception(error);
+			continue;
+		}
+#endif
+		allocate();
+	}
+}
+
+template <class T, class Traits>
+void numa_queue<T, Traits>::push(T&& t)
+{
+	// Wait while the node's queue is full.
+	ring_t &local = *nodes_[current_node()]->local;
+	for (uint32_t wait_count = 0; !local.try_push(t, 0); ++wait_count)
+	{
+		if ((wait_count % Traits::concurrency) + 1 == Traits::concurrency)
+			std::this_thread::yield(); // Deal with oversubscription...
+	}
+}
+
+template <class T, class Traits>
+bool numa_queue<T, Traits>::try_push(T &t, uint16_t attempts)
+{
+	return nodes_[current_node()]->local->try_push(t, attempts);
+}
+
+template <class T, class Traits>
+T numa_queue<T, Traits>::pop()
+{
+	// Wait while every node is empty.
+	optional_t ot;
+	for (uint32_t wait_count = 0; !try_pop_once(ot); ++wait_count)
+	{
+		if ((wait_count % Traits::concurrency) + 1 == Traits::concurrency)
+			std::this_thread::yield(); // Deal with oversubscription...
+	}
+	return ot.release();
+}
+
+// An attempt is the node's own queue then the others.
+template <class T, class Traits>
+typename numa_queue<T, Traits>::optional_t numa_queue<T, Traits>::try_pop(uint16_t attempts)
+{
+	optional_t ot;
+	for (uint16_t attempt = 0; !try_pop_once(ot); ++attempt)
+	{
+		if (attempt == attempts)
+			break;
+	}
+	return ot;
+}
+
+template <class T, class Traits>
+size_t numa_queue<T, Traits>::size() const
+{
+	size_t total = 0;
+	for (auto const &n : nodes_)
+		total += n->local->size() + n->spill_size;
+	return total;
+}
+
+template <class T, class Traits>
+size_t numa_queue<T, Traits>::empty() const
+{
+	return size() == 0;
+}
+
+template <class T, class Traits>
+size_t numa_queue<T, Traits>::capacity() const
+{
+	return nodes_[0]->local->capacity() * nodes_.size();
+}
+
+template <class T, class Traits>
+size_t numa_queue<T, Traits>::node_count() const
+{
+	return nodes_.size();
+}
+
+// A push only blocks on its own node's ring, so this is all a single thread can push without a pop.
+template <class T, class Traits>
+size_t numa_queue<T, Traits>::node_capacity() const
+{
+	return nodes_[0]->local->capacity();
+}
+
+template <class T, class Traits>
+uint64_t numa_queue<T, Traits>::steals() const
+{
+	uint64_t total = 0;
+	for (auto const &n : nodes_)
+		total += n->steals;
+	return total;
+}
+
+template <class T, class Traits>
+uint64_t numa_queue<T, Traits>::stolen_items() const
+{
+	uint64_t total = 0;
+	for (auto const &n : nodes_)
+		total += n->stolen_items;
+	return total;
+}
+
+template <class T, class Traits>
+size_t numa_queue<T, Traits>::current_node() const
+{
+	if (nodes_.size() == 1)
+		return 0;
+
+	if (simulated_)
+	{
+		static std::atomic<size_t> next_thread(0);
+		static thread_local size_t thread_index = next_thread.fetch_add(1);
+		return thread_index % nodes_.size();
+	}
+
+#if defined(__linux__)
+	std::vector<uint32_t> const &cpu_node = detail::numa_nodes().cpu_node;
+	int cpu = sched_getcpu();
+	if (cpu >= 0 && static_cast<size_t>(cpu) < cpu_node.size())
+		return cpu_node[cpu];
+#endif
+	return 0;
+}
+
+template <class T, class Traits>
+bool numa_queue<T, Traits>::try_pop_once(optional_t &ot)
+{
+	size_t home = current_node();
+	ring_t &local = *nodes_[home]->local;
+	if (take_spill(*nodes_[home], ot) || (!local.empty() && (ot = local.try_pop(0))))
+		return true;
+	return nodes_.size() != 1 && steal(home, ot);
+}
+
+template <class T, class Traits>
+bool numa_queue<T, Traits>::take_spill(node &n, optional_t &ot)
+{
+	if (n.spill_size == 0)
+		return false;
+
+	std::lock_guard<std::mutex> lock(n.spill_mutex);
+	if (n.spill.empty())
+		return false;
+	ot = std::move(n.spill.front());
+	n.spill.pop_front();
+	--n.spill_size;
+	return true;
+}
+
+// Moves a batch from the first other node with items, see numa_queue.
+template <class T, class Traits>
+bool numa_queue<T, Traits>::steal(size_t home, optional_t &ot)
+{
+	static thread_local std::vector<T> stolen;
+
+	node &h = *nodes_[home];
+	ring_t &local = *h.local;
+	for (size_t i = 1; i != nodes_.size(); ++i)
+	{
+		node &victim = *nodes_[(home + i) % nodes_.size()];
+		if (take_spill(victim, ot))
+		{
+			h.steals.fetch_add(1, std::memory_order_relaxed);
+			h.stolen_items.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+
+		ring_t &remote = *victim.local;
+		if (remote.empty())
+			continue;
+
+		size_t room = local.capacity() - std::min(local.size(), local.capacity());
+		size_t count = remote.try_pop_batch(std::back_inserter(stolen), std::min(steal_batch_, room + 1), 0);
+		if (count == 0)
+			continue;
+
+		ot = std::move(stolen[0]);
+		size_t j = 1;
+		while (j != count && local.try_push(stolen[j], 0))
+			++j;
+		if (j != count)
+		{
+			std::lock_guard<std::mutex> lock(h.spill_mutex);
+			h.spill.insert(h.spill.end(), std::make_move_iterator(stolen.begin() + j), std::make_move_iterator(stolen.begin() + count));
+			h.spill_size += count - j;
+		}
+		stolen.clear();
+
+		h.steals.fetch_add(1, std::memory_order_relaxed);
+		h.stolen_items.fetch_add(count, std::memory_order_relaxed);
+		return true;
+	}
+	return false;
+}
+
+#endif // GUARUNTEED_MPMC_NUMA_QUEUE_HPP
@@ -0,0 +1,374 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_PACKED_QUEUE_HPP
+#define GUARUNTEED_MPMC_PACKED_QUEUE_HPP
+
+
+#include "queue.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+
+namespace detail
+{
+	// An index of Index bits packed with a count of the same width into one word twice as wide, the count in the low half so adding to or
+	// subtracting from it never carries into the index.
+	template <class Index>
+	struct packed_index
+	{
+	};
+
+	template <>
+	struct packed_index<uint16_t>
+	{
+		typedef uint32_t word_type;
+		static const size_t max_capacity = static_cast<size_t>(1) << 14;
+	};
+
+	template <>
+	struct packed_index<uint32_t>
+	{
+		typedef uint64_t word_type;
+		// Counts have to stay below half the index range, and the capacity has to divide it evenly (a power of 2).
+		static const size_t max_capacity = static_cast<size_t>(1) << 30;
+	};
+}
+
+
+// Bounded MPMC queue with the same interface and guarantees as queue, for capacities that fit a narrower Index (up to 2^30 slots with the
+// default uint32_t).  Each size bound is packed with the leading edge it admits into one word, (upper bound, back lead) and (lower bound, front
+// lead), so admission and reservation are a single compare exchange instead of two RMWs.  The trailing edges are only ever advanced by the one
+// operation whose index they have reached, so they are plain release stores.  That leaves two RMWs per push or pop (queue makes four), and four
+// control counters instead of six.
+//
+// The price is that admission is a compare exchange loop, a failed exchange under contention is a retry where queue's fetch_add would not be.
+template <class T, class Traits = detail::queue_traits<>, class Index = uint32_t>
+class packed_queue
+{
+public:
+
+	typedef T value_type;
+	typedef detail::optional<T> optional_t;
+
+	packed_queue(size_t);
+
+	void push(T&&);
+	bool try_push(T&, uint16_t);
+	T pop();
+	optional_t try_pop(uint16_t);
+
+	template <class InputIt>
+	void push_batch(InputIt, size_t);
+	template <class OutputIt>
+	size_t try_pop_batch(OutputIt, size_t, uint16_t);
+
+	size_t size() const;
+	size_t empty() const;
+	size_t capacity() const;
+
+private:
+	typedef typename detail::packed_index<Index>::word_type word_t;
+	typedef detail::rmw_atomic<word_t> atomic_word_t;
+
+	static const unsigned index_bits = sizeof(Index) * 8;
+
+	static size_t checked_capacity(size_t);
+	static Index count_of(word_t);
+	static Index index_of(word_t);
+	static word_t make_word(Index count, Index index);
+
+	size_t bounded_index(Index) const;
+	bool reserve_back(Index, uint16_t, bool, Index&);
+	Index reserve_front(Index, uint16_t, bool, Index&);
+	void publish_back(Index, Index);
+	void publish_front(Index, Index);
+
+
+	// (size upper bound, back lead).  The upper bound counts slots holding, being written with or reserved for a T, the back lead is the next
+	// slot index a push reserves.
+	alignas(detail::control_alignment<Traits, true>::value) atomic_word_t back_;
+
+	// Index up to which pushes have finished writing.
+	alignas(detail::control_alignment<Traits, false>::value) std::atomic<Index> back_trail_;
+
+	// (size lower bound, front lead).  The lower bound counts fully formed T not yet reserved by a pop, the front lead is the next slot index a
+	// pop reserves.
+	alignas(detail::control_alignment<Traits, true>::value) atomic_word_t front_;
+
+	// Index up to which pops have finished reading.
+	alignas(detail::control_alignment<Traits, false>::value) std::atomic<Index> front_trail_;
+
+	// A buffer sized for holding elements of queue.
+	alignas(Traits::cache_line_size) std::vector<optional_t> buffer_;
+};
+
+
+template <class T, class Traits, class Index>
+packed_queue<T, Traits, Index>::packed_queue(size_t capacity) : back_(0), back_trail_(0), front_(0), front_trail_(0), buffer_(checked_capacity(capacity))
+{
+}
+
+template <class T, class Traits, class Index>
+size_t packed_queue<T, Traits, Index>::checked_capacity(size_t capacity)
+{
+	capacity = detail::queue_size<size_t>::round_up_to_power_of_2(capacity);
+	if (capacity > detail::packed_index<Index>::max_capacity)
+		throw std::invalid_argument("specified capacity is larger than max allowable capacity of queue for its index width");
+	else if (capacity == 0)
+		throw std::invalid_argument("specified capacity is zero - queue must have non zero capacity");
+	return capacity;
+}
+
+template <class T, class Traits, class Index>
+void packed_queue<T, Traits, Index>::push(T&& t)
+{
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	Index index;
+	reserve_back(1, 0, true, index);
+	GUARUNTEED_MPMC_TRACE_END(push, 1);
+
+	buffer_[bounded_index(index)] = std::move(t);
+	publish_back(index, 1);
+}
+
+template <class T, class Traits, class Index>
+bool packed_queue<T, Traits, Index>::try_push(T &t, uint16_t attempts)
+{
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	Index index;
+	if (!reserve_back(1, attempts, false, index))
+		return false;
+	GUARUNTEED_MPMC_TRACE_END(push, 1);
+
+	buffer_[bounded_index(index)] = std::move(t);
+	publish_back(index, 1);
+	return true;
+}
+
+template <class T, class Traits, class Index>
+T packed_queue<T, Traits, Index>::pop()
+{
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	Index index;
+	reserve_front(1, 0, true, index);
+	GUARUNTEED_MPMC_TRACE_END(pop, 1);
+
+	T t{ buffer_[bounded_index(index)].release() };
+	publish_front(index, 1);
+	return t;
+}
+
+template <class T, class Traits, class Index>
+typename packed_queue<T, Traits, Index>::optional_t packed_queue<T, Traits, Index>::try_pop(uint16_t attempts)
+{
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	optional_t ot;
+	Index index;
+	if (reserve_front(1, attempts, false, index) == 0)
+		return ot;
+	GUARUNTEED_MPMC_TRACE_END(pop, 1);
+
+	ot.relocate_from(buffer_[bounded_index(index)]);
+	publish_front(index, 1);
+	return ot;
+}
+
+// Pushes count items as one contiguous run, admitted and reserved with a single compare exchange.  As with queue the batch may not be larger
+// than the capacity.
+template <class T, class Traits, class Index>
+template <class InputIt>
+void packed_queue<T, Traits, Index>::push_batch(InputIt first, size_t count)
+{
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	if (count > buffer_.size())
+		throw std::invalid_argument("specified batch is larger than the capacity of queue");
+	else if (count == 0)
+		return;
+
+	Index index;
+	reserve_back(static_cast<Index>(count), 0, true, index);
+	GUARUNTEED_MPMC_TRACE_END(push, count);
+
+	for (size_t i = 0; i != count; ++i, ++first)
+		buffer_[bounded_index(static_cast<Index>(index + i))] = std::move(*first);
+	publish_back(index, static_cast<Index>(count));
+}
+
+// Pops up to max_count items, whatever is available, returns the number of items written to out.
+template <class T, class Traits, class Index>
+template <class OutputIt>
+size_t packed_queue<T, Traits, Index>::try_pop_batch(OutputIt out, size_t max_count, uint16_t attempts)
+{
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	Index index;
+	Index count = reserve_front(static_cast<Index>(std::min(max_count, buffer_.size())), attempts, false, index);
+	if (count == 0)
+		return 0;
+	GUARUNTEED_MPMC_TRACE_END(pop, count);
+
+	for (Index i = 0; i != count; ++i, ++out)
+		*out = buffer_[bounded_index(static_cast<Index>(index + i))].release();
+	publish_front(index, count);
+	return count;
+}
+
+template <class T, class Traits, class Index>
+size_t packed_queue<T, Traits, Index>::size() const
+{
+	return count_of(back_.load(std::memory_order_acquire));
+}
+
+template <class T, class Traits, class Index>
+size_t packed_queue<T, Traits, Index>::empty() const
+{
+	return count_of(front_.load(std::memory_order_acquire)) == 0;
+}
+
+template <class T, class Traits, class Index>
+size_t packed_queue<T, Traits, Index>::capacity() const
+{
+	return buffer_.size();
+}
+
+template <class T, class Traits, class Index>
+inline Index packed_queue<T, Traits, Index>::count_of(word_t w)
+{
+	return static_cast<Index>(w);
+}
+
+template <class T, class Traits, class Index>
+inline Index packed_queue<T, Traits, Index>::index_of(word_t w)
+{
+	return static_cast<Index>(w >> index_bits);
+}
+
+template <class T, class Traits, class Index>
+inline typename packed_queue<T, Traits, Index>::word_t packed_queue<T, Traits, Index>::make_word(Index count, Index index)
+{
+	return static_cast<word_t>(count) | (static_cast<word_t>(index) << index_bits);
+}
+
+// The indices wrap at 2^index_bits, which the (power of 2) capacity divides evenly.
+template <class T, class Traits, class Index>
+inline size_t packed_queue<T, Traits, Index>::bounded_index(Index index) const
+{
+	return index % buffer_.size();
+}
+
+// Raises the upper bound by n and reserves n slots at the back lead in one step, index is the first of them.  Without block it gives up once
+// the queue was seen too full attempts times in a row after the first, losing the exchange to another push doesn't count.
+template <class T, class Traits, class Index>
+inline bool packed_queue<T, Traits, Index>::reserve_back(Index n, uint16_t attempts, bool block, Index &index)
+{
+	uint16_t attempt = 0;
+	uint32_t wait_count = 0;
+	word_t w = back_.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		if (count_of(w) + n <= buffer_.size())
+		{
+			if (back_.compare_exchange_weak(w, make_word(static_cast<Index>(count_of(w) + n), static_cast<Index>(index_of(w) + n))))
+			{
+				index = index_of(w);
+				return true;
+			}
+		}
+		else
+		{
+			if (!block)
+			{
+				if (attempt == attempts)
+					return false;
+				++attempt;
+			}
+			else if ((wait_count++ % Traits::concurrency) + 1 == Traits::concurrency)
+			{
+				std::this_thread::yield(); // Deal with oversubscription...
+			}
+			w = back_.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+// Lowers the lower bound by up to max_count filled slots (at least one when blocking) and reserves them at the front lead in one step, returns
+// the number reserved with index the first of them.
+template <class T, class Traits, class Index>
+inline Index packed_queue<T, Traits, Index>::reserve_front(Index max_count, uint16_t attempts, bool block, Index &index)
+{
+	uint16_t attempt = 0;
+	uint32_t wait_count = 0;
+	word_t w = front_.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		Index n = std::min(count_of(w), max_count);
+		if (n != 0)
+		{
+			if (front_.compare_exchange_weak(w, make_word(static_cast<Index>(count_of(w) - n), static_cast<Index>(index_of(w) + n))))
+			{
+				index = index_of(w);
+				return n;
+			}
+		}
+		else
+		{
+			if (!block)
+			{
+				if (attempt == attempts || max_count == 0)
+					return 0;
+				++attempt;
+			}
+			else if ((wait_count++ % Traits::concurrency) + 1 == Traits::concurrency)
+			{
+				std::this_thread::yield(); // Deal with oversubscription...
+			}
+			w = front_.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+// Waits for the pushes before the run to finish, moves the trailing edge past it and makes the run available to pops.
+template <class T, class Traits, class Index>
+inline void packed_queue<T, Traits, Index>::publish_back(Index index, Index n)
+{
+	for (uint32_t wait_count = 0; back_trail_.load(std::memory_order_acquire) != index; ++wait_count)
+	{
+		if ((wait_count % Traits::concurrency) + 1 == Traits::concurrency)
+			std::this_thread::yield(); // Deal with oversubscription...
+	}
+	back_trail_.store(static_cast<Index>(index + n), std::memory_order_release);
+
+	// Raising the lower bound can't carry into the front lead, it never exceeds the capacity.
+	front_.fetch_add(static_cast<word_t>(n));
+}
+
+template <class T, class Traits, class Index>
+inline void packed_queue<T, Traits, Index>::publish_front(Index index, Index n)
+{
+	for (uint32_t wait_count = 0; front_trail_.load(std::memory_order_acquire) != index; ++wait_count)
+	{
+		if ((wait_count % Traits::concurrency) + 1 == Traits::concurrency)
+			std::this_thread::yield(); // Deal with oversubscription...
+	}
+	front_trail_.store(static_cast<Index>(index + n), std::memory_order_release);
+
+	// The upper bound is at least n (the run being released), so it can't borrow from the back lead.
+	back_.fetch_sub(static_cast<word_t>(n));
+}
+
+#endif // GUARUNTEED_MPMC_PACKED_QUEUE_HPP
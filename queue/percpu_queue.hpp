@@ -0,0 +1,493 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_PERCPU_QUEUE_HPP
+#define GUARUNTEED_MPMC_PERCPU_QUEUE_HPP
+
+
+#include "queue.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Restartable sequences need linux on x86-64 and a C library that registers them (glibc 2.35 and later), GUARUNTEED_MPMC_NO_RSEQ turns them off.
+#if defined(__linux__) && defined(__x86_64__) && defined(__GNUC__) && !defined(GUARUNTEED_MPMC_NO_RSEQ)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define GUARUNTEED_MPMC_RSEQ
+#endif
+#endif
+
+#if defined(__linux__)
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+
+// Bounded MPMC queue split into one lane per CPU, for when there are more producer threads than cores.  A producer pushes into the lane of the
+// CPU it is running on, so producers only share a lane with threads that were scheduled on the same core.  With restartable sequences the slot
+// reservation in that lane is a per-CPU critical section that the kernel restarts if the thread is preempted, migrated or signalled before it
+// commits, so it needs no atomic RMW at all and producers never contend.  Without them (other platforms, or the C library didn't register rseq)
+// the reservation is a compare exchange on the lane, which is still only contended by threads sharing a CPU.
+//
+// Consumers pop from their own CPU's lane first and then the others, one compare exchange per item.  Each lane is a ring of slots with a sequence
+// number (the position the slot is next expected at), so a full or empty lane is read from the slot rather than separate counters.
+//
+// With rseq there is one more lane than CPU ids, for threads on a CPU the kernel reports past them (a CPU that wasn't possible when the queue was
+// built), it is only ever reserved by compare exchange so it never mixes with the plain store of a restartable sequence.
+//
+// The capacity is split evenly between the lanes.  Items are FIFO within a lane, but there is no order between lanes, so a producer that migrates
+// between CPUs can have its items popped out of order.  A push blocks while its own lane is full even if other lanes have room.
+template <class T, class Traits = detail::queue_traits<>>
+class percpu_queue
+{
+public:
+
+	typedef T value_type;
+	typedef detail::optional<T> optional_t;
+
+	percpu_queue(size_t);
+
+	void push(T&&);
+	bool try_push(T&, uint16_t);
+	T pop();
+	optional_t try_pop(uint16_t);
+
+	template <class InputIt>
+	void push_batch(InputIt, size_t);
+	template <class OutputIt>
+	size_t try_pop_batch(OutputIt, size_t, uint16_t);
+
+	size_t size() const;
+	size_t empty() const;
+	size_t capacity() const;
+
+	size_t lane_count() const;
+	size_t lane_capacity() const;
+	bool uses_rseq() const;
+
+private:
+	typedef detail::rmw_atomic<size_t> atomic_position_t;
+
+	// sequence must stay the first member, the restartable sequence reads it at the slot's address.
+	struct slot
+	{
+		std::atomic<size_t> sequence;
+		optional_t value;
+	};
+
+	struct lane
+	{
+		// Next position a push reserves, only written by threads on this lane's CPU (when using rseq).
+		alignas(Traits::cache_line_size) atomic_position_t back{ 0 };
+
+		// Next position a pop takes.
+		alignas(Traits::cache_line_size) atomic_position_t front{ 0 };
+
+		alignas(Traits::cache_line_size) std::unique_ptr<slot[]> slots;
+	};
+
+	static bool rseq_registered();
+	static size_t cpu_count();
+	size_t current_lane() const;
+	bool reserve(size_t&, size_t&);
+	void publish(size_t, size_t, T&&);
+	bool take(size_t, optional_t&);
+
+	size_t lane_capacity_;
+	bool use_rseq_;
+	std::vector<lane, detail::aligned_allocator<lane>> lanes_;
+};
+
+
+namespace detail
+{
+#if defined(GUARUNTEED_MPMC_RSEQ)
+	// The calling thread's rseq area as registered by the C library, null when it isn't registered.
+	inline struct rseq* rseq_area()
+	{
+		if (__rseq_size == 0)
+			return nullptr;
+		char *thread_pointer;
+		asm("movq %%fs:0, %0" : "=r"(thread_pointer));
+		struct rseq *area = reinterpret_cast<struct rseq*>(thread_pointer + __rseq_offset);
+		return static_cast<int32_t>(area->cpu_id) < 0 ? nullptr : area;
+	}
+
+	enum class rseq_result
+	{
+		reserved,
+		full,
+		aborted
+	};
+
+	// Reserves the next position of the lane for cpu as a restartable sequence: check the thread is still on cpu, check the slot at back is free
+	// (its sequence equals back), then the single store of back + 1 commits.  The kernel moves the thread to the abort handler if it is preempted,
+	// migrated or signalled before that store, so no other thread can have touched back in between.
+	inline rseq_result rseq_reserve(struct rseq *area, uint32_t cpu, void *back, void *slots, size_t mask, size_t stride, size_t &position)
+	{
+		int status;
+		size_t address;
+		asm volatile(
+			".pushsection __rseq_cs, \"aw\"\n\t"
+			".balign 32\n\t"
+			"3:\n\t"
+			".long 0x0, 0x0\n\t"
+			".quad 1f, (2f - 1f), 4f\n\t"
+			".popsection\n\t"
+			"leaq 3b(%%rip), %[address]\n\t"
+			"movq %[address], %[rseq_cs]\n\t"
+			"1:\n\t"
+			"cmpl %[cpu], %[current_cpu]\n\t"
+			"jnz 4f\n\t"
+			"movq (%[back]), %[position]\n\t"
+			"movq %[position], %[address]\n\t"
+			"andq %[mask], %[address]\n\t"
+			"imulq %[stride], %[address]\n\t"
+			"addq %[slots], %[address]\n\t"
+			"cmpq %[position], (%[address])\n\t"
+			"jnz 5f\n\t"
+			"leaq 1(%[position]), %[address]\n\t"
+			"movq %[address], (%[back])\n\t"
+			"2:\n\t"
+			"movl $0, %[status]\n\t"
+			"jmp 6f\n\t"
+			"5:\n\t"
+			"movl $1, %[status]\n\t"
+			"jmp 6f\n\t"
+			".pushsection __rseq_failure, \"ax\"\n\t"
+			".byte 0x0f, 0xb9, 0x3d\n\t"
+			".long 0x53053053\n\t"
+			"4:\n\t"
+			"movl $2, %[status]\n\t"
+			"jmp 6f\n\t"
+			".popsection\n\t"
+			"6:\n\t"
+			: [status] "=&r"(status), [position] "=&r"(position), [address] "=&r"(address), [rseq_cs] "=m"(area->rseq_cs)
+			: [cpu] "r"(cpu), [current_cpu] "m"(area->cpu_id), [back] "r"(back), [slots] "r"(slots), [mask] "r"(mask), [stride] "r"(stride)
+			: "memory", "cc");
+		return static_cast<rseq_result>(status);
+	}
+#endif
+}
+
+
+template <class T, class Traits>
+percpu_queue<T, Traits>::percpu_queue(size_t capacity) : lane_capacity_(0), use_rseq_(rseq_registered()), lanes_(cpu_count() + (use_rseq_ ? 1 : 0))
+{
+	if (capacity == 0)
+		throw std::invalid_argument("specified capacity is zero - queue must have non zero capacity");
+
+	lane_capacity_ = detail::queue_size<size_t>::round_up_to_power_of_2((capacity + lanes_.size() - 1) / lanes_.size());
+	if (lane_capacity_ > detail::queue_size<size_t>::max_capacity / lanes_.size())
+		throw std::invalid_argument("specified capacity is larger than max allowable capacity of queue");
+
+	for (lane &l : lanes_)
+	{
+		l.slots.reset(new slot[lane_capacity_]);
+		for (size_t i = 0; i != lane_capacity_; ++i)
+			l.slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+}
+
+template <class T, class Traits>
+void percpu_queue<T, Traits>::push(T&& t)
+{
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	// Wait while the lane is full.
+	size_t lane_index, position;
+	for (uint32_t wait_count = 0; !reserve(lane_index, position); ++wait_count)
+	{
+		if ((wait_count % Traits::concurrency) + 1 == Traits::concurrency)
+			std::this_thread::yield(); // Deal with oversubscription...
+	}
+
+	GUARUNTEED_MPMC_TRACE_END(push, 1);
+	publish(lane_index, position, std::move(t));
+}
+
+template <class T, class Traits>
+bool percpu_queue<T, Traits>::try_push(T &t, uint16_t attempts)
+{
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	size_t lane_index, position;
+	for (uint16_t attempt = 0; !reserve(lane_index, position); ++attempt)
+	{
+		if (attempt == attempts)
+			return false;
+	}
+
+	GUARUNTEED_MPMC_TRACE_END(push, 1);
+	publish(lane_index, position, std::move(t));
+	return true;
+}
+
+template <class T, class Traits>
+T percpu_queue<T, Traits>::pop()
+{
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	// Wait while every lane is empty.
+	optional_t ot;
+	for (uint32_t wait_count = 0; ; ++wait_count)
+	{
+		size_t first = current_lane();
+		for (size_t i = 0; i != lanes_.size(); ++i)
+		{
+			if (take((first + i) % lanes_.size(), ot))
+			{
+				GUARUNTEED_MPMC_TRACE_END(pop, 1);
+				return ot.release();
+			}
+		}
+		if ((wait_count % Traits::concurrency) + 1 == Traits::concurrency)
+			std::this_thread::yield(); // Deal with oversubscription...
+	}
+}
+
+template <class T, class Traits>
+typename percpu_queue<T, Traits>::optional_t percpu_queue<T, Traits>::try_pop(uint16_t attempts)
+{
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	// An attempt is a pass over every lane.
+	optional_t ot;
+	for (uint16_t attempt = 0; ; ++attempt)
+	{
+		size_t first = current_lane();
+		for (size_t i = 0; i != lanes_.size(); ++i)
+		{
+			if (take((first + i) % lanes_.size(), ot))
+			{
+				GUARUNTEED_MPMC_TRACE_END(pop, 1);
+				return ot;
+			}
+		}
+		if (attempt == attempts)
+			return ot;
+	}
+}
+
+// Items go into the lane of whichever CPU the thread is on at each push, there is no single reservation for the batch.
+template <class T, class Traits>
+template <class InputIt>
+void percpu_queue<T, Traits>::push_batch(InputIt first, size_t count)
+{
+	for (size_t i = 0; i != count; ++i, ++first)
+		push(std::move(*first));
+}
+
+template <class T, class Traits>
+template <class OutputIt>
+size_t percpu_queue<T, Traits>::try_pop_batch(OutputIt out, size_t max_count, uint16_t attempts)
+{
+	size_t count = 0;
+	for (; count != max_count; ++count, ++out)
+	{
+		optional_t ot = try_pop(count == 0 ? attempts : 0);
+		if (!ot)
+			break;
+		*out = ot.release();
+	}
+	return count;
+}
+
+template <class T, class Traits>
+size_t percpu_queue<T, Traits>::size() const
+{
+	size_t total = 0;
+	for (lane const &l : lanes_)
+	{
+		size_t front = l.front.load(std::memory_order_acquire);
+		size_t back = l.back.load(std::memory_order_acquire);
+		total += back > front ? back - front : 0;
+	}
+	return total;
+}
+
+template <class T, class Traits>
+size_t percpu_queue<T, Traits>::empty() const
+{
+	return size() == 0;
+}
+
+template <class T, class Traits>
+size_t percpu_queue<T, Traits>::capacity() const
+{
+	return lane_capacity_ * lanes_.size();
+}
+
+template <class T, class Traits>
+size_t percpu_queue<T, Traits>::lane_count() const
+{
+	return lanes_.size();
+}
+
+// A push only blocks on its own lane, so this is all a single thread can push without a pop.
+template <class T, class Traits>
+size_t percpu_queue<T, Traits>::lane_capacity() const
+{
+	return lane_capacity_;
+}
+
+template <class T, class Traits>
+bool percpu_queue<T, Traits>::uses_rseq() const
+{
+	return use_rseq_;
+}
+
+// Whether the constructing thread has an rseq area, and so every thread of the process does.
+template <class T, class Traits>
+bool percpu_queue<T, Traits>::rseq_registered()
+{
+#if defined(GUARUNTEED_MPMC_RSEQ)
+	return detail::rseq_area() != nullptr;
+#else
+	return false;
+#endif
+}
+
+// One past the highest possible CPU id rather than a count of CPUs, lanes are indexed by id, which can be sparse, and a CPU brought online later
+// still needs a lane.
+template <class T, class Traits>
+size_t percpu_queue<T, Traits>::cpu_count()
+{
+#if defined(__linux__)
+	// A cpulist in ascending order, such as "0-63" or "0-3,8-11", so the highest id is the last number.
+	std::ifstream is("/sys/devices/system/cpu/possible");
+	std::string list;
+	if (std::getline(is, list))
+	{
+		size_t last = list.find_last_of(",-");
+		char const *first = list.c_str() + (last == std::string::npos ? 0 : last + 1);
+		char *end = nullptr;
+		unsigned long highest = std::strtoul(first, &end, 10);
+		if (end != first)
+			return static_cast<size_t>(highest) + 1;
+	}
+
+	long count = sysconf(_SC_NPROCESSORS_CONF);
+	if (count > 0)
+		return static_cast<size_t>(count);
+#endif
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Where there is no way to ask for the CPU, threads are spread over the lanes in the order they first use the queue.
+template <class T, class Traits>
+size_t percpu_queue<T, Traits>::current_lane() const
+{
+#if defined(__linux__)
+	int cpu = sched_getcpu();
+	if (cpu >= 0)
+		return static_cast<size_t>(cpu) % lanes_.size();
+#endif
+	static std::atomic<size_t> next_thread(0);
+	static thread_local size_t thread_index = next_thread.fetch_add(1);
+	return thread_index % lanes_.size();
+}
+
+// Reserves the next position of the calling CPU's lane, false when that lane is full.
+template <class T, class Traits>
+bool percpu_queue<T, Traits>::reserve(size_t &lane_index, size_t &position)
+{
+#if defined(GUARUNTEED_MPMC_RSEQ)
+	if (use_rseq_)
+	{
+		// Every thread of the process is registered once the constructing thread was, so the CPU lanes are only ever reserved here.
+		struct rseq *area = detail::rseq_area();
+		assert(area != nullptr);
+		for (;;)
+		{
+			uint32_t cpu = *static_cast<uint32_t volatile*>(&area->cpu_id_start);
+			if (cpu >= lanes_.size() - 1)
+				break; // Past the possible CPUs, see percpu_queue.
+			lane &l = lanes_[cpu];
+			detail::rseq_result result = detail::rseq_reserve(area, cpu, &l.back, l.slots.get(), lane_capacity_ - 1, sizeof(slot), position);
+			if (result != detail::rseq_result::aborted)
+			{
+				lane_index = cpu;
+				return result == detail::rseq_result::reserved;
+			}
+			// Preempted, migrated or signalled part way through, start over on whichever CPU the thread is on now.
+		}
+	}
+#endif
+
+	lane_index = use_rseq_ ? lanes_.size() - 1 : current_lane();
+	lane &l = lanes_[lane_index];
+	position = l.back.load(std::memory_order_acquire);
+	for (;;)
+	{
+		size_t sequence = l.slots[position & (lane_capacity_ - 1)].sequence.load(std::memory_order_acquire);
+		std::ptrdiff_t difference = static_cast<std::ptrdiff_t>(sequence - position);
+		if (difference == 0)
+		{
+			if (l.back.compare_exchange_weak(position, position + 1))
+				return true;
+		}
+		else if (difference < 0)
+		{
+			return false;
+		}
+		else
+		{
+			position = l.back.load(std::memory_order_acquire);
+		}
+	}
+}
+
+template <class T, class Traits>
+inline void percpu_queue<T, Traits>::publish(size_t lane_index, size_t position, T&& t)
+{
+	slot &s = lanes_[lane_index].slots[position & (lane_capacity_ - 1)];
+	s.value = std::move(t);
+	s.sequence.store(position + 1, std::memory_order_release);
+}
+
+// Pops the front of one lane, false when it is empty (or its front item is still being written).
+template <class T, class Traits>
+bool percpu_queue<T, Traits>::take(size_t lane_index, optional_t &ot)
+{
+	lane &l = lanes_[lane_index];
+	size_t position = l.front.load(std::memory_order_acquire);
+	for (;;)
+	{
+		slot &s = l.slots[position & (lane_capacity_ - 1)];
+		std::ptrdiff_t difference = static_cast<std::ptrdiff_t>(s.sequence.load(std::memory_order_acquire) - (position + 1));
+		if (difference == 0)
+		{
+			if (l.front.compare_exchange_weak(position, position + 1))
+			{
+				ot = s.value.release();
+				s.sequence.store(position + lane_capacity_, std::memory_order_release);
+				return true;
+			}
+		}
+		else if (difference < 0)
+		{
+			return false;
+		}
+		else
+		{
+			position = l.front.load(std::memory_order_acquire);
+		}
+	}
+}
+
+#endif // GUARUNTEED_MPMC_PERCPU_QUEUE_HPP
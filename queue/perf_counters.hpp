@@ -0,0 +1,197 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_PERF_COUNTERS_HPP
+#define GUARUNTEED_MPMC_PERF_COUNTERS_HPP
+
+
+#include <cstdint>
+
+#if defined(__linux__)
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+// Hardware cache and TLB miss counters for the benchmarks, through perf_event_open on linux.  Counting covers the calling thread and every thread
+// it creates after the counters are constructed, so construct them before starting the benchmark threads.  Counters the kernel, the hardware or a
+// virtual machine don't provide (or perf_event_paranoid forbids) are unavailable rather than an error, and on other platforms nothing is.
+//
+// There is no generic perf event for coherence misses, GUARUNTEED_MPMC_PERF_HITM_EVENT is the raw event code for the host's (e.g. 0x04d2 for
+// MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM on Intel Skylake), without it the coherence counter is unavailable.
+
+enum class perf_counter
+{
+	l1d_misses,         // L1 data cache read misses.
+	llc_misses,         // Last level cache misses.
+	dtlb_misses,        // Data TLB read misses.
+	coherence_misses,   // Loads served by a line modified in another core's cache (HITM), see GUARUNTEED_MPMC_PERF_HITM_EVENT.
+	instructions,       // Instructions retired (user mode).
+	count
+};
+
+
+class perf_counters
+{
+public:
+	perf_counters();
+	~perf_counters();
+
+	perf_counters(perf_counters const&) = delete;
+	perf_counters& operator=(perf_counters const&) = delete;
+
+	bool available(perf_counter) const;
+
+	// Resets and starts every available counter.
+	void start();
+	void stop();
+
+	// The count since start, 0 when unavailable.
+	uint64_t read(perf_counter) const;
+
+	static char const* name(perf_counter);
+
+private:
+	static const int counter_count = static_cast<int>(perf_counter::count);
+
+	int fds_[counter_count];
+};
+
+
+#if defined(__linux__)
+
+namespace detail
+{
+	inline int open_perf_counter(uint32_t type, uint64_t config)
+	{
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+	}
+
+	inline uint64_t cache_event(uint64_t cache, uint64_t op, uint64_t result)
+	{
+		return cache | (op << 8) | (result << 16);
+	}
+}
+
+inline perf_counters::perf_counters()
+{
+	fds_[static_cast<int>(perf_counter::l1d_misses)] = detail::open_perf_counter(PERF_TYPE_HW_CACHE,
+		detail::cache_event(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+	fds_[static_cast<int>(perf_counter::llc_misses)] = detail::open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	fds_[static_cast<int>(perf_counter::dtlb_misses)] = detail::open_perf_counter(PERF_TYPE_HW_CACHE,
+		detail::cache_event(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+#if defined(GUARUNTEED_MPMC_PERF_HITM_EVENT)
+	fds_[static_cast<int>(perf_counter::coherence_misses)] = detail::open_perf_counter(PERF_TYPE_RAW, GUARUNTEED_MPMC_PERF_HITM_EVENT);
+#else
+	fds_[static_cast<int>(perf_counter::coherence_misses)] = -1;
+#endif
+	fds_[static_cast<int>(perf_counter::instructions)] = detail::open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+}
+
+inline perf_counters::~perf_counters()
+{
+	for (int fd : fds_)
+	{
+		if (fd >= 0)
+			close(fd);
+	}
+}
+
+inline bool perf_counters::available(perf_counter c) const
+{
+	return fds_[static_cast<int>(c)] >= 0;
+}
+
+inline void perf_counters::start()
+{
+	for (int fd : fds_)
+	{
+		if (fd >= 0)
+		{
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+inline void perf_counters::stop()
+{
+	for (int fd : fds_)
+	{
+		if (fd >= 0)
+			ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	}
+}
+
+// With inherit the value read includes the counts of threads that have exited.
+inline uint64_t perf_counters::read(perf_counter c) const
+{
+	int fd = fds_[static_cast<int>(c)];
+	uint64_t value = 0;
+	if (fd < 0 || ::read(fd, &value, sizeof(value)) != static_cast<ssize_t>(sizeof(value)))
+		return 0;
+	return value;
+}
+
+#else
+
+inline perf_counters::perf_counters()
+{
+	for (int &fd : fds_)
+		fd = -1;
+}
+
+inline perf_counters::~perf_counters() {}
+
+inline bool perf_counters::available(perf_counter) const
+{
+	return false;
+}
+
+inline void perf_counters::start() {}
+
+inline void perf_counters::stop() {}
+
+inline uint64_t perf_counters::read(perf_counter) const
+{
+	return 0;
+}
+
+#endif
+
+inline char const* perf_counters::name(perf_counter c)
+{
+	switch (c)
+	{
+	case perf_counter::l1d_misses:
+		return "L1D misses";
+	case perf_counter::llc_misses:
+		return "LLC misses";
+	case perf_counter::dtlb_misses:
+		return "dTLB misses";
+	case perf_counter::coherence_misses:
+		return "HITM loads";
+	case perf_counter::instructions:
+		return "instructions";
+	default:
+		return "";
+	}
+}
+
+#endif // GUARUNTEED_MPMC_PERF_COUNTERS_HPP
@@ -0,0 +1,570 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_PIPELINE_HPP
+#define GUARUNTEED_MPMC_PIPELINE_HPP
+
+
+#include "queue.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+struct pipeline_options
+{
+	// Number of items a source collects before pushing them to the first stage as one queue item, stages forward the results of each input batch as one batch.
+	size_t batch_size = 64;
+
+	// Queues between stages hold this many batches per connected worker (rounded up to a power of 2).
+	size_t batches_per_worker = 2;
+
+	// Fuse adjacent stages with the same parallelism onto one thread when either is declared light, a hop through a queue costs more than a light stage.
+	bool fuse = true;
+};
+
+struct stage_metrics
+{
+	std::string name;
+	size_t parallelism;
+	uint64_t items_in;
+	uint64_t items_out;
+	uint64_t batches;
+	double busy_seconds;
+	double wall_seconds;
+
+	// Items per second over the lifetime of the stage.
+	double throughput() const
+	{
+		return wall_seconds > 0.0 ? static_cast<double>(items_in) / wall_seconds : 0.0;
+	}
+
+	// Average processing time per item, excluding time spent waiting for input.
+	double latency() const
+	{
+		return items_in != 0 ? busy_seconds / static_cast<double>(items_in) : 0.0;
+	}
+};
+
+
+namespace detail
+{
+	typedef std::chrono::steady_clock pipeline_clock;
+
+	// Batches are what travel between stages, a batch with end set carries no items and tells one worker of the next stage that the stream is over.
+	template <class T>
+	struct pipeline_batch
+	{
+		std::vector<T> items;
+		bool end;
+	};
+
+	template <class T>
+	using pipeline_queue = queue<pipeline_batch<T>>;
+
+	inline size_t pipeline_queue_capacity(size_t producers, size_t consumers, pipeline_options const &options)
+	{
+		return queue_size<size_t>::round_up_to_power_of_2(std::max<size_t>(4, options.batches_per_worker * (producers + consumers)));
+	}
+
+	template <class T>
+	void push_end_of_stream(pipeline_queue<T> &q, size_t consumers)
+	{
+		for (size_t i = 0; i != consumers; ++i)
+		{
+			pipeline_batch<T> end;
+			end.end = true;
+			q.push(std::move(end));
+		}
+	}
+
+	// Tallied per worker and folded into the stage totals when the worker exits, so the hot loop doesn't touch shared counters.
+	struct pipeline_worker_counters
+	{
+		uint64_t items_in = 0;
+		uint64_t items_out = 0;
+		uint64_t batches = 0;
+		uint64_t wait_ns = 0;
+		uint64_t total_ns = 0;
+	};
+
+	// The input side of a (possibly fused) stage, each call to next appends the results of one input batch to out.  Returns false at end of stream.
+	template <class Out>
+	class pipeline_head
+	{
+	public:
+		virtual ~pipeline_head() {}
+		virtual bool next(std::vector<Out>&, pipeline_worker_counters&) = 0;
+	};
+
+	// Pops batches off the queue feeding a stage.
+	template <class T>
+	class pipeline_input_head : public pipeline_head<T>
+	{
+	public:
+		explicit pipeline_input_head(std::shared_ptr<pipeline_queue<T>> input) : input_(std::move(input)) {}
+
+		bool next(std::vector<T> &out, pipeline_worker_counters &counters) override
+		{
+			auto t0 = pipeline_clock::now();
+			typename pipeline_queue<T>::optional_t batch;
+			for (uint32_t wait_count = 0; !(batch = input_->try_pop(0)); ++wait_count)
+			{
+				if ((wait_count % concurrency) + 1 == concurrency)
+					std::this_thread::yield();
+			}
+			counters.wait_ns += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(pipeline_clock::now() - t0).count());
+
+			if (batch->end)
+				return false;
+
+			counters.items_in += batch->items.size();
+			++counters.batches;
+			if (out.empty())
+				out.swap(batch->items);
+			else
+				std::move(begin(batch->items), end(batch->items), std::back_inserter(out));
+			return true;
+		}
+
+	private:
+		std::shared_ptr<pipeline_queue<T>> input_;
+	};
+
+	// Applies a stage function to the output of the head before it, this is both a plain stage (on top of an input head) and stage fusion.
+	template <class In, class Out>
+	class pipeline_map_head : public pipeline_head<Out>
+	{
+	public:
+		typedef std::function<void(std::vector<In>&, std::vector<Out>&)> function_t;
+
+		pipeline_map_head(std::shared_ptr<pipeline_head<In>> inner, function_t fn) : inner_(std::move(inner)), fn_(std::move(fn)) {}
+
+		bool next(std::vector<Out> &out, pipeline_worker_counters &counters) override
+		{
+			std::vector<In> in;
+			if (!inner_->next(in, counters))
+				return false;
+
+			fn_(in, out);
+			return true;
+		}
+
+	private:
+		std::shared_ptr<pipeline_head<In>> inner_;
+		function_t fn_;
+	};
+
+	class pipeline_stage_base
+	{
+	public:
+		pipeline_stage_base(std::string name, size_t parallelism) : name_(std::move(name)), parallelism_(parallelism), running_(parallelism), items_in_(0), items_out_(0), batches_(0), busy_ns_(0), finished_(0) {}
+		virtual ~pipeline_stage_base() {}
+
+		void start(std::vector<std::thread> &threads, pipeline_clock::time_point started)
+		{
+			started_ = started;
+			for (size_t i = 0; i != parallelism_; ++i)
+				threads.emplace_back(&pipeline_stage_base::run_worker, this);
+		}
+
+		stage_metrics metrics() const
+		{
+			stage_metrics m;
+			m.name = name_;
+			m.parallelism = parallelism_;
+			m.items_in = items_in_;
+			m.items_out = items_out_;
+			m.batches = batches_;
+			m.busy_seconds = static_cast<double>(busy_ns_) * 1e-9;
+			pipeline_clock::rep finished = finished_;
+			pipeline_clock::time_point end = finished != 0 ? pipeline_clock::time_point(pipeline_clock::duration(finished)) : pipeline_clock::now();
+			m.wall_seconds = std::chrono::duration<double>(end - started_).count();
+			return m;
+		}
+
+	protected:
+		virtual void run(pipeline_worker_counters&) = 0;
+
+		// Called by the last worker of the stage to exit.
+		virtual void finish() {}
+
+	private:
+		void run_worker()
+		{
+			pipeline_worker_counters counters;
+			run(counters);
+
+			items_in_ += counters.items_in;
+			items_out_ += counters.items_out;
+			batches_ += counters.batches;
+			busy_ns_ += counters.total_ns - std::min(counters.total_ns, counters.wait_ns);
+
+			if (running_.fetch_sub(1) == 1)
+			{
+				finished_ = pipeline_clock::now().time_since_epoch().count();
+				finish();
+			}
+		}
+
+		std::string name_;
+		size_t parallelism_;
+		std::atomic_size_t running_;
+		std::atomic<uint64_t> items_in_;
+		std::atomic<uint64_t> items_out_;
+		std::atomic<uint64_t> batches_;
+		std::atomic<uint64_t> busy_ns_;
+		pipeline_clock::time_point started_;
+
+		// Written by the last worker out as it exits (ticks since the clock's epoch), 0 while the stage runs.
+		std::atomic<pipeline_clock::rep> finished_;
+	};
+
+	// A stage that feeds the next stage through a queue, the last worker out forwards end of stream to every worker of the next stage.
+	template <class Out>
+	class pipeline_stage : public pipeline_stage_base
+	{
+	public:
+		pipeline_stage(std::string name, size_t parallelism, std::shared_ptr<pipeline_head<Out>> head, std::shared_ptr<pipeline_queue<Out>> output, size_t downstream)
+			: pipeline_stage_base(std::move(name), parallelism), head_(std::move(head)), output_(std::move(output)), downstream_(downstream) {}
+
+	protected:
+		void run(pipeline_worker_counters &counters) override
+		{
+			for (;;)
+			{
+				pipeline_batch<Out> batch;
+				batch.end = false;
+
+				auto t0 = pipeline_clock::now();
+				bool more = head_->next(batch.items, counters);
+				counters.total_ns += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(pipeline_clock::now() - t0).count());
+				if (!more)
+					return;
+
+				if (!batch.items.empty())
+				{
+					counters.items_out += batch.items.size();
+					output_->push(std::move(batch));
+				}
+			}
+		}
+
+		void finish() override
+		{
+			push_end_of_stream(*output_, downstream_);
+		}
+
+	private:
+		std::shared_ptr<pipeline_head<Out>> head_;
+		std::shared_ptr<pipeline_queue<Out>> output_;
+		size_t downstream_;
+	};
+
+	// The last stage of a pipeline, consumes items instead of forwarding them.
+	template <class In>
+	class pipeline_sink_stage : public pipeline_stage_base
+	{
+	public:
+		typedef std::function<void(In&&)> function_t;
+
+		pipeline_sink_stage(std::string name, size_t parallelism, std::shared_ptr<pipeline_head<In>> head, function_t fn)
+			: pipeline_stage_base(std::move(name), parallelism), head_(std::move(head)), fn_(std::move(fn)) {}
+
+	protected:
+		void run(pipeline_worker_counters &counters) override
+		{
+			for (std::vector<In> items; ; items.clear())
+			{
+				auto t0 = pipeline_clock::now();
+				bool more = head_->next(items, counters);
+				for (auto &item : items)
+					fn_(std::move(item));
+				counters.total_ns += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(pipeline_clock::now() - t0).count());
+
+				if (!more)
+					return;
+				counters.items_out += items.size();
+			}
+		}
+
+	private:
+		std::shared_ptr<pipeline_head<In>> head_;
+		function_t fn_;
+	};
+
+	template <class Source>
+	struct pipeline_state
+	{
+		pipeline_options options;
+		std::shared_ptr<pipeline_queue<Source>> input;
+		size_t input_consumers;
+		std::vector<std::unique_ptr<pipeline_stage_base>> stages;
+	};
+}
+
+
+template <class Source>
+class pipeline;
+
+template <class Source>
+class pipeline_source;
+
+
+// Builds a pipeline one stage at a time, Out is the item type produced by the last (still open) stage.  Stage functions are either one to one,
+// R(Out&&) through then(), or one to many, void(Out&&, std::vector<R>&) through then_each() which covers filtering and aggregation.
+template <class Source, class Out>
+class pipeline_builder
+{
+public:
+	pipeline_builder(std::shared_ptr<detail::pipeline_state<Source>> state, std::shared_ptr<detail::pipeline_head<Out>> head, std::string name, size_t parallelism, bool light)
+		: state_(std::move(state)), head_(std::move(head)), name_(std::move(name)), parallelism_(parallelism), light_(light) {}
+
+	template <class F, class R = decltype(std::declval<F&>()(std::declval<Out&&>()))>
+	pipeline_builder<Source, R> then(std::string name, size_t parallelism, F fn, bool light = false)
+	{
+		return connect<R>(std::move(name), parallelism, light, [fn](std::vector<Out> &in, std::vector<R> &out) mutable
+		{
+			out.reserve(out.size() + in.size());
+			for (auto &item : in)
+				out.push_back(fn(std::move(item)));
+		});
+	}
+
+	template <class R, class F>
+	pipeline_builder<Source, R> then_each(std::string name, size_t parallelism, F fn, bool light = false)
+	{
+		return connect<R>(std::move(name), parallelism, light, [fn](std::vector<Out> &in, std::vector<R> &out) mutable
+		{
+			for (auto &item : in)
+				fn(std::move(item), out);
+		});
+	}
+
+	template <class F>
+	pipeline<Source> sink(std::string name, size_t parallelism, F fn, bool light = false);
+
+private:
+	template <class R>
+	pipeline_builder<Source, R> connect(std::string, size_t, bool, std::function<void(std::vector<Out>&, std::vector<R>&)>);
+
+	bool fuses_with(size_t parallelism, bool light) const
+	{
+		return state_->options.fuse && parallelism == parallelism_ && (light || light_);
+	}
+
+	// Closes off the open stage by giving it an output queue, returns the input head of the next stage.
+	std::shared_ptr<detail::pipeline_head<Out>> materialize(size_t downstream)
+	{
+		auto output = std::allocate_shared<detail::pipeline_queue<Out>>(detail::aligned_allocator<detail::pipeline_queue<Out>>(), detail::pipeline_queue_capacity(parallelism_, downstream, state_->options));
+		state_->stages.emplace_back(new detail::pipeline_stage<Out>(name_, parallelism_, head_, output, downstream));
+		return std::make_shared<detail::pipeline_input_head<Out>>(output);
+	}
+
+	std::shared_ptr<detail::pipeline_state<Source>> state_;
+	std::shared_ptr<detail::pipeline_head<Out>> head_;
+	std::string name_;
+	size_t parallelism_;
+	bool light_;
+};
+
+
+// A running (or ready to run) pipeline.  Feed it through sources, then close() it, which propagates end of stream stage by stage, and wait() for it.
+template <class Source>
+class pipeline
+{
+public:
+	explicit pipeline(std::shared_ptr<detail::pipeline_state<Source>>);
+	pipeline(pipeline&&) = default;
+	~pipeline();
+
+	void start();
+	void push(std::vector<Source>&&);
+	pipeline_source<Source> source();
+	void close();
+	void wait();
+
+	std::vector<stage_metrics> metrics() const;
+
+private:
+	std::shared_ptr<detail::pipeline_state<Source>> state_;
+	std::vector<std::thread> threads_;
+	bool closed_;
+};
+
+
+// Collects items into batches for a pipeline, one per producing thread.  Whatever is left is pushed on flush() or destruction.
+template <class Source>
+class pipeline_source
+{
+public:
+	pipeline_source(pipeline<Source> &p, size_t batch_size) : pipeline_(&p), batch_size_(batch_size) {}
+	pipeline_source(pipeline_source &&other) : pipeline_(other.pipeline_), batch_size_(other.batch_size_), batch_(std::move(other.batch_))
+	{
+		other.pipeline_ = nullptr; // The moved from source has nothing to flush.
+	}
+	~pipeline_source()
+	{
+		if (pipeline_ != nullptr)
+			flush();
+	}
+
+	void push(Source &&s)
+	{
+		batch_.push_back(std::move(s));
+		if (batch_.size() >= batch_size_)
+			flush();
+	}
+
+	void flush()
+	{
+		if (!batch_.empty())
+			pipeline_->push(std::move(batch_));
+		batch_.clear();
+		batch_.reserve(batch_size_);
+	}
+
+private:
+	pipeline<Source> *pipeline_;
+	size_t batch_size_;
+	std::vector<Source> batch_;
+};
+
+
+// Starts a pipeline with its first stage.
+template <class Source, class F, class R = decltype(std::declval<F&>()(std::declval<Source&&>()))>
+pipeline_builder<Source, R> make_pipeline(std::string name, size_t parallelism, F fn, pipeline_options options = pipeline_options(), bool light = false)
+{
+	if (parallelism == 0)
+		throw std::invalid_argument("specified parallelism is zero - a stage needs at least one worker");
+
+	auto state = std::make_shared<detail::pipeline_state<Source>>();
+	state->options = options;
+	state->input = std::allocate_shared<detail::pipeline_queue<Source>>(detail::aligned_allocator<detail::pipeline_queue<Source>>(), detail::pipeline_queue_capacity(1, parallelism, options));
+	state->input_consumers = parallelism;
+
+	auto input = std::make_shared<detail::pipeline_input_head<Source>>(state->input);
+	auto head = std::make_shared<detail::pipeline_map_head<Source, R>>(input, [fn](std::vector<Source> &in, std::vector<R> &out) mutable
+	{
+		out.reserve(out.size() + in.size());
+		for (auto &item : in)
+			out.push_back(fn(std::move(item)));
+	});
+
+	return pipeline_builder<Source, R>(state, head, std::move(name), parallelism, light);
+}
+
+
+template <class Source, class Out>
+template <class R>
+pipeline_builder<Source, R> pipeline_builder<Source, Out>::connect(std::string name, size_t parallelism, bool light, std::function<void(std::vector<Out>&, std::vector<R>&)> fn)
+{
+	if (parallelism == 0)
+		throw std::invalid_argument("specified parallelism is zero - a stage needs at least one worker");
+
+	if (fuses_with(parallelism, light))
+	{
+		auto head = std::make_shared<detail::pipeline_map_head<Out, R>>(head_, std::move(fn));
+		return pipeline_builder<Source, R>(state_, head, name_ + "+" + name, parallelism, light && light_);
+	}
+
+	auto head = std::make_shared<detail::pipeline_map_head<Out, R>>(materialize(parallelism), std::move(fn));
+	return pipeline_builder<Source, R>(state_, head, std::move(name), parallelism, light);
+}
+
+template <class Source, class Out>
+template <class F>
+pipeline<Source> pipeline_builder<Source, Out>::sink(std::string name, size_t parallelism, F fn, bool light)
+{
+	if (parallelism == 0)
+		throw std::invalid_argument("specified parallelism is zero - a stage needs at least one worker");
+
+	if (fuses_with(parallelism, light))
+		state_->stages.emplace_back(new detail::pipeline_sink_stage<Out>(name_ + "+" + name, parallelism, head_, fn));
+	else
+		state_->stages.emplace_back(new detail::pipeline_sink_stage<Out>(std::move(name), parallelism, materialize(parallelism), fn));
+
+	return pipeline<Source>(state_);
+}
+
+
+template <class Source>
+pipeline<Source>::pipeline(std::shared_ptr<detail::pipeline_state<Source>> state) : state_(std::move(state)), closed_(false)
+{
+}
+
+template <class Source>
+pipeline<Source>::~pipeline()
+{
+	if (!threads_.empty())
+	{
+		close();
+		wait();
+	}
+}
+
+template <class Source>
+void pipeline<Source>::start()
+{
+	auto started = detail::pipeline_clock::now();
+	for (auto &stage : state_->stages)
+		stage->start(threads_, started);
+}
+
+template <class Source>
+void pipeline<Source>::push(std::vector<Source> &&items)
+{
+	detail::pipeline_batch<Source> batch;
+	batch.items = std::move(items);
+	batch.end = false;
+	state_->input->push(std::move(batch));
+}
+
+template <class Source>
+pipeline_source<Source> pipeline<Source>::source()
+{
+	return pipeline_source<Source>(*this, state_->options.batch_size);
+}
+
+// Every source must have been flushed before the pipeline is closed.
+template <class Source>
+void pipeline<Source>::close()
+{
+	if (closed_)
+		return;
+
+	closed_ = true;
+	detail::push_end_of_stream(*state_->input, state_->input_consumers);
+}
+
+template <class Source>
+void pipeline<Source>::wait()
+{
+	for (auto &t : threads_)
+		t.join();
+	threads_.clear();
+}
+
+template <class Source>
+std::vector<stage_metrics> pipeline<Source>::metrics() const
+{
+	std::vector<stage_metrics> m;
+	for (auto &stage : state_->stages)
+		m.push_back(stage->metrics());
+	return m;
+}
+
+#endif // GUARUNTEED_MPMC_PIPELINE_HPP
@@ -3,13 +3,38 @@
 
 #include "stdafx.h"
 
+#include "adaptive_queue.hpp"
+#include "async_logger.hpp"
+#include "baseline_queues.hpp"
+#include "bench_results.hpp"
+#include "flat_combining_queue.hpp"
+#include "idle_release.hpp"
+#include "microbench.hpp"
+#include "numa_queue.hpp"
+#include "packed_queue.hpp"
+#include "percpu_queue.hpp"
+#include "perf_counters.hpp"
+#include "pipeline.hpp"
 #include "queue.hpp"
+#include "queue_adapter.hpp"
+#include "queue_scheduler.hpp"
+#include "task_graph.hpp"
+#include "ticket_queue.hpp"
+#include "trace.hpp"
+#include "tuner.hpp"
+#include "uring_sink.hpp"
 
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <numeric>
+#include <sstream>
 #include <thread>
 #include <boost/chrono.hpp>
 #include <boost/lockfree/queue.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
 #include <boost/thread/barrier.hpp>
 
 
@@ -30,119 +55,231 @@ using boost::barrier;
 
 typedef queue<size_t> queue_t;
 typedef boost::lockfree::queue<size_t, boost::lockfree::fixed_sized<true>> boost_queue_t;
+typedef boost::lockfree::spsc_queue<size_t> boost_spsc_queue_t;
 typedef boost::chrono::duration<double> seconds;
 typedef boost::chrono::high_resolution_clock timer;
 
 #define TRY_PUSH_POP__
 static const uint16_t attempts = 4;
 
-void consecutive_producer(size_t count, barrier &barrier, queue_t &queue)
+// Every implementation the scenarios run against, see queue_adapter.hpp for adding one.
+template <class... Queues>
+struct queue_list {};
+
+template <class T>
+using benchmark_queues_of = queue_list<boost::lockfree::queue<T, boost::lockfree::fixed_sized<true>>, boost::lockfree::spsc_queue<T>, locked_queue<T>, blocking_queue<T>, queue<T>, ticket_queue<T>, packed_queue<T>, percpu_queue<T>, adaptive_queue<T>, numa_queue<T>, flat_combining_queue<T>>;
+
+typedef benchmark_queues_of<size_t> benchmark_queues;
+
+template <class Queue>
+struct queue_tag
 {
-	barrier.wait();
-	for (size_t i = 0; i != count; ++i)
+	typedef Queue type;
+};
+
+template <class F>
+void for_each_queue(queue_list<>, F&&) {}
+
+template <class Queue, class... Queues, class F>
+void for_each_queue(queue_list<Queue, Queues...>, F &&f)
+{
+	f(queue_tag<Queue>());
+	for_each_queue(queue_list<Queues...>(), std::forward<F>(f));
+}
+
+// Items are tagged with the producer that pushed them and that producer's sequence number, consumers check every item they pop in optimized builds
+// too (the numbers worth checking are the release build numbers).  A queue is FIFO, so each consumer must see every producer's sequence numbers
+// strictly increasing, a repeat or step back is a duplicated or reordered item, and dropped items show up as a short count or checksum.  Turn off
+// to measure the overhead of the checks.
+#define VERIFY_ITEMS__
+static const unsigned sequence_bits = 40;
+static const size_t sequence_mask = (size_t(1) << sequence_bits) - 1;
+
+size_t tag_item(size_t producer, size_t sequence)
+{
+	return (producer << sequence_bits) | sequence;
+}
+
+class item_check
+{
+public:
+	// Without ordered only the count and checksum are checked, for implementations that aren't FIFO (see queue_adapter::fifo).
+	item_check(size_t producer_count, bool ordered = true) : next_(producer_count, 0), ordered_(ordered), count_(0), sum_(0), errors_(0) {}
+
+	void operator()(size_t v)
 	{
-		size_t ip = i;
-#if !defined(TRY_PUSH_POP__)
-		queue.push(move(ip));
+#if defined(VERIFY_ITEMS__)
+		size_t producer = v >> sequence_bits;
+		size_t sequence = v & sequence_mask;
+		if (producer >= next_.size() || (ordered_ && sequence < next_[producer]))
+			++errors_;
+		else
+			next_[producer] = sequence + 1;
+		++count_;
+		sum_ += v;
 #else
-		while (!queue.try_push(ip, attempts))
+		(void)v;
+#endif
+	}
+
+	// Folds another consumer's check into this one.
+	void merge(item_check const &other)
+	{
+		count_ += other.count_;
+		sum_ += other.sum_;
+		errors_ += other.errors_;
+	}
+
+	// Compares what was consumed with what producer_count producers of producer_iterations items each pushed, prints and counts a failure.
+	bool reconcile(char const *name, size_t producer_iterations) const
+	{
+		return reconcile(name, std::vector<size_t>(next_.size(), producer_iterations));
+	}
+
+	// As above with the number of items each producer pushed.
+	bool reconcile(char const *name, std::vector<size_t> const &producer_iterations) const
+	{
+#if defined(VERIFY_ITEMS__)
+		uint64_t expected_count = 0;
+		uint64_t expected_sum = 0;
+		for (size_t p = 0; p != next_.size(); ++p)
 		{
-			std::this_thread::yield();
+			uint64_t n = producer_iterations[p];
+			expected_count += n;
+			expected_sum += static_cast<uint64_t>(tag_item(p, 0)) * n + n * (n - 1) / 2;
 		}
+
+		if (errors_ == 0 && count_ == expected_count && sum_ == expected_sum)
+			return true;
+
+		cout << "VERIFICATION FAILED for " << name << ": " << errors_ << " out of order or duplicated items, consumed " << count_ << " of " << expected_count
+			<< " items, checksum " << sum_ << " expected " << expected_sum << endl;
+		++failures();
+		return false;
+#else
+		(void)name;
+		(void)producer_iterations;
+		return true;
 #endif
 	}
-}
 
-void boost_consecutive_producer(size_t count, barrier &barrier, boost_queue_t &queue)
-{
-	barrier.wait();
-	for (size_t i = 0; i != count; ++i)
+	// Failed reconciliations over the whole run, non zero fails the bench mode.
+	static size_t& failures()
 	{
-		size_t ip = i;
-		while (!queue.push(ip)) {}
+		static size_t count = 0;
+		return count;
 	}
+
+private:
+	std::vector<size_t> next_;
+	bool ordered_;
+	uint64_t count_;
+	uint64_t sum_;
+	uint64_t errors_;
+};
+
+// The share of total_iterations a consumer pops, the last one takes the remainder.
+size_t consumer_share(size_t total_iterations, size_t consumer_count, size_t consumer)
+{
+	size_t share = total_iterations / consumer_count;
+	return consumer + 1 == consumer_count ? share + total_iterations % consumer_count : share;
 }
 
-void consecutive_consumer(size_t count, barrier &barrier, queue_t &queue)
+template <class Queue>
+void consecutive_producer(size_t producer, size_t count, barrier &barrier, Queue &queue)
 {
+	typedef queue_adapter<Queue> adapter;
+
 	barrier.wait();
 	for (size_t i = 0; i != count; ++i)
 	{
+		typename adapter::value_type ip(tag_item(producer, i));
 #if !defined(TRY_PUSH_POP__)
-		size_t v = queue.pop();
-		assert(v == i);
+		adapter::push(queue, move(ip));
 #else
-		queue_t::optional_t v;
-		for (v = queue.try_pop(attempts); !static_cast<bool>(v); v = queue.try_pop(attempts))
+		while (!adapter::try_push(queue, ip, attempts))
 		{
 			std::this_thread::yield();
 		}
-		assert(*v == i);
 #endif
-		
 	}
 }
 
-void boost_consecutive_consumer(size_t count, barrier &barrier, boost_queue_t &queue)
+// Pops count items, checking each, then hands the check back through result (a local until then, consumers don't share cache lines per item).
+template <class Queue>
+void checked_consumer(size_t count, size_t producer_count, barrier &barrier, Queue &queue, item_check &result)
 {
-	barrier.wait();
-	for (size_t i = 0; i != count; ++i)
-	{
-		size_t v = std::numeric_limits<size_t>::max();
-		while (!queue.pop(v)) {}
-		assert(v == i);
-	}
-}
+	typedef queue_adapter<Queue> adapter;
+	item_check check(producer_count, queue_adapter<Queue>::fifo);
 
-void bounded_consumer(size_t count, size_t bound, barrier &barrier, queue_t &queue)
-{
 	barrier.wait();
 	for (size_t i = 0; i != count; ++i)
 	{
 #if !defined(TRY_PUSH_POP__)
-		size_t v = queue.pop();
-		assert(v < i);
+		typename adapter::value_type v = adapter::pop(queue);
 #else
-		queue_t::optional_t v;
-		for (v = queue.try_pop(attempts); !static_cast<bool>(v); v = queue.try_pop(attempts))
+		typename adapter::value_type v(std::numeric_limits<size_t>::max());
+		while (!adapter::try_pop(queue, v, attempts))
 		{
 			std::this_thread::yield();
 		}
-		assert(*v < bound);
 #endif
+		check(static_cast<size_t>(v));
 	}
+	result = check;
 }
 
-void boost_bounded_consumer(size_t count, size_t bound, barrier &barrier, boost_queue_t &queue)
+template <class Queue>
+void batch_producer(size_t producer, size_t count, size_t batch_size, barrier &barrier, Queue &queue)
 {
+	std::vector<size_t> batch(batch_size);
+
 	barrier.wait();
-	for (size_t i = 0; i != count; ++i)
+	for (size_t i = 0; i != count; )
+	{
+		size_t n = std::min(batch_size, count - i);
+		for (size_t j = 0; j != n; ++j)
+			batch[j] = tag_item(producer, i + j);
+		queue_adapter<Queue>::push_batch(queue, batch.data(), n);
+		i += n;
+	}
+}
+
+template <class Queue>
+void batch_consumer(size_t count, size_t producer_count, size_t batch_size, barrier &barrier, Queue &queue, item_check &result)
+{
+	std::vector<size_t> batch(batch_size);
+	item_check check(producer_count, queue_adapter<Queue>::fifo);
+
+	barrier.wait();
+	for (size_t i = 0; i != count; )
 	{
-		size_t v = std::numeric_limits<size_t>::max();
-		while (!queue.pop(v)) {}
-		assert(v < bound);
+		size_t n = queue_adapter<Queue>::try_pop_batch(queue, batch.data(), std::min(batch_size, count - i), attempts);
+		if (n == 0)
+			std::this_thread::yield();
+		for (size_t j = 0; j != n; ++j)
+			check(batch[j]);
+		i += n;
 	}
+	result = check;
 }
 
-void queue_test(size_t capacity, size_t producer_count, size_t consumer_count, size_t producer_iterations)
+// Runs the producer and consumer threads to completion once they have all reached the barrier, returns the seconds that took.
+template <class Producer, class Consumer>
+double timed_run(size_t producer_count, size_t consumer_count, Producer producer, Consumer consumer)
 {
-	queue_t q(capacity);
 	barrier b(static_cast<unsigned int>(producer_count + consumer_count + 1));
 
 	std::vector<thread> producers;
 	std::vector<thread> consumers;
 
-	size_t total_iterations = producer_count * producer_iterations;
-	size_t consumer_iterations = total_iterations / consumer_count;
-
 	for (size_t i = 0; i != producer_count; ++i)
 	{
-		producers.emplace_back(consecutive_producer, producer_iterations, std::ref(b), std::ref(q));
-		
+		producers.emplace_back(producer, i, std::ref(b));
 	}
 	for (size_t i = 0; i != consumer_count; ++i)
 	{
-		consumers.emplace_back(bounded_consumer, consumer_iterations, producer_iterations, std::ref(b), std::ref(q));
+		consumers.emplace_back(consumer, i, std::ref(b));
 	}
 
 	b.wait();
@@ -157,132 +294,1507 @@ void queue_test(size_t capacity, size_t producer_count, size_t consumer_count, s
 	});
 	auto t1 = timer::now();
 	seconds dur = t1 - t0;
-	double rate = static_cast<double>(total_iterations) / dur.count();
-	
-	cout << "queue size is: " << capacity << " producer count is: " << producer_count << " consumer count is: " << consumer_count << endl;
-	cout << "completed " << producer_iterations << " iterations for each producer in " << std::fixed << std::setprecision(5) << dur << " @ " << std::setprecision(1) << rate << " items / second" << endl;
+	return dur.count();
 }
 
-void boost_queue_test(size_t capacity, size_t producer_count, size_t consumer_count, size_t producer_iterations)
+void report_rate(char const *name, char const *scenario, size_t capacity, size_t producer_count, size_t consumer_count, size_t producer_iterations, double dur)
 {
-	boost_queue_t q(capacity);
-	barrier b(static_cast<unsigned int>(producer_count + consumer_count + 1));
+	double rate = static_cast<double>(producer_count * producer_iterations) / dur;
+	cout << name << scenario << " size is: " << capacity << " producer count is: " << producer_count << " consumer count is: " << consumer_count << endl;
+	cout << "completed " << producer_iterations << " iterations for each producer in " << std::fixed << std::setprecision(5) << dur << " seconds @ " << std::setprecision(1) << rate << " items / second" << endl;
+}
 
-	std::vector<thread> producers;
-	std::vector<thread> consumers;
+// Reconciles the consumers' checks against what the producers pushed.
+void reconcile(char const *name, std::vector<item_check> const &checks, size_t producer_count, size_t producer_iterations)
+{
+	item_check total(producer_count);
+	for (auto const &c : checks)
+		total.merge(c);
+	total.reconcile(name, producer_iterations);
+}
 
+// A single producer and consumer, the consumer must see exactly the producer's order.
+template <class Queue>
+double sequence_test(size_t capacity, size_t iterations)
+{
+	Queue q(capacity);
+	std::vector<item_check> checks(1, item_check(1, queue_adapter<Queue>::fifo));
+	double dur = timed_run(1, 1,
+		[&](size_t p, barrier &b) { consecutive_producer(p, iterations, b, q); },
+		[&](size_t c, barrier &b) { checked_consumer(iterations, 1, b, q, checks[c]); });
+
+	report_rate(queue_adapter<Queue>::name(), " sequence", capacity, 1, 1, iterations, dur);
+	reconcile(queue_adapter<Queue>::name(), checks, 1, iterations);
+	return static_cast<double>(iterations) / dur;
+}
+
+template <class Queue>
+double queue_test(size_t capacity, size_t producer_count, size_t consumer_count, size_t producer_iterations)
+{
+	Queue q(capacity);
 	size_t total_iterations = producer_count * producer_iterations;
-	size_t consumer_iterations = total_iterations / consumer_count;
+	std::vector<item_check> checks(consumer_count, item_check(producer_count, queue_adapter<Queue>::fifo));
 
-	for (size_t i = 0; i != producer_count; ++i)
+	double dur = timed_run(producer_count, consumer_count,
+		[&](size_t p, barrier &b) { consecutive_producer(p, producer_iterations, b, q); },
+		[&](size_t c, barrier &b) { checked_consumer(consumer_share(total_iterations, consumer_count, c), producer_count, b, q, checks[c]); });
+
+	report_rate(queue_adapter<Queue>::name(), "", capacity, producer_count, consumer_count, producer_iterations, dur);
+	reconcile(queue_adapter<Queue>::name(), checks, producer_count, producer_iterations);
+	return static_cast<double>(total_iterations) / dur;
+}
+
+// Items per second through q, checking every item like queue_test but without the report, for modes that tabulate their runs.
+template <class Queue>
+double checked_rate(Queue &q, size_t producer_count, size_t consumer_count, size_t producer_iterations)
+{
+	size_t total_iterations = producer_count * producer_iterations;
+	std::vector<item_check> checks(consumer_count, item_check(producer_count, queue_adapter<Queue>::fifo));
+	double dur = timed_run(producer_count, consumer_count,
+		[&](size_t p, barrier &b) { consecutive_producer(p, producer_iterations, b, q); },
+		[&](size_t c, barrier &b) { checked_consumer(consumer_share(total_iterations, consumer_count, c), producer_count, b, q, checks[c]); });
+	reconcile(queue_adapter<Queue>::name(), checks, producer_count, producer_iterations);
+	return static_cast<double>(total_iterations) / dur;
+}
+
+template <class Queue>
+double batch_queue_test(size_t capacity, size_t producer_count, size_t consumer_count, size_t producer_iterations, size_t batch_size)
+{
+	Queue q(capacity);
+	size_t total_iterations = producer_count * producer_iterations;
+	std::vector<item_check> checks(consumer_count, item_check(producer_count, queue_adapter<Queue>::fifo));
+
+	double dur = timed_run(producer_count, consumer_count,
+		[&](size_t p, barrier &b) { batch_producer(p, producer_iterations, batch_size, b, q); },
+		[&](size_t c, barrier &b) { batch_consumer(consumer_share(total_iterations, consumer_count, c), producer_count, batch_size, b, q, checks[c]); });
+
+	report_rate(queue_adapter<Queue>::name(), " batch", capacity, producer_count, consumer_count, producer_iterations, dur);
+	reconcile(queue_adapter<Queue>::name(), checks, producer_count, producer_iterations);
+	return static_cast<double>(total_iterations) / dur;
+}
+
+// Every implementation that supports the thread counts, one after the other.
+void paired_queue_test(size_t capacity, size_t producer_count, size_t consumer_count, size_t producer_iterations)
+{
+	cout << "\n================================================================================\n" << endl;
+	bool first = true;
+	for_each_queue(benchmark_queues(), [&](auto tag)
 	{
-		producers.emplace_back(boost_consecutive_producer, producer_iterations, std::ref(b), std::ref(q));
+		typedef typename decltype(tag)::type Queue;
+		if (!queue_adapter<Queue>::supports(producer_count, consumer_count))
+			return;
+		if (!first)
+			cout << "--------------------------------------------------------------------------------" << endl;
+		first = false;
+		queue_test<Queue>(capacity, producer_count, consumer_count, producer_iterations);
+	});
+}
 
+
+void logger_producer(size_t count, barrier &barrier, async_logger &logger, double &ns_per_log)
+{
+	barrier.wait();
+	auto t0 = timer::now();
+	for (size_t i = 0; i != count; ++i)
+	{
+		logger.log("item {} of {} at {}", i, count, 0.5);
 	}
-	for (size_t i = 0; i != consumer_count; ++i)
+	auto t1 = timer::now();
+	ns_per_log = boost::chrono::duration<double, boost::nano>(t1 - t0).count() / static_cast<double>(count);
+}
+
+void logger_test(size_t capacity, size_t producer_count, size_t producer_iterations, log_full_policy policy, char const *policy_name)
+{
+#if defined(_WIN32)
+	std::FILE *sink = std::fopen("NUL", "wb");
+	int fd = _fileno(sink);
+#else
+	std::FILE *sink = std::fopen("/dev/null", "wb");
+	int fd = fileno(sink);
+#endif
+
+	std::vector<double> ns_per_log(producer_count);
+	size_t dropped = 0;
+	auto t0 = timer::now();
 	{
-		consumers.emplace_back(boost_bounded_consumer, consumer_iterations, producer_iterations, std::ref(b), std::ref(q));
+		async_logger logger(fd, capacity, policy);
+		barrier b(static_cast<unsigned int>(producer_count));
+
+		std::vector<thread> producers;
+		for (size_t i = 0; i != producer_count; ++i)
+		{
+			producers.emplace_back(logger_producer, producer_iterations, std::ref(b), std::ref(logger), std::ref(ns_per_log[i]));
+		}
+		std::for_each(begin(producers), end(producers), [=](thread &t) -> void
+		{
+			t.join();
+		});
+		logger.flush();
+		dropped = logger.dropped();
 	}
+	auto t1 = timer::now();
+	seconds dur = t1 - t0;
+	std::fclose(sink);
 
-	b.wait();
+	double mean_ns = std::accumulate(begin(ns_per_log), end(ns_per_log), 0.0) / static_cast<double>(producer_count);
+	cout << "logger queue size is: " << capacity << " producer count is: " << producer_count << " full policy is: " << policy_name << endl;
+	cout << "logged " << producer_iterations << " records for each producer in " << std::fixed << std::setprecision(5) << dur << " @ " << std::setprecision(1) << mean_ns << " ns / record on the hot path";
+	if (policy == log_full_policy::count_drops)
+		cout << " (" << dropped << " dropped)";
+	cout << endl;
+}
+
+void pipeline_test(size_t producer_count, size_t producer_iterations, bool fuse)
+{
+	pipeline_options options;
+	options.fuse = fuse;
+
+	// parse -> transform -> aggregate -> write, transform is light enough to be fused onto the parse threads.
+	std::atomic<uint64_t> written(0);
+	uint64_t running_total = 0;
+	auto p = make_pipeline<size_t>("parse", 2, [](size_t i) -> uint64_t { return static_cast<uint64_t>(i) * 3; }, options)
+		.then("transform", 2, [](uint64_t v) -> uint64_t { return v + 1; }, true)
+		.then_each<uint64_t>("aggregate", 1, [&running_total](uint64_t v, std::vector<uint64_t> &out)
+		{
+			running_total += v;
+			if (v % 1000 == 1)
+				out.push_back(running_total);
+		})
+		.sink("write", 1, [&written](uint64_t) { ++written; });
+
+	p.start();
 	auto t0 = timer::now();
-	std::for_each(begin(producers), end(producers), [=](thread &t) -> void
+	std::vector<thread> producers;
+	for (size_t i = 0; i != producer_count; ++i)
 	{
-		t.join();
-	});
-	std::for_each(begin(consumers), end(consumers), [=](thread &t) -> void
+		producers.emplace_back([&p, producer_iterations]() -> void
+		{
+			auto source = p.source();
+			for (size_t i = 0; i != producer_iterations; ++i)
+				source.push(move(i));
+		});
+	}
+	std::for_each(begin(producers), end(producers), [=](thread &t) -> void
 	{
 		t.join();
 	});
+	p.close();
+	p.wait();
 	auto t1 = timer::now();
 	seconds dur = t1 - t0;
+	size_t total_iterations = producer_count * producer_iterations;
 	double rate = static_cast<double>(total_iterations) / dur.count();
 
-	cout << "boost queue size is: " << capacity << " producer count is: " << producer_count << " consumer count is: " << consumer_count << endl;
-	cout << "completed " << producer_iterations << " iterations for each producer in " << std::fixed << std::setprecision(5) << dur << " @ " << std::setprecision(1) << rate << " items / second" << endl;
+	cout << "pipeline producer count is: " << producer_count << " fusion is: " << (fuse ? "on" : "off") << endl;
+	cout << "completed " << producer_iterations << " iterations for each producer in " << std::fixed << std::setprecision(5) << dur << " @ " << std::setprecision(1) << rate << " items / second, wrote " << written << endl;
+	for (auto const &m : p.metrics())
+	{
+		cout << "  stage " << std::setw(16) << std::left << m.name << std::right << " x" << m.parallelism << " in " << m.items_in << " out " << m.items_out << " batches " << m.batches
+			<< " @ " << std::setprecision(1) << m.throughput() << " items / second, " << std::setprecision(1) << m.latency() * 1e9 << " ns / item" << endl;
+	}
+}
+
+// Stands in for a small task, about a microsecond of work per 1000 iterations.
+void spin_work(size_t iterations)
+{
+	volatile size_t sink = 0;
+	for (size_t i = 0; i != iterations; ++i)
+		sink = sink + i;
 }
 
-void paired_queue_test(size_t capacity, size_t producer_count, size_t consumer_count, size_t producer_iterations)
+// One root fanning out to width tasks which all join into one exit task.
+task_graph wide_graph(size_t width, size_t work)
 {
+	task_graph g;
+	auto root = g.add_task([=] { spin_work(work); });
+	auto exit = g.add_task([=] { spin_work(work); });
+	for (size_t i = 0; i != width; ++i)
+	{
+		auto t = g.add_task([=] { spin_work(work); });
+		g.add_dependency(root, t);
+		g.add_dependency(t, exit);
+	}
+	return g;
+}
 
-	cout << "\n================================================================================\n" << endl;
-	boost_queue_test(capacity, producer_count, consumer_count, producer_iterations);
-	cout << "--------------------------------------------------------------------------------" << endl;
-	queue_test(capacity, producer_count, consumer_count, producer_iterations);
+// Independent chains of depth tasks.
+task_graph deep_graph(size_t chains, size_t depth, size_t work)
+{
+	task_graph g;
+	for (size_t c = 0; c != chains; ++c)
+	{
+		auto previous = g.add_task([=] { spin_work(work); });
+		for (size_t d = 1; d != depth; ++d)
+		{
+			auto t = g.add_task([=] { spin_work(work); });
+			g.add_dependency(previous, t);
+			previous = t;
+		}
+	}
+	return g;
 }
 
+// A long chain next to a lot of independent filler, finishing early needs the chain to be started ahead of the filler.
+task_graph critical_path_graph(size_t depth, size_t filler, size_t work)
+{
+	task_graph g;
+	for (size_t i = 0; i != filler; ++i)
+		g.add_task([=] { spin_work(work); });
+
+	auto previous = g.add_task([=] { spin_work(work); });
+	for (size_t d = 1; d != depth; ++d)
+	{
+		auto t = g.add_task([=] { spin_work(work); });
+		g.add_dependency(previous, t);
+		previous = t;
+	}
+	return g;
+}
 
-int main()
+void task_graph_test(char const *name, task_graph const &graph, size_t worker_count, task_scheduling scheduling)
 {
-	
+	task_graph_executor executor(worker_count, scheduling);
+	auto t0 = timer::now();
+	executor.run(graph);
+	auto t1 = timer::now();
+	seconds dur = t1 - t0;
+	double rate = static_cast<double>(graph.size()) / dur.count();
 
-#ifdef _M_AMD64
-	size_t max_capacity = detail::queue_size<size_t>::max_capacity;
-	assert(max_capacity == 4611686018427387904);
-#elif _M_IX86
-	size_t max_capacity = detail::queue_size<size_t>::max_capacity;
-	assert(max_capacity == 1073741824);
-#endif
+	cout << "task graph " << name << " of " << graph.size() << " tasks, worker count is: " << worker_count << " scheduling is: " << (scheduling == task_scheduling::fifo ? "fifo" : "critical path") << endl;
+	cout << "completed in " << std::fixed << std::setprecision(5) << dur << " @ " << std::setprecision(1) << rate << " tasks / second" << endl;
+}
 
+void scheduler_test(size_t worker_count, size_t round_trips, size_t bulk_shape)
+{
+	queue_context context(worker_count);
+	queue_scheduler scheduler = context.get_scheduler();
 
-	assert(detail::queue_size<size_t>::round_up_to_power_of_2(2) == 2);
-	assert(detail::queue_size<size_t>::round_up_to_power_of_2(3) == 4);
-	assert(detail::queue_size<size_t>::round_up_to_power_of_2(4) == 4);
-	assert(detail::queue_size<size_t>::round_up_to_power_of_2(5) == 8);
-	assert(detail::queue_size<size_t>::round_up_to_power_of_2(1023) == 1024);
-	assert(detail::queue_size<size_t>::round_up_to_power_of_2(1024) == 1024);
-	assert(detail::queue_size<size_t>::round_up_to_power_of_2(1025) == 2048);
+	auto t0 = timer::now();
+	for (size_t i = 0; i != round_trips; ++i)
+	{
+		sync_wait(scheduler.schedule());
+	}
+	auto t1 = timer::now();
+	double ns_per_round_trip = boost::chrono::duration<double, boost::nano>(t1 - t0).count() / static_cast<double>(round_trips);
+
+	std::vector<size_t> results(bulk_shape);
+	auto t2 = timer::now();
+	sync_wait(scheduler.bulk(bulk_shape, [&results](size_t i) { results[i] = i * 2; }));
+	auto t3 = timer::now();
+	seconds dur = t3 - t2;
+	double rate = static_cast<double>(bulk_shape) / dur.count();
+
+	cout << "scheduler worker count is: " << worker_count << endl;
+	cout << "completed " << round_trips << " schedule round trips @ " << std::fixed << std::setprecision(1) << ns_per_round_trip << " ns / round trip, bulk of " << bulk_shape
+		<< " in " << std::setprecision(5) << dur << " @ " << std::setprecision(1) << rate << " items / second" << endl;
+}
+
+#if defined(__linux__)
+struct sink_record
+{
+	size_t sequence;
+	char payload[56];
+};
+
+void sink_producer(size_t count, barrier &barrier, queue<sink_record> &queue)
+{
+	barrier.wait();
+	for (size_t i = 0; i != count; ++i)
+	{
+		sink_record r;
+		r.sequence = i;
+		std::memset(r.payload, 'x', sizeof(r.payload));
+		queue.push(move(r));
+	}
+}
+
+// Baseline for the sink, one write() per item.
+void write_per_item_consumer(size_t count, int fd, barrier &barrier, queue<sink_record> &queue)
+{
+	barrier.wait();
+	for (size_t i = 0; i != count; ++i)
+	{
+		sink_record r = queue.pop();
+		if (::write(fd, &r, sizeof(r)) != static_cast<ssize_t>(sizeof(r)))
+			throw std::runtime_error("write failed");
+	}
+}
+
+void uring_sink_consumer(size_t count, int fd, barrier &barrier, queue<sink_record> &queue, uint64_t &writes)
+{
+	uring_sink<sink_record> sink(queue, fd);
+	barrier.wait();
+	for (size_t drained = 0; drained != count; )
+	{
+		drained += sink.drain(count - drained, attempts);
+	}
+	sink.flush();
+	writes = sink.writes();
+}
+
+// Resident set size of the process in bytes.
+size_t resident_bytes()
+{
+	size_t pages = 0;
+	size_t resident = 0;
+	std::ifstream statm("/proc/self/statm");
+	statm >> pages >> resident;
+	return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+// A burst through a large queue, then a trickle while the releaser returns the idle part of the buffer, then a second burst faulting it back in.
+void idle_memory_test(size_t capacity, size_t trickle)
+{
+	queue<size_t> q(capacity);
+	size_t before = resident_bytes();
+	for (size_t i = 0; i != capacity; ++i)
+		q.push(move(i));
+	for (size_t i = 0; i != capacity; ++i)
+		q.pop();
+	size_t burst = resident_bytes();
+
+	for (size_t i = 0; i != trickle; ++i)
+		q.push(move(i));
+
+	idle_release_policy policy;
+	policy.sample_interval = std::chrono::milliseconds(10);
+	policy.idle_samples = 5;
+	size_t released = 0;
+	{
+		idle_memory_releaser<queue<size_t>> releaser(q, policy);
+		while (releaser.releases() == 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		released = releaser.released_bytes();
+	}
+	size_t idle = resident_bytes();
+
+	// The items held across the release must come out intact.
+	item_check check(1);
+	for (size_t i = 0; i != trickle; ++i)
+		check(q.pop());
+	check.reconcile("idle memory release", trickle);
+
+	for (size_t i = 0; i != capacity; ++i)
+		q.push(move(i));
+	for (size_t i = 0; i != capacity; ++i)
+		q.pop();
+	size_t refault = resident_bytes();
+
+	cout << "idle memory release queue size is: " << capacity << " (" << capacity * sizeof(queue<size_t>::slot_type) / 1024 << " KiB) holding " << trickle << " items while idle" << endl;
+	cout << "resident KiB constructed " << before / 1024 << ", after burst " << burst / 1024 << ", released " << released / 1024 << ", idle " << idle / 1024
+		<< ", after second burst " << refault / 1024 << endl;
+}
 
-	// Boost sequence test.
+// Writes to tmpfs so that the syscall overhead rather than the device is measured.
+void sink_test(size_t capacity, size_t producer_count, size_t producer_iterations, bool use_uring)
+{
+	char path[] = "/dev/shm/guarunteed_mpmc_sink_XXXXXX";
+	int fd = ::mkstemp(path);
+	if (fd < 0)
 	{
-		boost_queue_t q(8);
-		barrier b(3);
+		cout << "sink test skipped, unable to create a file in /dev/shm" << endl;
+		return;
+	}
+	::unlink(path);
 
-		thread p0(boost_consecutive_producer, c_million, std::ref(b), std::ref(q));
-		thread c0(boost_consecutive_consumer, c_million, std::ref(b), std::ref(q));
+	queue<sink_record> q(capacity);
+	barrier b(static_cast<unsigned int>(producer_count + 2));
+	size_t total_iterations = producer_count * producer_iterations;
+	uint64_t writes = total_iterations;
 
-		b.wait();
-		auto t0 = timer::now();
-		p0.join();
-		c0.join();
-		auto t1 = timer::now();
-		seconds dur = t1 - t0;
-		double rate = static_cast<double>(c_million) / dur.count();
-		cout << "boost completed " << c_million << " iterations of consecutive producer/consumer in " << std::fixed << std::setprecision(5) << dur << " @ " << std::setprecision(1) << rate << " items / second" << endl;
+	std::vector<thread> producers;
+	for (size_t i = 0; i != producer_count; ++i)
+	{
+		producers.emplace_back(sink_producer, producer_iterations, std::ref(b), std::ref(q));
 	}
+	thread consumer = use_uring ? thread(uring_sink_consumer, total_iterations, fd, std::ref(b), std::ref(q), std::ref(writes)) : thread(write_per_item_consumer, total_iterations, fd, std::ref(b), std::ref(q));
 
-	// Sequence test
+	b.wait();
+	auto t0 = timer::now();
+	std::for_each(begin(producers), end(producers), [=](thread &t) -> void
 	{
-		queue_t q(8);
-		barrier b(3);
+		t.join();
+	});
+	consumer.join();
+	auto t1 = timer::now();
+	seconds dur = t1 - t0;
+	double rate = static_cast<double>(total_iterations) / dur.count();
 
-		thread p0(consecutive_producer, c_million, std::ref(b), std::ref(q));
-		thread c0(consecutive_consumer, c_million, std::ref(b), std::ref(q));
+	off_t size = ::lseek(fd, 0, SEEK_END);
+	::close(fd);
+	if (size != static_cast<off_t>(total_iterations * sizeof(sink_record)))
+		cout << "sink test wrote " << size << " bytes, expected " << total_iterations * sizeof(sink_record) << endl;
 
-		b.wait();
-		auto t0 = timer::now();
-		p0.join();
-		c0.join();
-		auto t1 = timer::now();
-		seconds dur = t1 - t0;
-		double rate = static_cast<double>(c_million) / dur.count();
-		cout << "--------------------------------------------------------------------------------" << endl;
-		cout << "completed " << c_million << " iterations of consecutive producer/consumer in " << std::fixed << std::setprecision(5) << dur << " @ " << std::setprecision(1) << rate << " items / second" << endl;
+	cout << (use_uring ? "io_uring sink" : "write() per item") << " queue size is: " << capacity << " producer count is: " << producer_count << endl;
+	cout << "completed " << producer_iterations << " iterations for each producer in " << std::fixed << std::setprecision(5) << dur << " @ " << std::setprecision(1) << rate << " items / second with " << writes << " writes" << endl;
+}
+#endif
+
+// The tuner's scenario, the same checked producers and consumers as queue_test.
+struct checked_tuner_run
+{
+	template <class Queue>
+	double operator()(Queue &q, tuner_workload const &workload) const
+	{
+		return checked_rate(q, workload.producer_count, workload.consumer_count, workload.producer_iterations);
 	}
+};
 
-	
+// queue tune [producers] [consumers] [items per producer] [output header]
+int tune(int argc, char *argv[])
+{
+	tuner_workload workload;
+	workload.producer_count = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4;
+	workload.consumer_count = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 4;
+	workload.producer_iterations = argc > 4 ? std::strtoul(argv[4], nullptr, 10) : c_100k;
+	workload.repetitions = 5;
+	char const *path = argc > 5 ? argv[5] : "queue_config.hpp";
 
-	paired_queue_test(4, 2, 2, c_million);
-	paired_queue_test(128, 2, 2, c_million);
-	paired_queue_test(6, 3, 3, c_million);
-	paired_queue_test(128, 3, 3, c_million);
-	paired_queue_test(8, 4, 4, c_million);
-	paired_queue_test(128, 4, 4, c_million);
-	paired_queue_test(16, 8, 8, c_100k);
-	paired_queue_test(128, 8, 8, c_100k);
-	paired_queue_test(1024, 8, 8, c_10k);
-	paired_queue_test(128, 16, 16, c_100k);
+	std::vector<size_t> capacities;
+	for (size_t capacity = 4; capacity <= 64 * 1024; capacity *= 4)
+		capacities.push_back(capacity);
+
+	queue_tuner<checked_tuner_run> tuner(workload, capacities);
+	tuner_measurement best = tuner.tune(&cout);
+	if (item_check::failures() != 0)
+	{
+		cout << item_check::failures() << " tuning run(s) failed verification, no configuration written" << endl;
+		return 3;
+	}
+	cout << "best: capacity " << best.capacity << " cache line " << best.cache_line_size << " concurrency " << best.concurrency << endl;
+
+	std::ofstream config(path);
+	tuner.write_config(config);
+	if (!config)
+	{
+		cout << "failed to write " << path << endl;
+		return 1;
+	}
+	cout << "wrote " << path << ", build with GUARUNTEED_MPMC_CONFIG_HEADER=\"" << path << "\" to use it" << endl;
+	return 0;
+}
+
+#if defined(GUARUNTEED_MPMC_TRACE)
+// queue record [output trace], records a bursty producer/consumer run so there is something to replay without a production capture.
+int record(int argc, char *argv[])
+{
+	char const *path = argc > 2 ? argv[2] : "queue.trace";
+	queue_t q(1024);
+	size_t producer_count = 2;
+	size_t burst_count = 200;
+	size_t burst_size = 256;
+
+	trace_start(&q);
+	std::vector<thread> threads;
+	for (size_t i = 0; i != producer_count; ++i)
+	{
+		threads.emplace_back([&]()
+		{
+			for (size_t b = 0; b != burst_count; ++b)
+			{
+				for (size_t n = 0; n != burst_size; ++n)
+				{
+					size_t v = n;
+					q.push(move(v));
+				}
+				std::this_thread::sleep_for(std::chrono::microseconds(500));
+			}
+		});
+	}
+	threads.emplace_back([&]()
+	{
+		for (size_t n = 0; n != producer_count * burst_count * burst_size; ++n)
+			q.pop();
+	});
+	for (auto &t : threads)
+		t.join();
+	trace_stop();
+
+	std::ofstream os(path, std::ios::binary);
+	trace_dump(os);
+	cout << "wrote " << path << endl;
+	return os ? 0 : 1;
+}
+#endif
+
+// The interface replay_trace expects, over any of the benchmark queues through its adapter.  The capacity is what one thread can push without a
+// pop, the replay pre-fills from a single thread.
+template <class Queue>
+class replay_target
+{
+public:
+	explicit replay_target(size_t capacity) : q_(capacity), capacity_(queue_adapter<Queue>::single_thread_capacity(q_, capacity))
+	{
+	}
+
+	void push(size_t &&v)
+	{
+		queue_adapter<Queue>::push(q_, std::move(v));
+	}
+
+	size_t pop()
+	{
+		return queue_adapter<Queue>::pop(q_);
+	}
+
+	bool try_pop(uint16_t attempts)
+	{
+		size_t v;
+		return queue_adapter<Queue>::try_pop(q_, v, attempts);
+	}
+
+	size_t capacity() const
+	{
+		return capacity_;
+	}
+
+private:
+	Queue q_;
+	size_t capacity_;
+};
+
+// queue replay <trace> [capacity] [speed] [queue name], replays against every queue (that supports the trace's thread count) when no name is given.
+int replay(int argc, char *argv[])
+{
+	if (argc < 3)
+	{
+		cout << "usage: queue replay <trace> [capacity] [speed] [queue name]" << endl;
+		return 1;
+	}
+	size_t capacity = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 1024;
+	double speed = argc > 4 ? std::strtod(argv[4], nullptr) : 1.0;
+	char const *only = argc > 5 ? argv[5] : nullptr;
+
+	std::ifstream is(argv[2], std::ios::binary);
+	queue_trace trace = trace_load(is);
+	if (trace.dropped != 0)
+		cout << trace.dropped << " events were dropped while recording" << endl;
+
+	// Every recorded thread pushes and pops, and the replay's own thread drains.
+	size_t thread_count = trace.threads.size();
+	bool found = false;
+	for_each_queue(benchmark_queues(), [&](auto tag)
+	{
+		typedef typename decltype(tag)::type Queue;
+		if (only != nullptr && std::strcmp(only, queue_adapter<Queue>::name()) != 0)
+			return;
+		found = true;
+		if (!queue_adapter<Queue>::supports(thread_count, thread_count + 1))
+		{
+			cout << queue_adapter<Queue>::name() << " doesn't support " << thread_count << " threads pushing and " << thread_count + 1 << " popping" << endl;
+			return;
+		}
+
+		// A queue split into lanes can be too small for the pre-fill where the others aren't, that skips just that queue.
+		replay_target<Queue> q(capacity);
+		replay_result r;
+		try
+		{
+			r = replay_trace(trace, q, speed);
+		}
+		catch (std::invalid_argument const &e)
+		{
+			cout << queue_adapter<Queue>::name() << ": " << e.what() << endl;
+			return;
+		}
+		cout << queue_adapter<Queue>::name() << " replayed " << thread_count << " threads, " << r.pushes << " pushes and " << r.pops << " pops (" << r.prefilled << " prefilled, "
+			<< r.drained << " drained) at " << std::defaultfloat << speed << "x in " << std::fixed << std::setprecision(5) << r.seconds << " seconds" << endl;
+		cout << "event lateness mean " << std::setprecision(1) << r.mean_lateness << " ns max " << r.max_lateness << " ns" << endl;
+	});
+	if (!found)
+	{
+		cout << "no queue named " << only << endl;
+		return 1;
+	}
+	return 0;
+}
+
+// Prints one line per scenario present in both runs, returns the number of regressions.
+size_t report_comparison(bench_results const &baseline, bench_results const &current)
+{
+	size_t regressions = 0;
+	for (auto const &c : compare_results(baseline, current))
+	{
+		cout << std::left << std::setw(40) << c.scenario << std::right << std::fixed << std::setprecision(1) << std::setw(16) << c.baseline_mean << " -> " << std::setw(16) << c.current_mean
+			<< std::showpos << std::setw(8) << c.change * 100.0 << std::noshowpos << "%  p = " << std::setprecision(4) << c.p_value << (c.regression ? "  REGRESSION" : "") << endl;
+		if (c.regression)
+			++regressions;
+	}
+	cout << regressions << " regression(s)" << endl;
+	return regressions;
+}
+
+// queue compare <baseline> <results>
+int compare(int argc, char *argv[])
+{
+	if (argc < 4)
+	{
+		cout << "usage: queue compare <baseline> <results>" << endl;
+		return 1;
+	}
+	std::ifstream baseline(argv[2]);
+	std::ifstream current(argv[3]);
+	if (!baseline || !current)
+	{
+		cout << "failed to read results" << endl;
+		return 1;
+	}
+	return report_comparison(bench_results::read(baseline), bench_results::read(current)) == 0 ? 0 : 2;
+}
+
+// queue bench <results> [baseline], runs every implementation through the scenario matrix a few times, writes the samples to results and, given a
+// baseline, fails (exit code 2) when any scenario regressed against it.  Exit code 3 means items were lost, duplicated or reordered.
+int bench(int argc, char *argv[])
+{
+	if (argc < 3)
+	{
+		cout << "usage: queue bench <results> [baseline]" << endl;
+		return 1;
+	}
+
+	struct scenario
+	{
+		size_t capacity;
+		size_t producer_count;
+		size_t consumer_count;
+	};
+	static const scenario scenarios[] = { { 8, 1, 1 }, { 128, 2, 2 }, { 128, 4, 4 }, { 1024, 8, 8 } };
+	const size_t repetitions = 5;
+	const size_t producer_iterations = c_100k;
+	const size_t batch_size = 8;
+
+	bench_results results;
+	for (auto const &sc : scenarios)
+	{
+		std::ostringstream suffix;
+		suffix << "/" << sc.capacity << "/" << sc.producer_count << "p" << sc.consumer_count << "c";
+		for (size_t i = 0; i != repetitions; ++i)
+		{
+			for_each_queue(benchmark_queues(), [&](auto tag)
+			{
+				typedef typename decltype(tag)::type Queue;
+				if (!queue_adapter<Queue>::supports(sc.producer_count, sc.consumer_count))
+					return;
+				std::string name = queue_adapter<Queue>::name();
+				results.add(name + suffix.str(), queue_test<Queue>(sc.capacity, sc.producer_count, sc.consumer_count, producer_iterations));
+				results.add(name + "_batch" + suffix.str(), batch_queue_test<Queue>(sc.capacity, sc.producer_count, sc.consumer_count, producer_iterations, batch_size));
+			});
+		}
+	}
+
+	std::ofstream os(argv[2]);
+	results.write(os);
+	if (!os)
+	{
+		cout << "failed to write " << argv[2] << endl;
+		return 1;
+	}
+	cout << "wrote " << argv[2] << endl;
+
+	// Numbers from a run that lost or reordered items mean nothing, whatever the baseline says.
+	if (item_check::failures() != 0)
+	{
+		cout << item_check::failures() << " scenario run(s) failed verification" << endl;
+		return 3;
+	}
+
+	if (argc > 3)
+	{
+		std::ifstream baseline(argv[3]);
+		if (!baseline)
+		{
+			cout << "failed to read " << argv[3] << endl;
+			return 1;
+		}
+		cout << "\n================================================================================\n" << endl;
+		return report_comparison(bench_results::read(baseline), results) == 0 ? 0 : 2;
+	}
+	return 0;
+}
+
+template <class T>
+void micro_payload_test(size_t payload_size)
+{
+	struct scenario
+	{
+		micro_scenario id;
+		char const *name;
+	};
+	static const scenario scenarios[] =
+	{
+		{ micro_scenario::push_pop, "push then pop" },
+		{ micro_scenario::alternating, "alternating" },
+		{ micro_scenario::fill_drain, "fill then drain" },
+		{ micro_scenario::empty_try_pop, "empty try_pop" }
+	};
+	const size_t capacity = 1024;
+
+	for (auto const &sc : scenarios)
+	{
+		for_each_queue(benchmark_queues_of<T>(), [&](auto tag)
+		{
+			typedef typename decltype(tag)::type Queue;
+			micro_result r = run_micro<Queue>(sc.id, capacity);
+			cout << std::left << std::setw(16) << sc.name << std::setw(16) << queue_adapter<Queue>::name() << std::right << std::setw(8) << payload_size
+				<< std::fixed << std::setprecision(1) << std::setw(14) << r.cycles_per_op;
+			if (r.rmw_per_op < 0.0)
+				cout << std::setw(10) << "n/a" << endl;
+			else
+				cout << std::setprecision(2) << std::setw(10) << r.rmw_per_op << endl;
+		});
+	}
+}
+
+// queue micro, the single thread cost of each operation without contention.
+int micro(int, char *[])
+{
+#if !defined(GUARUNTEED_MPMC_COUNT_RMW)
+	cout << "RMW counts need a build with GUARUNTEED_MPMC_COUNT_RMW defined (which adds its own small cost to the cycle counts)" << endl;
+#endif
+	cout << std::left << std::setw(16) << "scenario" << std::setw(16) << "queue" << std::right << std::setw(8) << "bytes" << std::setw(14) << "cycles / op" << std::setw(10) << "RMW / op" << endl;
+	micro_payload_test<size_t>(sizeof(size_t));
+	micro_payload_test<micro_payload<64>>(64);
+	micro_payload_test<micro_payload<256>>(256);
+	return 0;
+}
+
+// Runs the checked producer/consumer scenario on q under the hardware counters, returns items / second.  The counters include the thread start up
+// and join, which is small next to a run of a million items.
+template <class Queue>
+double counted_queue_test(Queue &q, size_t producer_count, size_t consumer_count, size_t producer_iterations, perf_counters &counters)
+{
+	size_t total_iterations = producer_count * producer_iterations;
+	std::vector<item_check> checks(consumer_count, item_check(producer_count, queue_adapter<Queue>::fifo));
+
+	counters.start();
+	double dur = timed_run(producer_count, consumer_count,
+		[&](size_t p, barrier &b) { consecutive_producer(p, producer_iterations, b, q); },
+		[&](size_t c, barrier &b) { checked_consumer(consumer_share(total_iterations, consumer_count, c), producer_count, b, q, checks[c]); });
+	counters.stop();
+
+	reconcile(queue_adapter<Queue>::name(), checks, producer_count, producer_iterations);
+	return static_cast<double>(total_iterations) / dur;
+}
+
+// Counts per item for the counters that are available, n/a for the rest.
+void report_counters(perf_counters const &counters, std::initializer_list<perf_counter> which, size_t items)
+{
+	for (perf_counter c : which)
+	{
+		if (counters.available(c))
+			cout << std::fixed << std::setprecision(3) << std::setw(14) << static_cast<double>(counters.read(c)) / static_cast<double>(items);
+		else
+			cout << std::setw(14) << "n/a";
+	}
+	cout << endl;
+}
+
+void report_counter_names(std::initializer_list<perf_counter> which)
+{
+	for (perf_counter c : which)
+		cout << std::setw(14) << perf_counters::name(c);
+	cout << endl;
+}
+
+// One capacity of the sweep, the queue is filled and drained once first so the buffer's pages are touched before the timed run.
+template <class T, size_t PrefetchDistance>
+void sweep_test(size_t capacity, size_t producer_count, size_t consumer_count, size_t payload_size)
+{
+	typedef queue<T, detail::queue_traits<detail::cache_line_size, detail::concurrency, detail::queue_traits<>::layout, PrefetchDistance>> Queue;
+	typedef queue_adapter<Queue> adapter;
+
+	Queue q(capacity);
+	for (size_t i = 0; i != capacity; ++i)
+		adapter::push(q, T(i));
+	for (size_t i = 0; i != capacity; ++i)
+		adapter::pop(q);
+
+	// Enough items for the positions to lap the buffer several times.
+	size_t producer_iterations = std::max(c_million, 4 * capacity) / producer_count;
+	perf_counters counters;
+	double rate = counted_queue_test(q, producer_count, consumer_count, producer_iterations, counters);
+
+	cout << std::right << std::setw(8) << payload_size << std::setw(12) << capacity << std::setw(10) << PrefetchDistance << std::setw(14) << capacity * sizeof(typename Queue::slot_type) / 1024
+		<< std::fixed << std::setprecision(1) << std::setw(16) << rate;
+	report_counters(counters, { perf_counter::l1d_misses, perf_counter::llc_misses, perf_counter::dtlb_misses }, producer_count * producer_iterations);
+}
+
+// With prefetch every capacity runs at several prefetch distances, otherwise at the configured one.
+template <class T>
+void sweep_payload_test(size_t producer_count, size_t consumer_count, size_t memory_cap, size_t payload_size, bool prefetch)
+{
+	for (size_t capacity = size_t(1) << 2; capacity <= size_t(1) << 26; capacity *= 2)
+	{
+		if (capacity * sizeof(typename queue<T>::slot_type) > memory_cap)
+		{
+			cout << std::right << std::setw(8) << payload_size << std::setw(12) << capacity << "  skipped, the buffer is over the memory cap" << endl;
+			continue;
+		}
+		if (!prefetch)
+		{
+			sweep_test<T, detail::prefetch_distance>(capacity, producer_count, consumer_count, payload_size);
+			continue;
+		}
+		sweep_test<T, 0>(capacity, producer_count, consumer_count, payload_size);
+		sweep_test<T, 2>(capacity, producer_count, consumer_count, payload_size);
+		sweep_test<T, 8>(capacity, producer_count, consumer_count, payload_size);
+		sweep_test<T, 32>(capacity, producer_count, consumer_count, payload_size);
+	}
+}
+
+// queue sweep [producers] [consumers] [memory cap MiB] [prefetch], throughput and cache / TLB misses as the buffer grows from 2^2 to 2^26 slots,
+// for picking capacities whose buffer stays resident in a given cache level.  Capacities whose buffer is over the cap are skipped.  With prefetch
+// each capacity is also run at several prefetch distances (see GUARUNTEED_MPMC_PREFETCH_DISTANCE).
+int sweep(int argc, char *argv[])
+{
+	size_t producer_count = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 2;
+	size_t consumer_count = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 2;
+	size_t memory_cap = (argc > 4 ? std::strtoul(argv[4], nullptr, 10) : 1024) * 1024 * 1024;
+	bool prefetch = argc > 5 && std::strcmp(argv[5], "prefetch") == 0;
+	if (producer_count == 0 || consumer_count == 0)
+	{
+		cout << "producer and consumer counts must be non zero" << endl;
+		return 1;
+	}
+
+	perf_counters probe;
+	if (!probe.available(perf_counter::l1d_misses) && !probe.available(perf_counter::llc_misses) && !probe.available(perf_counter::dtlb_misses))
+		cout << "hardware counters are unavailable (not linux, no PMU, or perf_event_paranoid), miss rates are n/a" << endl;
+	cout << producer_count << " producer(s), " << consumer_count << " consumer(s), misses are per item" << endl;
+	cout << std::right << std::setw(8) << "bytes" << std::setw(12) << "capacity" << std::setw(10) << "prefetch" << std::setw(14) << "buffer KiB" << std::setw(16) << "items / second";
+	report_counter_names({ perf_counter::l1d_misses, perf_counter::llc_misses, perf_counter::dtlb_misses });
+
+	sweep_payload_test<size_t>(producer_count, consumer_count, memory_cap, sizeof(size_t), prefetch);
+	sweep_payload_test<micro_payload<64>>(producer_count, consumer_count, memory_cap, 64, prefetch);
+	sweep_payload_test<micro_payload<256>>(producer_count, consumer_count, memory_cap, 256, prefetch);
+	return item_check::failures() == 0 ? 0 : 3;
+}
+
+template <detail::control_layout Layout>
+void layout_test(char const *name, size_t capacity, size_t producer_count, size_t consumer_count, size_t producer_iterations)
+{
+	typedef queue<size_t, detail::queue_traits<detail::cache_line_size, detail::concurrency, Layout>> Queue;
+
+	Queue q(capacity);
+	perf_counters counters;
+	double rate = counted_queue_test(q, producer_count, consumer_count, producer_iterations, counters);
+
+	cout << std::left << std::setw(14) << name << std::right << std::setw(8) << sizeof(Queue) / detail::cache_line_size << std::setw(8) << producer_count
+		<< std::setw(8) << consumer_count << std::fixed << std::setprecision(1) << std::setw(16) << rate;
+	report_counters(counters, { perf_counter::coherence_misses, perf_counter::l1d_misses, perf_counter::llc_misses }, producer_count * producer_iterations);
+}
+
+// queue layout [capacity] [items per producer], the per_counter and by_role control block layouts side by side at rising thread counts.  The
+// capacity is kept small so the buffer stays in L1 and the misses counted are mostly the control block's.
+int layout(int argc, char *argv[])
+{
+	size_t capacity = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 128;
+	size_t producer_iterations = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : c_million;
+
+	perf_counters probe;
+	if (!probe.available(perf_counter::coherence_misses))
+		cout << "HITM loads need GUARUNTEED_MPMC_PERF_HITM_EVENT set to the host's raw event code (see perf_counters.hpp) and a PMU" << endl;
+	cout << "misses are per item, lines is the size of the queue object (control block plus buffer_'s handle) in cache lines" << endl;
+	cout << std::left << std::setw(14) << "layout" << std::right << std::setw(8) << "lines" << std::setw(8) << "pushers" << std::setw(8) << "poppers" << std::setw(16) << "items / second";
+	report_counter_names({ perf_counter::coherence_misses, perf_counter::l1d_misses, perf_counter::llc_misses });
+
+	for (size_t threads : { 1, 2, 4, 8 })
+	{
+		layout_test<detail::control_layout::per_counter>("per_counter", capacity, threads, threads, producer_iterations / threads);
+		layout_test<detail::control_layout::by_role>("by_role", capacity, threads, threads, producer_iterations / threads);
+	}
+	return item_check::failures() == 0 ? 0 : 3;
+}
+
+// Payload of Bytes through a queue written with ordinary then streaming stores, with a buffer of about 8 MiB so it doesn't fit in the producer's
+// L2 either way.  Returns the streaming rate over the ordinary one.
+template <size_t Bytes>
+double stream_test(size_t producer_count, size_t consumer_count)
+{
+	typedef micro_payload<Bytes> payload_t;
+	typedef queue<payload_t, detail::queue_traits<detail::cache_line_size, detail::concurrency, detail::queue_traits<>::layout, detail::prefetch_distance, 0>> cached_queue;
+	typedef queue<payload_t, detail::queue_traits<detail::cache_line_size, detail::concurrency, detail::queue_traits<>::layout, detail::prefetch_distance, 1>> streaming_queue;
+
+	size_t capacity = std::max<size_t>(16, (size_t(8) << 20) / Bytes);
+	size_t producer_iterations = std::max<size_t>(c_10k, (size_t(256) << 20) / Bytes) / producer_count;
+
+	double rates[2];
+	uint64_t llc_misses[2];
+	{
+		cached_queue q(capacity);
+		perf_counters counters;
+		rates[0] = counted_queue_test(q, producer_count, consumer_count, producer_iterations, counters);
+		llc_misses[0] = counters.read(perf_counter::llc_misses);
+	}
+	{
+		streaming_queue q(capacity);
+		perf_counters counters;
+		rates[1] = counted_queue_test(q, producer_count, consumer_count, producer_iterations, counters);
+		llc_misses[1] = counters.read(perf_counter::llc_misses);
+	}
+
+	double items = static_cast<double>(producer_count * producer_iterations);
+	cout << std::right << std::setw(8) << Bytes << std::setw(10) << capacity << std::fixed << std::setprecision(1) << std::setw(16) << rates[0] << std::setw(16) << rates[1]
+		<< std::setprecision(3) << std::setw(10) << rates[1] / rates[0];
+	if (perf_counters().available(perf_counter::llc_misses))
+		cout << std::setw(14) << static_cast<double>(llc_misses[0]) / items << std::setw(14) << static_cast<double>(llc_misses[1]) / items << endl;
+	else
+		cout << std::setw(14) << "n/a" << std::setw(14) << "n/a" << endl;
+	return rates[1] / rates[0];
+}
+
+// queue stream [producers] [consumers], ordinary against streaming stores for payloads from 64 bytes to 16 KiB, and the smallest payload from which
+// streaming wins for every larger one, as a value for GUARUNTEED_MPMC_STREAMING_STORE_BYTES.  Run it with producers and consumers pinned to
+// different sockets (numactl / taskset) for the case streaming is for.
+int stream(int argc, char *argv[])
+{
+	size_t producer_count = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1;
+	size_t consumer_count = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 1;
+	if (producer_count == 0 || consumer_count == 0)
+	{
+		cout << "producer and consumer counts must be non zero" << endl;
+		return 1;
+	}
+#if !defined(GUARUNTEED_MPMC_STREAMING_STORES)
+	cout << "there are no streaming stores on this target, both columns are ordinary stores" << endl;
+#endif
+
+	cout << std::right << std::setw(8) << "bytes" << std::setw(10) << "capacity" << std::setw(16) << "cached / s" << std::setw(16) << "streamed / s" << std::setw(10) << "speedup"
+		<< std::setw(14) << "LLC cached" << std::setw(14) << "LLC streamed" << endl;
+	const size_t sizes[] = { 64, 256, 1024, 4096, 16384 };
+	double speedups[] =
+	{
+		stream_test<64>(producer_count, consumer_count),
+		stream_test<256>(producer_count, consumer_count),
+		stream_test<1024>(producer_count, consumer_count),
+		stream_test<4096>(producer_count, consumer_count),
+		stream_test<16384>(producer_count, consumer_count)
+	};
+
+	size_t threshold = 0;
+	for (size_t i = sizeof(sizes) / sizeof(sizes[0]); i != 0 && speedups[i - 1] > 1.0; --i)
+		threshold = sizes[i - 1];
+	if (threshold == 0)
+		cout << "streaming didn't win at any size, leave GUARUNTEED_MPMC_STREAMING_STORE_BYTES at 0" << endl;
+	else
+		cout << "streaming wins from " << threshold << " bytes: #define GUARUNTEED_MPMC_STREAMING_STORE_BYTES " << threshold << endl;
+	return item_check::failures() == 0 ? 0 : 3;
+}
+
+// Nanoseconds per item of batch_size batches pushed then popped on one thread through Queue, checking what comes out.  Cached and uncontended
+// so the copies in and out of the buffer are what is measured.
+template <class Queue>
+double bulk_copy_run(size_t batch_size, size_t batches)
+{
+	typedef typename Queue::value_type payload_t;
+
+	Queue q(4 * batch_size);
+	std::vector<payload_t> in(batch_size), out(batch_size);
+	for (size_t i = 0; i != batch_size; ++i)
+		in[i] = payload_t(i);
+
+	auto t0 = timer::now();
+	for (size_t b = 0; b != batches; ++b)
+	{
+		q.push_batch(in.data(), batch_size);
+		if (q.try_pop_batch(out.data(), batch_size, attempts) != batch_size || static_cast<size_t>(out[b % batch_size]) != b % batch_size)
+			throw std::runtime_error("bulk copy lost or corrupted an item");
+	}
+	seconds dur = timer::now() - t0;
+	return dur.count() * 1e9 / static_cast<double>(batch_size * batches);
+}
+
+// The same bytes copied in and out with memcpy, what the batch operations can at best get to.
+template <size_t Bytes>
+double bulk_copy_memcpy_run(size_t batch_size, size_t batches)
+{
+	std::vector<micro_payload<Bytes>> in(batch_size), buffer(4 * batch_size), out(batch_size);
+	for (size_t i = 0; i != batch_size; ++i)
+		in[i] = micro_payload<Bytes>(i);
+
+	auto t0 = timer::now();
+	for (size_t b = 0; b != batches; ++b)
+	{
+		micro_payload<Bytes> *slots = &buffer[(b % 4) * batch_size];
+		std::memcpy(slots, in.data(), batch_size * Bytes);
+		std::memcpy(out.data(), slots, batch_size * Bytes);
+		if (static_cast<size_t>(out[b % batch_size]) != b % batch_size)
+			throw std::runtime_error("memcpy lost or corrupted an item");
+	}
+	seconds dur = timer::now() - t0;
+	return dur.count() * 1e9 / static_cast<double>(batch_size * batches);
+}
+
+template <size_t Bytes>
+void bulk_copy_test(size_t batch_size)
+{
+	typedef micro_payload<Bytes> payload_t;
+	typedef queue<payload_t, detail::queue_traits<detail::cache_line_size, detail::concurrency, detail::queue_traits<>::layout, detail::prefetch_distance,
+		detail::streaming_store_bytes, false>> itemwise_queue;
+	typedef queue<payload_t, detail::queue_traits<detail::cache_line_size, detail::concurrency, detail::queue_traits<>::layout, detail::prefetch_distance,
+		detail::streaming_store_bytes, true>> bulk_queue;
+
+	size_t batches = std::max<size_t>(1, (size_t(64) << 20) / (batch_size * Bytes));
+	double itemwise = bulk_copy_run<itemwise_queue>(batch_size, batches);
+	double bulk = bulk_copy_run<bulk_queue>(batch_size, batches);
+	double copy = bulk_copy_memcpy_run<Bytes>(batch_size, batches);
+
+	cout << std::right << std::setw(8) << Bytes << std::fixed << std::setprecision(2) << std::setw(14) << itemwise << std::setw(14) << bulk << std::setw(14) << copy
+		<< std::setw(12) << itemwise / bulk << endl;
+}
+
+// queue bulk [batch size], ns per item through push_batch / try_pop_batch copying item by item and with the bulk copy kernels, against memcpy of the
+// same bytes, for 8 to 64 byte records.
+int bulk(int argc, char *argv[])
+{
+	size_t batch_size = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 256;
+	if (batch_size == 0)
+	{
+		cout << "batch size must be non zero" << endl;
+		return 1;
+	}
+
+	cout << "bulk copy kernels: " << bulk_copy_isa_name(bulk_copy_selected_isa()) << ", batches of " << batch_size << endl;
+	cout << std::right << std::setw(8) << "bytes" << std::setw(14) << "item ns" << std::setw(14) << "bulk ns" << std::setw(14) << "memcpy ns" << std::setw(12) << "speedup" << endl;
+	bulk_copy_test<8>(batch_size);
+	bulk_copy_test<16>(batch_size);
+	bulk_copy_test<24>(batch_size);
+	bulk_copy_test<32>(batch_size);
+	bulk_copy_test<48>(batch_size);
+	bulk_copy_test<64>(batch_size);
+	return 0;
+}
+
+// A move only handle, the kind of item an ownership passing queue carries.  The two are the same type, only relocatable_handle is declared
+// trivially relocatable.
+template <bool Relocatable>
+struct owning_handle
+{
+	owning_handle() = default;
+	explicit owning_handle(size_t v) : p(new size_t(v)) {}
+
+	std::unique_ptr<size_t> p;
+};
+
+typedef owning_handle<false> plain_handle;
+typedef owning_handle<true> relocatable_handle;
+
+template <>
+struct is_trivially_relocatable<relocatable_handle> : std::true_type
+{
+};
+
+// Moves a pool of handles through the queue and back, timing (and counting instructions for) the pushes and the pops separately.  Handles cycle
+// between the pool and the queue so nothing is allocated or freed while timing.
+template <class Handle>
+void relocate_test(char const *name, size_t capacity, size_t rounds)
+{
+	queue<Handle> q(capacity);
+	std::vector<Handle> pool(capacity);
+	for (size_t i = 0; i != capacity; ++i)
+		pool[i] = Handle(i);
+
+	const char *ops[] = { "pop", "try_pop", "try_pop_batch" };
+	for (size_t op = 0; op != 3; ++op)
+	{
+		double push_seconds = 0.0, pop_seconds = 0.0;
+		uint64_t push_instructions = 0, pop_instructions = 0;
+		for (size_t r = 0; r != rounds; ++r)
+		{
+			perf_counters counters;
+			counters.start();
+			auto t0 = timer::now();
+			for (size_t i = 0; i != capacity; ++i)
+				q.push(std::move(pool[i]));
+			auto t1 = timer::now();
+			counters.stop();
+			push_seconds += seconds(t1 - t0).count();
+			push_instructions += counters.read(perf_counter::instructions);
+
+			counters.start();
+			t0 = timer::now();
+			if (op == 0)
+			{
+				for (size_t i = 0; i != capacity; ++i)
+					pool[i] = q.pop();
+			}
+			else if (op == 1)
+			{
+				for (size_t i = 0; i != capacity; ++i)
+					pool[i] = std::move(*q.try_pop(attempts));
+			}
+			else
+			{
+				for (size_t i = 0; i != capacity; )
+					i += q.try_pop_batch(pool.data() + i, capacity - i, attempts);
+			}
+			t1 = timer::now();
+			counters.stop();
+			pop_seconds += seconds(t1 - t0).count();
+			pop_instructions += counters.read(perf_counter::instructions);
+
+			for (size_t i = 0; i != capacity; ++i)
+			{
+				if (!pool[i].p || *pool[i].p != i)
+					throw std::runtime_error("relocation lost or reordered a handle");
+			}
+		}
+
+		double items = static_cast<double>(capacity * rounds);
+		cout << std::left << std::setw(14) << name << std::setw(16) << ops[op] << std::right << std::fixed << std::setprecision(2)
+			<< std::setw(12) << push_seconds * 1e9 / items << std::setw(12) << pop_seconds * 1e9 / items;
+		if (perf_counters().available(perf_counter::instructions))
+			cout << std::setprecision(1) << std::setw(14) << static_cast<double>(push_instructions) / items << std::setw(14) << static_cast<double>(pop_instructions) / items << endl;
+		else
+			cout << std::setw(14) << "n/a" << std::setw(14) << "n/a" << endl;
+	}
+}
+
+// queue relocate, handles (a unique_ptr) through the queue moved as usual and relocated as trivially relocatable.
+int relocate(int, char *[])
+{
+	cout << std::left << std::setw(14) << "handle" << std::setw(16) << "pop with" << std::right << std::setw(12) << "push ns" << std::setw(12) << "pop ns"
+		<< std::setw(14) << "push instr" << std::setw(14) << "pop instr" << endl;
+	relocate_test<plain_handle>("moved", 1024, 2000);
+	relocate_test<relocatable_handle>("relocated", 1024, 2000);
+	return 0;
+}
+
+// Producers push until their push fails and consumers pop until pop throws (or try_pop reports the close), the main thread closes the queue after run_for with everyone still at
+// it (no sentinels).  Reports how long after the close the last waiter was released, and checks that exactly the items whose push succeeded
+// were popped.  With no consumers the producers are left waiting on a full queue, the remaining items are drained after they are released.
+bool close_test(size_t capacity, size_t producer_count, size_t consumer_count, std::chrono::milliseconds run_for)
+{
+	queue<size_t> q(capacity);
+	barrier b(static_cast<unsigned int>(producer_count + consumer_count + 1));
+	std::vector<size_t> pushed(producer_count, 0);
+	std::vector<item_check> checks(consumer_count, item_check(producer_count));
+	std::vector<timer::time_point> released(producer_count + consumer_count);
+
+	std::vector<thread> threads;
+	for (size_t p = 0; p != producer_count; ++p)
+	{
+		threads.emplace_back([&, p]()
+		{
+			b.wait();
+			size_t i = 0;
+			while (q.push(tag_item(p, i)))
+				++i;
+			released[p] = timer::now();
+			pushed[p] = i;
+		});
+	}
+	for (size_t c = 0; c != consumer_count; ++c)
+	{
+		threads.emplace_back([&, c]()
+		{
+			item_check check(producer_count);
+			b.wait();
+			if (c % 2 == 1)
+			{
+				// Every other consumer polls, stopping on try_pop's closed status rather than pop's exception.
+				pop_status status = pop_status::empty;
+				while (status != pop_status::closed)
+				{
+					if (auto v = q.try_pop(attempts, status))
+						check(*v);
+					else
+						std::this_thread::yield();
+				}
+				released[producer_count + c] = timer::now();
+			}
+			else
+			{
+				try
+				{
+					for (;;)
+						check(q.pop());
+				}
+				catch (queue_closed const&)
+				{
+					released[producer_count + c] = timer::now();
+				}
+			}
+			checks[c] = check;
+		});
+	}
+
+	b.wait();
+	std::this_thread::sleep_for(run_for);
+	auto t0 = timer::now();
+	q.close();
+	for (auto &t : threads)
+		t.join();
+	seconds release = *std::max_element(begin(released), end(released)) - t0;
+
+	item_check check(producer_count);
+	for (auto const &c : checks)
+		check.merge(c);
+	size_t leftover = 0;
+	pop_status status;
+	while (auto v = q.try_pop(0, status))
+	{
+		check(*v);
+		++leftover;
+	}
+
+	// Once drained every pop has to report the close, not just come back empty.
+	bool ok = check.reconcile("close", pushed);
+	size_t late = 0;
+	if (q.push(0))
+		++late;
+	try
+	{
+		q.pop();
+		++late;
+	}
+	catch (queue_closed const&)
+	{
+	}
+	size_t v = 0;
+	if (status != pop_status::closed || q.try_pop_batch(&v, 1, 0, status) != 0 || status != pop_status::closed)
+		++late;
+	if (late != 0)
+	{
+		cout << "VERIFICATION FAILED for close: an operation succeeded, or didn't report the close, on a closed and drained queue" << endl;
+		++item_check::failures();
+		ok = false;
+	}
+
+	cout << "close queue size is: " << capacity << " producer count is: " << producer_count << " consumer count is: " << consumer_count << endl;
+	cout << "pushed " << std::accumulate(begin(pushed), end(pushed), size_t(0)) << " items, " << leftover << " drained after the waiters were released, last waiter released "
+		<< std::fixed << std::setprecision(1) << release.count() * 1e6 << " us after close" << endl;
+	return ok;
+}
+
+// queue close [producers] [consumers], shutting a queue down mid stream.
+int close_queue(int argc, char *argv[])
+{
+	size_t producer_count = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4;
+	size_t consumer_count = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 4;
+
+	bool ok = close_test(128, producer_count, consumer_count, std::chrono::milliseconds(100));
+	ok = close_test(128, producer_count, 0, std::chrono::milliseconds(10)) && ok;
+	ok = close_test(128, 0, consumer_count, std::chrono::milliseconds(10)) && ok;
+	return ok ? 0 : 3;
+}
+
+// queue adaptive [threads] [items per producer], light, heavy then light load again through one queue of each kind.  The adaptive queue should
+// end up in the single ring for the light phases and the lanes for the heavy one.
+int adaptive(int argc, char *argv[])
+{
+	size_t heavy = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 8;
+	size_t producer_iterations = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : c_million / 4;
+	size_t const capacity = 1024;
+	size_t const phases[] = { 1, heavy, 1 };
+
+	queue<size_t> single(capacity);
+	percpu_queue<size_t> percpu(capacity);
+	adaptive_queue<size_t> adaptive(capacity);
+
+	cout << "adaptive_queue with " << adaptive.lane_count() << " lanes, items / second per phase" << endl;
+	cout << std::left << std::setw(20) << "producers/consumers" << std::right << std::setw(14) << "queue" << std::setw(14) << "percpu_queue"
+		<< std::setw(16) << "adaptive_queue" << std::setw(10) << "mode" << std::setw(10) << "switches" << endl;
+	for (size_t threads : phases)
+	{
+		double single_rate = checked_rate(single, threads, threads, producer_iterations);
+		double percpu_rate = checked_rate(percpu, threads, threads, producer_iterations);
+		double adaptive_rate = checked_rate(adaptive, threads, threads, producer_iterations);
+		std::ostringstream label;
+		label << threads << "/" << threads;
+		cout << std::left << std::setw(20) << label.str() << std::right << std::fixed << std::setprecision(0) << std::setw(14) << single_rate
+			<< std::setw(14) << percpu_rate << std::setw(16) << adaptive_rate << std::setw(10) << (adaptive.sharded() ? "lanes" : "single")
+			<< std::setw(10) << adaptive.switches() << endl;
+	}
+	return item_check::failures() == 0 ? 0 : 3;
+}
+
+// queue numa [nodes] [threads per node], producers and consumers spread over the nodes (simulated when the machine has fewer), queue against
+// numa_queue.  Steals are the batches numa_queue moved between nodes.
+int numa(int argc, char *argv[])
+{
+	size_t machine_nodes = detail::numa_nodes().node_cpus.size();
+	size_t node_count = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : std::max<size_t>(2, machine_nodes);
+	size_t threads_per_node = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 2;
+	size_t producer_iterations = c_million / 4;
+	size_t const capacity = 1024;
+	size_t thread_count = node_count * threads_per_node;
+
+	cout << "machine has " << machine_nodes << " NUMA node" << (machine_nodes == 1 ? "" : "s") << ", running " << node_count << (node_count == machine_nodes ? "" : " simulated")
+		<< " with " << threads_per_node << " producers and consumers each" << endl;
+
+	queue_test<queue<size_t>>(capacity, thread_count, thread_count, producer_iterations);
+
+	cout << "--------------------------------------------------------------------------------" << endl;
+	numa_queue<size_t> q(capacity, node_count);
+	double rate = checked_rate(q, thread_count, thread_count, producer_iterations);
+	cout << "numa_queue size is: " << capacity << " producer count is: " << thread_count << " consumer count is: " << thread_count << endl;
+	cout << std::fixed << std::setprecision(1) << rate << " items / second, " << q.steals() << " steals moving " << q.stolen_items() << " items ("
+		<< (q.steals() != 0 ? static_cast<double>(q.stolen_items()) / static_cast<double>(q.steals()) : 0.0) << " per steal)" << endl;
+	return item_check::failures() == 0 ? 0 : 3;
+}
+
+// queue combine [max threads], half producers and half consumers of size_t from 2 threads up, queue against flat_combining_queue.  Items per
+// round is how many requests a combining round applied on average.
+int combine(int argc, char *argv[])
+{
+	size_t max_threads = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 128;
+	size_t const capacity = 1024;
+	size_t const total_iterations = c_million / 2;
+
+	cout << std::left << std::setw(10) << "threads" << std::right << std::setw(16) << "queue" << std::setw(22) << "flat_combining_queue" << std::setw(16) << "items / round" << endl;
+	for (size_t threads = 2; threads <= max_threads; threads *= 2)
+	{
+		size_t producer_count = threads / 2;
+		size_t producer_iterations = total_iterations / producer_count;
+
+		queue<size_t> q(capacity);
+		double queue_rate = checked_rate(q, producer_count, producer_count, producer_iterations);
+		flat_combining_queue<size_t> fc(capacity);
+		double fc_rate = checked_rate(fc, producer_count, producer_count, producer_iterations);
+		cout << std::left << std::setw(10) << threads << std::right << std::fixed << std::setprecision(0) << std::setw(16) << queue_rate << std::setw(22) << fc_rate
+			<< std::setprecision(1) << std::setw(16) << static_cast<double>(fc.combined()) / static_cast<double>(std::max<uint64_t>(1, fc.rounds())) << endl;
+	}
+	return item_check::failures() == 0 ? 0 : 3;
+}
+
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && std::strcmp(argv[1], "tune") == 0)
+		return tune(argc, argv);
+	else if (argc > 1 && std::strcmp(argv[1], "replay") == 0)
+		return replay(argc, argv);
+	else if (argc > 1 && std::strcmp(argv[1], "bench") == 0)
+		return bench(argc, argv);
+	else if (argc > 1 && std::strcmp(argv[1], "compare") == 0)
+		return compare(argc, argv);
+	else if (argc > 1 && std::strcmp(argv[1], "micro") == 0)
+		return micro(argc, argv);
+	else if (argc > 1 && std::strcmp(argv[1], "sweep") == 0)
+		return sweep(argc, argv);
+	else if (argc > 1 && std::strcmp(argv[1], "layout") == 0)
+		return layout(argc, argv);
+	else if (argc > 1 && std::strcmp(argv[1], "stream") == 0)
+		return stream(argc, argv);
+	else if (argc > 1 && std::strcmp(argv[1], "bulk") == 0)
+		return bulk(argc, argv);
+	else if (argc > 1 && std::strcmp(argv[1], "relocate") == 0)
+		return relocate(argc, argv);
+	else if (argc > 1 && std::strcmp(argv[1], "close") == 0)
+		return close_queue(argc, argv);
+	else if (argc > 1 && std::strcmp(argv[1], "adaptive") == 0)
+		return adaptive(argc, argv);
+	else if (argc > 1 && std::strcmp(argv[1], "numa") == 0)
+		return numa(argc, argv);
+	else if (argc > 1 && std::strcmp(argv[1], "combine") == 0)
+		return combine(argc, argv);
+#if defined(GUARUNTEED_MPMC_TRACE)
+	else if (argc > 1 && std::strcmp(argv[1], "record") == 0)
+		return record(argc, argv);
+#endif
+
+
+#ifdef _M_AMD64
+	size_t max_capacity = detail::queue_size<size_t>::max_capacity;
+	assert(max_capacity == 4611686018427387904);
+#elif _M_IX86
+	size_t max_capacity = detail::queue_size<size_t>::max_capacity;
+	assert(max_capacity == 1073741824);
+#endif
+
+
+	assert(detail::queue_size<size_t>::round_up_to_power_of_2(2) == 2);
+	assert(detail::queue_size<size_t>::round_up_to_power_of_2(3) == 4);
+	assert(detail::queue_size<size_t>::round_up_to_power_of_2(4) == 4);
+	assert(detail::queue_size<size_t>::round_up_to_power_of_2(5) == 8);
+	assert(detail::queue_size<size_t>::round_up_to_power_of_2(1023) == 1024);
+	assert(detail::queue_size<size_t>::round_up_to_power_of_2(1024) == 1024);
+	assert(detail::queue_size<size_t>::round_up_to_power_of_2(1025) == 2048);
+
+	// Sequence tests.
+	for_each_queue(benchmark_queues(), [](auto tag)
+	{
+		typedef typename decltype(tag)::type Queue;
+		sequence_test<Queue>(8, c_million);
+		cout << "--------------------------------------------------------------------------------" << endl;
+	});
+
+	paired_queue_test(8, 1, 1, c_million);
+	paired_queue_test(4, 2, 2, c_million);
+	paired_queue_test(128, 2, 2, c_million);
+	paired_queue_test(6, 3, 3, c_million);
+	paired_queue_test(128, 3, 3, c_million);
+	paired_queue_test(8, 4, 4, c_million);
+	paired_queue_test(128, 4, 4, c_million);
+	paired_queue_test(16, 8, 8, c_100k);
+	paired_queue_test(128, 8, 8, c_100k);
+	paired_queue_test(1024, 8, 8, c_10k);
+	paired_queue_test(128, 16, 16, c_100k);
+
+	// More producers than cores, where percpu_queue's lanes keep producers from contending.
+	cout << "\npercpu_queue reserves with " << (percpu_queue<size_t>(1).uses_rseq() ? "restartable sequences" : "compare exchange") << endl;
+	paired_queue_test(1024, 4 * std::max(1u, thread::hardware_concurrency()), 2, c_100k);
+
+	cout << "\n================================================================================\n" << endl;
+	for_each_queue(benchmark_queues(), [](auto tag)
+	{
+		typedef typename decltype(tag)::type Queue;
+		if (queue_adapter<Queue>::supports(4, 4))
+		{
+			batch_queue_test<Queue>(128, 4, 4, c_million, 16);
+			cout << "--------------------------------------------------------------------------------" << endl;
+		}
+	});
+
+	cout << "\n================================================================================\n" << endl;
+	logger_test(1024, 1, c_million, log_full_policy::block, "block");
+	logger_test(1024, 4, c_100k, log_full_policy::block, "block");
+	logger_test(1024, 4, c_100k, log_full_policy::drop, "drop");
+	logger_test(1024, 4, c_100k, log_full_policy::count_drops, "count drops");
+
+	cout << "\n================================================================================\n" << endl;
+	pipeline_test(2, c_million, false);
+	cout << "--------------------------------------------------------------------------------" << endl;
+	pipeline_test(2, c_million, true);
+
+	cout << "\n================================================================================\n" << endl;
+	scheduler_test(2, c_100k, c_million);
+	cout << "--------------------------------------------------------------------------------" << endl;
+	scheduler_test(8, c_100k, c_million);
+
+	{
+		size_t worker_count = std::max(2u, thread::hardware_concurrency());
+		task_graph wide = wide_graph(c_100k, 1000);
+		task_graph deep = deep_graph(worker_count, c_10k, 1000);
+		task_graph critical = critical_path_graph(c_10k, c_100k, 1000);
+		for (auto scheduling : { task_scheduling::fifo, task_scheduling::critical_path })
+		{
+			cout << "\n================================================================================\n" << endl;
+			task_graph_test("wide", wide, worker_count, scheduling);
+			cout << "--------------------------------------------------------------------------------" << endl;
+			task_graph_test("deep", deep, worker_count, scheduling);
+			cout << "--------------------------------------------------------------------------------" << endl;
+			task_graph_test("critical path", critical, worker_count, scheduling);
+		}
+	}
+
+#if defined(__linux__)
+	cout << "\n================================================================================\n" << endl;
+	sink_test(1024, 1, c_million, false);
+	cout << "--------------------------------------------------------------------------------" << endl;
+	sink_test(1024, 1, c_million, true);
+	cout << "--------------------------------------------------------------------------------" << endl;
+	sink_test(1024, 4, c_100k, false);
+	cout << "--------------------------------------------------------------------------------" << endl;
+	sink_test(1024, 4, c_100k, true);
+
+	cout << "\n================================================================================\n" << endl;
+	idle_memory_test(size_t(1) << 22, 100);
+#endif
 
+	if (item_check::failures() != 0)
+		cout << "\n\n" << item_check::failures() << " scenario run(s) failed verification" << endl;
 	cout << "\n\nCompleted!" << endl;
 	::getchar();
     return 0;
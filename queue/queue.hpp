@@ -8,22 +8,306 @@
 #define GUARUNTEED_MPMC_QUEUE_HPP
 
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <limits>
+#include <memory>
+#include <new>
 #include <stdexcept>
+#include <thread>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <malloc.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GUARUNTEED_MPMC_STREAMING_STORES
+#endif
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// A host specific configuration (such as the one generated by 'queue tune') can be pulled in by defining GUARUNTEED_MPMC_CONFIG_HEADER to its path.
+#if defined(GUARUNTEED_MPMC_CONFIG_HEADER)
+#include GUARUNTEED_MPMC_CONFIG_HEADER
+#endif
+
+// Some CPUs prefetch adjacent pairs of cache lines, on those 128 keeps the counters from false sharing.
+#if !defined(GUARUNTEED_MPMC_CACHE_LINE_SIZE)
+#define GUARUNTEED_MPMC_CACHE_LINE_SIZE 64
+#endif
+
+#if !defined(GUARUNTEED_MPMC_CONCURRENCY)
+#define GUARUNTEED_MPMC_CONCURRENCY 256
+#endif
+
+// How many slots ahead of the one it reserved a push prefetches for write (and a pop for read), 0 turns prefetching off.  Worth it for buffers
+// that don't fit in cache, see 'queue sweep ... prefetch'.
+#if !defined(GUARUNTEED_MPMC_PREFETCH_DISTANCE)
+#define GUARUNTEED_MPMC_PREFETCH_DISTANCE 0
+#endif
+
+// Trivially copyable T at least this many bytes are written into the buffer with non-temporal (streaming) stores that bypass the producer's cache,
+// for large items consumed on another core or socket.  0 turns streaming off, 'queue stream' measures where it starts to win.
+#if !defined(GUARUNTEED_MPMC_STREAMING_STORE_BYTES)
+#define GUARUNTEED_MPMC_STREAMING_STORE_BYTES 0
+#endif
+
+// 1 keeps trivially copyable T in a plain array (detail::trivial_slot) and batch operations copy runs of it from and to T* with the vector kernels
+// of bulk_copy.hpp, 0 (the default) keeps an optional per slot and copies item by item.  'queue bulk' measures the difference.
+#if !defined(GUARUNTEED_MPMC_BULK_COPY)
+#define GUARUNTEED_MPMC_BULK_COPY 0
+#endif
+
+// per_counter or by_role, see detail::control_layout.
+#if !defined(GUARUNTEED_MPMC_CONTROL_LAYOUT)
+#define GUARUNTEED_MPMC_CONTROL_LAYOUT per_counter
+#endif
+
+#include "bulk_copy.hpp"
+
+// Recording of push/pop arrival times for trace replay (see trace.hpp), compiled out unless GUARUNTEED_MPMC_TRACE is defined.  The time is taken on
+// entry and recorded once the operation has been admitted, at which point it can no longer fail (a push once it has reserved its slot, it still
+// fails if the queue was closed before that).
+#if defined(GUARUNTEED_MPMC_TRACE)
+#include "trace.hpp"
+#define GUARUNTEED_MPMC_TRACE_BEGIN uint64_t trace_time = detail::trace_now(this)
+#define GUARUNTEED_MPMC_TRACE_END(op, count) detail::trace_record(trace_time, trace_op::op, count)
+#else
+#define GUARUNTEED_MPMC_TRACE_BEGIN
+#define GUARUNTEED_MPMC_TRACE_END(op, count)
+#endif
+
 namespace detail
 {
-	// Add macro magic here for cache line size depending on hardware ...
-	static const size_t cache_line_size = 64;
+	// Cache line size depending on hardware, see GUARUNTEED_MPMC_CACHE_LINE_SIZE.
+	static const size_t cache_line_size = GUARUNTEED_MPMC_CACHE_LINE_SIZE;
 
-	// Add macro magic here for the correct number of wait iterations for trailing back/front value before a yeild, this is hardware dependant...
+	// The number of wait iterations for trailing back/front value before a yeild, this is hardware dependant, see GUARUNTEED_MPMC_CONCURRENCY.
 	// TODO: This has little to do with concurrency, and a lot more to do with oversubscription...
-	static const uint32_t concurrency = 256;
+	static const uint32_t concurrency = GUARUNTEED_MPMC_CONCURRENCY;
+
+	// See GUARUNTEED_MPMC_PREFETCH_DISTANCE.
+	static const size_t prefetch_distance = GUARUNTEED_MPMC_PREFETCH_DISTANCE;
+
+	inline void prefetch_for_write(void const *p)
+	{
+#if defined(__GNUC__)
+		__builtin_prefetch(p, 1, 3);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		_m_prefetchw(p);
+#else
+		(void)p;
+#endif
+	}
+
+	inline void prefetch_for_read(void const *p)
+	{
+#if defined(__GNUC__)
+		__builtin_prefetch(p, 0, 3);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		_mm_prefetch(static_cast<char const*>(p), _MM_HINT_T0);
+#else
+		(void)p;
+#endif
+	}
+
+	// See GUARUNTEED_MPMC_BULK_COPY.
+	static const bool bulk_copy = GUARUNTEED_MPMC_BULK_COPY != 0;
+
+	// See GUARUNTEED_MPMC_STREAMING_STORE_BYTES.
+	static const size_t streaming_store_bytes = GUARUNTEED_MPMC_STREAMING_STORE_BYTES;
+
+	// Copies with non-temporal stores where there are some (SSE2), the stores are weakly ordered so stream_fence must come before publishing.
+	inline void stream_copy(void *destination, void const *source, size_t size)
+	{
+#if defined(GUARUNTEED_MPMC_STREAMING_STORES)
+		char *d = static_cast<char*>(destination);
+		char const *s = static_cast<char const*>(source);
+
+		// The streaming store needs a 16 byte aligned destination, the bytes before the first boundary and after the last are ordinary stores.
+		size_t head = std::min(size, static_cast<size_t>((16 - reinterpret_cast<uintptr_t>(d) % 16) % 16));
+		std::memcpy(d, s, head);
+		d += head;
+		s += head;
+		size -= head;
+		for (; size >= 16; d += 16, s += 16, size -= 16)
+			_mm_stream_si128(reinterpret_cast<__m128i*>(d), _mm_loadu_si128(reinterpret_cast<__m128i const*>(s)));
+		std::memcpy(d, s, size);
+#else
+		std::memcpy(destination, source, size);
+#endif
+	}
+
+	inline void stream_fence()
+	{
+#if defined(GUARUNTEED_MPMC_STREAMING_STORES)
+		_mm_sfence();
+#endif
+	}
+
+	// Heap memory for types aligned past what operator new guarantees (the cache line aligned control blocks), which new only honours from C++17
+	// on.  Throws std::bad_alloc like new.
+	inline void* aligned_allocate(size_t alignment, size_t size)
+	{
+		void *p = nullptr;
+#if defined(_MSC_VER)
+		p = _aligned_malloc(size, alignment);
+#else
+		if (posix_memalign(&p, std::max(alignment, sizeof(void*)), size) != 0)
+			p = nullptr;
+#endif
+		if (p == nullptr)
+			throw std::bad_alloc();
+		return p;
+	}
+
+	inline void aligned_deallocate(void *p)
+	{
+#if defined(_MSC_VER)
+		_aligned_free(p);
+#else
+		std::free(p);
+#endif
+	}
+
+	template <class T>
+	struct aligned_delete
+	{
+		void operator()(T *p) const
+		{
+			p->~T();
+			aligned_deallocate(p);
+		}
+	};
+
+	template <class T>
+	using aligned_ptr = std::unique_ptr<T, aligned_delete<T>>;
+
+	// new T(args...) at T's alignment.
+	template <class T, class... Args>
+	aligned_ptr<T> make_aligned(Args&&... args)
+	{
+		void *p = aligned_allocate(alignof(T), sizeof(T));
+		try
+		{
+			return aligned_ptr<T>(new (p) T(std::forward<Args>(args)...));
+		}
+		catch (...)
+		{
+			aligned_deallocate(p);
+			throw;
+		}
+	}
+
+	// An allocator at T's alignment, for containers (and allocate_shared) of cache line aligned types.
+	template <class T>
+	struct aligned_allocator
+	{
+		typedef T value_type;
+
+		aligned_allocator() {}
+		template <class U>
+		aligned_allocator(aligned_allocator<U> const&) {}
+
+		T* allocate(size_t n)
+		{
+			if (n > std::numeric_limits<size_t>::max() / sizeof(T))
+				throw std::bad_alloc();
+			return static_cast<T*>(aligned_allocate(alignof(T), n * sizeof(T)));
+		}
+
+		void deallocate(T *p, size_t)
+		{
+			aligned_deallocate(p);
+		}
+	};
+
+	template <class T, class U>
+	bool operator==(aligned_allocator<T> const&, aligned_allocator<U> const&)
+	{
+		return true;
+	}
+
+	template <class T, class U>
+	bool operator!=(aligned_allocator<T> const&, aligned_allocator<U> const&)
+	{
+		return false;
+	}
+
+}
+
+
+// Whether moving a T and destroying the source is the same as copying its bytes (and forgetting the source), which lets the queue relocate items
+// into and out of its slots with a memcpy instead of a move construction and a destructor.  Trivially copyable types are, others have to opt in with a
+// specialization.  A type isn't if it points into itself (libstdc++'s std::string, std::list) or something points back at it.
+template <class T>
+struct is_trivially_relocatable : std::is_trivially_copyable<T>
+{
+};
+
+template <class T>
+struct is_trivially_relocatable<std::unique_ptr<T, std::default_delete<T>>> : std::true_type
+{
+};
+
+template <class T>
+struct is_trivially_relocatable<std::shared_ptr<T>> : std::true_type
+{
+};
+
+template <class T>
+struct is_trivially_relocatable<std::weak_ptr<T>> : std::true_type
+{
+};
+
+// With iterator debugging msvc's containers keep a proxy that points back at them, and libstdc++'s debug mode containers (_GLIBCXX_DEBUG) keep a
+// list of their iterators, each pointing back at the container.
+#if (!defined(_ITERATOR_DEBUG_LEVEL) || _ITERATOR_DEBUG_LEVEL == 0) && !defined(_GLIBCXX_DEBUG)
+template <class T>
+struct is_trivially_relocatable<std::vector<T, std::allocator<T>>> : std::true_type
+{
+};
+#endif
+
+
+namespace detail
+{
+	// Moves the T at source into the uninitialized storage at destination and ends the source's lifetime, a copy of the bytes when T is
+	// trivially relocatable.
+	template <class T>
+	inline void relocate(T *destination, T *source, std::true_type)
+	{
+		std::memcpy(static_cast<void*>(destination), static_cast<void const*>(source), sizeof(T));
+	}
+
+	template <class T>
+	inline void relocate(T *destination, T *source, std::false_type)
+	{
+		new (destination) T(std::move(*source));
+		source->~T();
+	}
+
+	template <class T>
+	inline void relocate(T *destination, T *source)
+	{
+		relocate(destination, source, is_trivially_relocatable<T>());
+	}
 
 
 	// My current compiler doesn't include experimental/optional...
@@ -35,10 +319,11 @@ namespace detail
 		optional(optional<T> const &o) : has_value_(o.has_value_)
 		{
 			if (has_value_)
-				new (&storage_) T(o);
+				new (&storage_) T(reinterpret_cast<T const&>(o.storage_));
 		}
 		
-		optional(optional<T>&& o) : has_value_(std::move(o.has_value_))
+		// noexcept where T's is, so a vector of them (the buffer) moves rather than copies them and takes move only T.
+		optional(optional<T>&& o) noexcept(std::is_nothrow_move_constructible<T>::value) : has_value_(std::move(o.has_value_))
 		{
 			if (has_value_)
 				new (&storage_) T(std::move(reinterpret_cast<T&>(o.storage_)));
@@ -58,7 +343,7 @@ namespace detail
 		optional<T>& operator=(optional<T> const &o)
 		{
 			if (has_value_)
-				reinterpret_cast<T*>(&storage_)->~();
+				reinterpret_cast<T*>(&storage_)->~T();
 
 			has_value_ = o.has_value_;
 			if (has_value_)
@@ -102,7 +387,7 @@ namespace detail
 
 		T const& get() const
 		{
-			reinterpret_cast<T&>(o.storage_)
+			return reinterpret_cast<T const&>(storage_);
 		}
 
 		T const& operator*() const
@@ -125,10 +410,45 @@ namespace detail
 			return &get();
 		}
 
+		// Sets the value with streaming stores (see stream_copy), T must be trivially copyable.
+		void stream_assign(T const &t)
+		{
+			stream_copy(&storage_, &t, sizeof(T));
+			has_value_ = true;
+		}
+
+		// Moves the value out, destroying what is left of it.
 		T release()
 		{
 			has_value_ = false;
-			return std::move(reinterpret_cast<T&>(storage_));
+			T t(std::move(reinterpret_cast<T&>(storage_)));
+			reinterpret_cast<T*>(&storage_)->~T();
+			return t;
+		}
+
+		// Moves the value out into the uninitialized storage at destination, see relocate.
+		void relocate_to(T *destination)
+		{
+			has_value_ = false;
+			relocate(destination, reinterpret_cast<T*>(&storage_));
+		}
+
+		// Takes the value of slot (an optional or a trivial_slot holding one), this optional must be empty.
+		template <class Slot>
+		void relocate_from(Slot &slot)
+		{
+			assert(!has_value_);
+			slot.relocate_to(reinterpret_cast<T*>(&storage_));
+			has_value_ = true;
+		}
+
+		// Takes the value of t, leaving a default constructed T in its place (which must not throw), this optional must be empty.
+		void relocate_assign(T &t)
+		{
+			assert(!has_value_);
+			relocate(reinterpret_cast<T*>(&storage_), &t);
+			new (&t) T();
+			has_value_ = true;
 		}
 
 	private:
@@ -137,6 +457,44 @@ namespace detail
 		bool has_value_;
 	};
 
+	// A slot of the buffer for a trivially copyable T, there is nothing to destroy so it doesn't need to know whether it holds a value.  Without the
+	// flag a run of slots is a plain array of T, which the batch operations copy in bulk (and small items take half the space).  The part of
+	// optional's interface the queue uses on its slots.
+	template <class T>
+	class trivial_slot
+	{
+	public:
+		trivial_slot& operator=(T &&t)
+		{
+			new (&storage_) T(t);
+			return *this;
+		}
+
+		T& get()
+		{
+			return reinterpret_cast<T&>(storage_);
+		}
+
+		void stream_assign(T const &t)
+		{
+			stream_copy(&storage_, &t, sizeof(T));
+		}
+
+		T release()
+		{
+			return reinterpret_cast<T&>(storage_);
+		}
+
+		void relocate_to(T *destination)
+		{
+			std::memcpy(static_cast<void*>(destination), &storage_, sizeof(T));
+		}
+
+	private:
+		typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_type;
+		storage_type storage_;
+	};
+
 	template <typename SizeType>
 	struct queue_size
 	{
@@ -186,61 +544,230 @@ namespace detail
 			return c;
 		}
 	};
+
+#if defined(GUARUNTEED_MPMC_COUNT_RMW)
+	// Atomic read-modify-write operations made by the calling thread on queue counters, for the microbenchmarks.
+	inline uint64_t& rmw_count()
+	{
+		static thread_local uint64_t count = 0;
+		return count;
+	}
+
+	// std::atomic that counts its read-modify-write operations, a failed compare exchange still is one.
+	template <class T>
+	struct rmw_atomic : std::atomic<T>
+	{
+		rmw_atomic(T t) : std::atomic<T>(t) {}
+
+		using std::atomic<T>::operator=;
+
+		T fetch_add(T v, std::memory_order order = std::memory_order_seq_cst)
+		{
+			++rmw_count();
+			return std::atomic<T>::fetch_add(v, order);
+		}
+
+		T fetch_sub(T v, std::memory_order order = std::memory_order_seq_cst)
+		{
+			++rmw_count();
+			return std::atomic<T>::fetch_sub(v, order);
+		}
+
+		T fetch_or(T v, std::memory_order order = std::memory_order_seq_cst)
+		{
+			++rmw_count();
+			return std::atomic<T>::fetch_or(v, order);
+		}
+
+		bool compare_exchange_weak(T &expected, T desired, std::memory_order order = std::memory_order_seq_cst)
+		{
+			++rmw_count();
+			return std::atomic<T>::compare_exchange_weak(expected, desired, order);
+		}
+
+		bool compare_exchange_strong(T &expected, T desired, std::memory_order order = std::memory_order_seq_cst)
+		{
+			++rmw_count();
+			return std::atomic<T>::compare_exchange_strong(expected, desired, order);
+		}
+	};
+#else
+	template <class T>
+	using rmw_atomic = std::atomic<T>;
+#endif
+
+	// How the six control counters are spread over cache lines.
+	//   per_counter    every counter on its own line, a push or pop touches four lines (the two size bounds are written by both sides).
+	//   by_role        the counters a push writes first (size_upper_bound_, back_lead_, back_trail_) share one line and the ones a pop writes first
+	//                  (size_lower_bound_, front_lead_, front_trail_) another, so a push or pop touches two lines.  Producers then contend with each
+	//                  other on one line instead of three, at the cost of the other side's single bound update landing on that same line.
+	enum class control_layout
+	{
+		per_counter,
+		by_role
+	};
+
+	// Hardware dependant tuning of a queue, the defaults come from the configuration macros.  Instantiating queue with other traits lets several
+	// configurations be compared in one process (which is what 'queue tune' does).
+	template <size_t CacheLineSize = cache_line_size, uint32_t Concurrency = concurrency, control_layout Layout = control_layout::GUARUNTEED_MPMC_CONTROL_LAYOUT,
+		size_t PrefetchDistance = prefetch_distance, size_t StreamingStoreBytes = streaming_store_bytes, bool BulkCopy = bulk_copy>
+	struct queue_traits
+	{
+		static const size_t cache_line_size = CacheLineSize;
+		static const uint32_t concurrency = Concurrency;
+		static const control_layout layout = Layout;
+		static const size_t prefetch_distance = PrefetchDistance;
+		static const size_t streaming_store_bytes = StreamingStoreBytes;
+		static const bool bulk_copy = BulkCopy;
+	};
+
+	// Alignment of a control counter, the first counter of each role always starts a cache line.
+	template <class Traits, bool FirstOfRole>
+	struct control_alignment
+	{
+		static const size_t value = FirstOfRole || Traits::layout == control_layout::per_counter ? Traits::cache_line_size : alignof(std::atomic<size_t>);
+	};
 }
 
 
-template <class T>
+// Thrown by pop() on a queue that has been closed and drained, see queue::close.
+class queue_closed : public std::runtime_error
+{
+public:
+	queue_closed() : std::runtime_error("queue is closed and drained") {}
+};
+
+// What a try pop came back with, so a consumer can tell a queue that has nothing yet from one that is closed and drained.
+enum class pop_status
+{
+	popped,
+	empty,
+	closed
+};
+
+
+template <class T, class Traits = detail::queue_traits<>>
 class queue
 {
 public:
 
+	typedef T value_type;
 	typedef detail::optional<T> optional_t;
 
+	// What each slot of the buffer holds, optional_t or for trivially copyable T a detail::trivial_slot, so sizeof(slot_type) is the buffer's bytes
+	// per item.
+	typedef typename std::conditional<Traits::bulk_copy && std::is_trivially_copyable<T>::value, detail::trivial_slot<T>, optional_t>::type slot_type;
+
 	queue(size_t);
 
-	void push(T&&);
+	bool push(T&&);
 	bool try_push(T&, uint16_t);
 	T pop();
 	optional_t try_pop(uint16_t);
+	optional_t try_pop(uint16_t, pop_status&);
+
+	template <class InputIt>
+	bool push_batch(InputIt, size_t);
+	template <class OutputIt>
+	size_t try_pop_batch(OutputIt, size_t, uint16_t);
+	template <class OutputIt>
+	size_t try_pop_batch(OutputIt, size_t, uint16_t, pop_status&);
 	
 	size_t size() const;
 	size_t empty() const;
 	size_t capacity() const;
 
+	void close();
+	bool closed() const;
+
+	size_t release_idle_memory();
+
 private:
 	typedef detail::queue_size<size_t>::type queue_size_t;
-	typedef detail::queue_size<size_t>::atomic_type atomic_queue_size_t;
+	typedef detail::rmw_atomic<queue_size_t> atomic_queue_size_t;
+	typedef detail::rmw_atomic<size_t> atomic_index_t;
 
-	size_t bounded_index(size_t) const;
-	void push_impl(T&&);
-	T pop_impl();
+	// Set in back_lead_ by close(), indices stay well below it (2^63 pushes).
+	static const size_t closed_mark = size_t(1) << (std::numeric_limits<size_t>::digits - 1);
 
+	// close_index_ until the queue is closed.
+	static const size_t not_closed = std::numeric_limits<size_t>::max();
 
-	// Tracks the queue size upper bound.  The size upper bound is the number of queue slots either holding a T object, holding a partially formed T object, or reserved (by push operation) to write a T object.
-	alignas(detail::cache_line_size) atomic_queue_size_t size_upper_bound_;
+	static const bool streaming_stores = std::is_trivially_copyable<T>::value && Traits::streaming_store_bytes != 0 && sizeof(T) >= Traits::streaming_store_bytes;
 
-	// Tracks the queue size lower bound.  The size lower bound is the number of fully formed T objects in the queue, not reserved (by pop operation) to read a T object.
-	alignas(detail::cache_line_size) atomic_queue_size_t size_lower_bound_;
+	static const bool trivial_slots = !std::is_same<slot_type, optional_t>::value;
+	typedef slot_type slot_t;
+
+	// push and pop relocate items into and out of the slots rather than moving them, the pushed T is left default constructed.  Trivially copyable
+	// T are copied as they are.
+	static const bool relocate_items = is_trivially_relocatable<T>::value && !std::is_trivially_copyable<T>::value && std::is_nothrow_default_constructible<T>::value;
+	typedef std::integral_constant<bool, relocate_items> relocate_items_tag;
+
+	// Whether a batch from or to It is copied with detail::copy_items, the slots have to be trivial and It a T* (contiguous).
+	template <class It>
+	using bulk_copy_tag = std::integral_constant<bool, trivial_slots && !streaming_stores && std::is_pointer<It>::value
+		&& std::is_same<typename std::remove_cv<typename std::remove_pointer<It>::type>::type, T>::value>;
+
+	size_t bounded_index(size_t) const;
+	bool drained() const;
+	bool push_impl(T&&);
+	template <class Result, class Take>
+	Result pop_impl(Take);
+	template <class InputIt>
+	bool push_batch_impl(InputIt, size_t);
+	template <class OutputIt>
+	void pop_batch_impl(OutputIt, size_t);
+	template <class InputIt>
+	void write_slots(size_t, InputIt, size_t, std::false_type);
+	void write_slots(size_t, T const*, size_t, std::true_type);
+	template <class OutputIt>
+	void read_slots(size_t, OutputIt, size_t, std::false_type);
+	void read_slots(size_t, T*, size_t, std::true_type);
+	template <class OutputIt>
+	static void take_slot(slot_t&, OutputIt, std::false_type);
+	static void take_slot(slot_t&, T*, std::true_type);
+	static void put_slot(slot_t&, T&, std::false_type);
+	static void put_slot(slot_t&, T&, std::true_type);
+	static T release_slot(slot_t&, std::false_type);
+	static T release_slot(slot_t&, std::true_type);
+
+
+	// The counters are declared grouped by the role that writes them first (push then pop), see detail::control_layout for how they are placed.
+
+	// Tracks the queue size upper bound.  The size upper bound is the number of queue slots either holding a T object, holding a partially formed T object, or reserved (by push operation) to write a T object.
+	alignas(detail::control_alignment<Traits, true>::value) atomic_queue_size_t size_upper_bound_;
 
 	// The back of the queue is where items are inserted (pushed). back_lead_ is the leading (edge of 'back' of the queue) index where slots in the queue are reserved for writing a T object.
-	alignas(detail::cache_line_size) std::atomic_size_t back_lead_;
+	alignas(detail::control_alignment<Traits, false>::value) atomic_index_t back_lead_;
 	
 	// The back of the queue is where items are 'pushed'.  back_trail_ is the trailing (edge of 'back' of queue) index where fully formed T objects have been written.
-	alignas(detail::cache_line_size) std::atomic_size_t back_trail_;
+	alignas(detail::control_alignment<Traits, false>::value) atomic_index_t back_trail_;
+
+	// Tracks the queue size lower bound.  The size lower bound is the number of fully formed T objects in the queue, not reserved (by pop operation) to read a T object.
+	alignas(detail::control_alignment<Traits, true>::value) atomic_queue_size_t size_lower_bound_;
 
 	// The front of the queue is where items are removed from (poped). front_lead_ is the leading (edge of 'front') index reserved (by pop operation) to read a T object.
-	alignas(detail::cache_line_size) std::atomic_size_t front_lead_;
+	alignas(detail::control_alignment<Traits, false>::value) atomic_index_t front_lead_;
 
 	// The front of the queue is where items are 'poped'.  front_trail_ is the trailing (edge of 'front' of queue) index where T objects are read from.
-	alignas(detail::cache_line_size) std::atomic_size_t front_trail_;
+	alignas(detail::control_alignment<Traits, false>::value) atomic_index_t front_trail_;
+
+	// The back_lead_ at which the queue was closed, the number of pushes pops drain before failing, not_closed until then.  Only read while waiting
+	// for room or for an item, on its own line so the waits don't pull in a counter line.
+	alignas(Traits::cache_line_size) std::atomic<size_t> close_index_;
+
+	// Steps through four phases per release_idle_memory so size() can tell whether size_upper_bound_ holds its bias: adding it, held, taking it
+	// off, and none (0 modulo 4).
+	alignas(Traits::cache_line_size) std::atomic<uint32_t> release_epoch_;
 
 	// A buffer sized for holding elements of queue.
-	alignas(detail::cache_line_size) std::vector<optional_t> buffer_;
+	alignas(Traits::cache_line_size) std::vector<slot_t> buffer_;
 };
 
 
-template <class T>
-queue<T>::queue(size_t capacity) : size_upper_bound_(0), size_lower_bound_(0), back_lead_(0), back_trail_(0), front_lead_(0), front_trail_(0)
+template <class T, class Traits>
+queue<T, Traits>::queue(size_t capacity) : size_upper_bound_(0), back_lead_(0), back_trail_(0), size_lower_bound_(0), front_lead_(0), front_trail_(0),
+	close_index_(not_closed), release_epoch_(0)
 {
 	// The inc logic for back/front lead/trail edges working correctly depends on buffer_.size() dividing evenly into range of size_t, so that modulus
 	// always returns the next valid index in buffer as if it were w ring buffer (it is emulating a ring buffer...)
@@ -253,131 +780,375 @@ queue<T>::queue(size_t capacity) : size_upper_bound_(0), size_lower_bound_(0), b
 	buffer_.resize(capacity);
 }
 
-template <class T>
-void queue<T>::push(T&& t)
+// Returns false (leaving t as it was) once the queue is closed.
+template <class T, class Traits>
+bool queue<T, Traits>::push(T&& t)
 {
-	// Increase queueu upper bound size, wait while there are no completely empty slots in queue.
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	// A push after the close fails without touching the counters, only one racing the close reserves and gives the slot back (see push_impl).
+	if (closed())
+		return false;
+
+	// Increase queueu upper bound size, wait while there are no completely empty slots in queue (and the queue is open).  The wait yields the way
+	// the trailing edge waits do, a waiter has to be scheduled to see close().
+	uint32_t wait_count = 0;
 	for (queue_size_t size = size_upper_bound_.fetch_add(1) + 1; size > static_cast<queue_size_t>(buffer_.size()); size = size_upper_bound_.fetch_add(1) + 1)
 	{
 		size_upper_bound_.fetch_sub(1); // Back off and retry.
+		if (closed())
+			return false;
+		if ((wait_count++ % Traits::concurrency) + 1 == Traits::concurrency)
+			std::this_thread::yield(); // Deal with oversubscription...
 	}
 
-	push_impl(std::move(t));
+	if (!push_impl(std::move(t)))
+		return false;
+	GUARUNTEED_MPMC_TRACE_END(push, 1);
+	return true;
 }
 
-template<class T>
-bool queue<T>::try_push(T &t, uint16_t attempts)
+template <class T, class Traits>
+bool queue<T, Traits>::try_push(T &t, uint16_t attempts)
 {
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	if (closed())
+		return false;
+
 	// Increase queueu upper bound size, wait while there are no completely empty slots in queue.
 	uint16_t attempt = 0;
 	for (queue_size_t size = size_upper_bound_.fetch_add(1) + 1; size > static_cast<queue_size_t>(buffer_.size()); size = size_upper_bound_.fetch_add(1) + 1)
 	{
 		size_upper_bound_.fetch_sub(1); // Back off and retry.
-		if (attempt == attempts)
+		if (attempt == attempts || closed())
 		{
 			return false;
 		}
 		++attempt;
 	}
 
-	push_impl(std::move(t));
+	if (!push_impl(std::move(t)))
+		return false;
+	GUARUNTEED_MPMC_TRACE_END(push, 1);
 	return true;
 }
 
-template <class T>
-T queue<T>::pop()
+// Throws queue_closed once the queue is closed and every item pushed before that has been popped.
+template <class T, class Traits>
+T queue<T, Traits>::pop()
 {
-	// Decrease queueu lower bound size, wait while there are no completely filled slots in queue.
-	uint16_t attempt = 0;
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	// Decrease queueu lower bound size, wait while there are no completely filled slots in queue (and more are still to come), yielding like push.
+	uint32_t wait_count = 0;
 	for (queue_size_t size = size_lower_bound_.fetch_sub(1) - 1; size < 0; size = size_lower_bound_.fetch_sub(1) - 1)
 	{
 		size_lower_bound_.fetch_add(1); // Back off and retry.
+		if (drained())
+			throw queue_closed();
+		if ((wait_count++ % Traits::concurrency) + 1 == Traits::concurrency)
+			std::this_thread::yield(); // Deal with oversubscription...
 	}
 
-	return pop_impl();
+	GUARUNTEED_MPMC_TRACE_END(pop, 1);
+	return pop_impl<T>([](slot_t &slot) { return release_slot(slot, relocate_items_tag()); });
+}
+
+template <class T, class Traits>
+typename queue<T, Traits>::optional_t queue<T, Traits>::try_pop(uint16_t attempts)
+{
+	pop_status status;
+	return try_pop(attempts, status);
 }
 
-template<class T>
-typename queue<T>::optional_t queue<T>::try_pop(uint16_t attempts)
+// Comes back empty with status empty while there is nothing to pop, or closed once the queue is closed and every item pushed before that has been
+// popped.
+template <class T, class Traits>
+typename queue<T, Traits>::optional_t queue<T, Traits>::try_pop(uint16_t attempts, pop_status &status)
 {
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
 	// Decrease queueu lower bound size, wait while there are no completely filled slots in queue.
 	optional_t ot;
 	uint16_t attempt = 0;
 	for (queue_size_t size = size_lower_bound_.fetch_sub(1) - 1; size < 0; size = size_lower_bound_.fetch_sub(1) - 1)
 	{
 		size_lower_bound_.fetch_add(1); // Back off and retry.
-		if (attempt == attempts)
+		bool is_drained = drained();
+		if (attempt == attempts || is_drained)
 		{
+			status = is_drained ? pop_status::closed : pop_status::empty;
 			return ot;
 		}
 		++attempt;
 	}
 
-	return pop_impl();
+	GUARUNTEED_MPMC_TRACE_END(pop, 1);
+	status = pop_status::popped;
+	return pop_impl<optional_t>([](slot_t &slot)
+	{
+		// Straight into the returned optional, a memcpy for a trivially relocatable T.
+		optional_t value;
+		value.relocate_from(slot);
+		return value;
+	});
 }
 
-template <class T>
-size_t queue<T>::size() const
+// Pushes count items as one contiguous run of the queue, reserving all the slots with a single increment of each counter.
+// Returns false (pushing none of them) once the queue is closed.
+template <class T, class Traits>
+template <class InputIt>
+bool queue<T, Traits>::push_batch(InputIt first, size_t count)
 {
-	 return size_upper_bound_;
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	if (count > buffer_.size())
+		throw std::invalid_argument("specified batch is larger than the capacity of queue");
+	else if (count == 0)
+		return !closed();
+	else if (closed())
+		return false;
+
+	// Increase queueu upper bound size by the whole batch, wait while there are not enough completely empty slots in queue, yielding like push.
+	queue_size_t n = static_cast<queue_size_t>(count);
+	uint32_t wait_count = 0;
+	for (queue_size_t size = size_upper_bound_.fetch_add(n) + n; size > static_cast<queue_size_t>(buffer_.size()); size = size_upper_bound_.fetch_add(n) + n)
+	{
+		size_upper_bound_.fetch_sub(n); // Back off and retry.
+		if (closed())
+			return false;
+		if ((wait_count++ % Traits::concurrency) + 1 == Traits::concurrency)
+			std::this_thread::yield(); // Deal with oversubscription...
+	}
+
+	if (!push_batch_impl(first, count))
+		return false;
+	GUARUNTEED_MPMC_TRACE_END(push, count);
+	return true;
 }
 
-template <class T>
-size_t queue<T>::empty() const
+// Pops up to max_count items, whatever is available, returns the number of items written to out (0 once the queue is closed and drained).
+template <class T, class Traits>
+template <class OutputIt>
+size_t queue<T, Traits>::try_pop_batch(OutputIt out, size_t max_count, uint16_t attempts)
+{
+	pop_status status;
+	return try_pop_batch(out, max_count, attempts, status);
+}
+
+// As try_pop_batch, with status saying whether a 0 means nothing to pop yet or closed and drained.
+template <class T, class Traits>
+template <class OutputIt>
+size_t queue<T, Traits>::try_pop_batch(OutputIt out, size_t max_count, uint16_t attempts, pop_status &status)
+{
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	// Decrease queueu lower bound size by as many filled slots as are available (up to max_count) in one step.
+	uint16_t attempt = 0;
+	queue_size_t count = 0;
+	for (queue_size_t size = size_lower_bound_; ; )
+	{
+		if (size > 0)
+		{
+			count = std::min(size, static_cast<queue_size_t>(max_count));
+			if (size_lower_bound_.compare_exchange_weak(size, size - count))
+				break;
+		}
+		else
+		{
+			bool is_drained = drained();
+			if (attempt == attempts || max_count == 0 || is_drained)
+			{
+				status = is_drained ? pop_status::closed : pop_status::empty;
+				return 0;
+			}
+			++attempt;
+			size = size_lower_bound_;
+		}
+	}
+
+	GUARUNTEED_MPMC_TRACE_END(pop, static_cast<size_t>(count));
+	status = pop_status::popped;
+	pop_batch_impl(out, static_cast<size_t>(count));
+	return static_cast<size_t>(count);
+}
+
+// The size upper bound, less release_idle_memory's bias while it holds one.
+template <class T, class Traits>
+size_t queue<T, Traits>::size() const
+{
+	for (uint32_t wait_count = 0; ; ++wait_count)
+	{
+		// A read between the epoch loads that saw no step knows which side of the bias it is on, except while the bias is being added or taken off.
+		uint32_t epoch = release_epoch_;
+		queue_size_t bound = size_upper_bound_;
+		if (release_epoch_ == epoch && epoch % 2 == 0)
+			return static_cast<size_t>(epoch % 4 == 0 ? bound : bound - static_cast<queue_size_t>(buffer_.size()));
+
+		if ((wait_count % Traits::concurrency) + 1 == Traits::concurrency)
+			std::this_thread::yield(); // Deal with oversubscription...
+	}
+}
+
+template <class T, class Traits>
+size_t queue<T, Traits>::empty() const
 {
 	return size_lower_bound_ == 0;
 }
 
-template <class T>
-size_t queue<T>::capacity() const
+template <class T, class Traits>
+size_t queue<T, Traits>::capacity() const
 {
 	return buffer_.size();
 }
 
-template <class T>
-size_t queue<T>::bounded_index(size_t unbounded_index) const
+// Closes the queue (a channel close): pushes fail from here on, pops take the items already pushed and then fail, pop() by throwing queue_closed
+// and the try operations by coming back empty with pop_status::closed.  Pushes and pops waiting for room or for an item are released rather than left spinning, so
+// consumers can be shut down without a sentinel item each.  Marking back_lead_ is what orders the close against pushes, those that reserved a
+// slot before it complete (and are drained), those after it back off.  Closing more than once does nothing.
+template <class T, class Traits>
+void queue<T, Traits>::close()
+{
+	size_t index = back_lead_.fetch_or(closed_mark);
+	if ((index & closed_mark) == 0)
+		close_index_ = index;
+}
+
+template <class T, class Traits>
+bool queue<T, Traits>::closed() const
+{
+	return close_index_ != not_closed;
+}
+
+// Returns the pages of buffer_ that no operation can touch before the indices next wrap to the system (madvise MADV_DONTNEED), they are faulted
+// back in (zero filled) as pushes reach them, so the resident size follows the load.  Returns the number of bytes released, always 0 where there
+// is no madvise.  Pushes are held off (by biasing the size upper bound past the capacity) for the duration, pops carry on: push waits and
+// try_push fails as though the queue were full, however empty it is, while size() takes the bias back off.  Not to be called concurrently with
+// itself.  See idle_release.hpp for calling it when the queue has been mostly empty for a while.
+//
+// A zero filled slot is an empty optional, which is only valid for T without a destructor to run.
+template <class T, class Traits>
+size_t queue<T, Traits>::release_idle_memory()
+{
+	static_assert(std::is_trivially_destructible<T>::value, "release_idle_memory requires a trivially destructible T");
+
+#if defined(__linux__)
+	// After the bias no push can be admitted.  Pushes admitted before it number at most pending, and reserve the slots from back_lead_ on, pops
+	// only touch slots pushed before those.  So from back_lead_ + pending up to a lap past front_trail_ nothing is touched until pushes resume.
+	queue_size_t capacity = static_cast<queue_size_t>(buffer_.size());
+	++release_epoch_;
+	queue_size_t pending = size_upper_bound_.fetch_add(capacity);
+	++release_epoch_;
+	size_t first = (back_lead_ & ~closed_mark) + static_cast<size_t>(std::max(pending, static_cast<queue_size_t>(0)));
+	size_t last = front_trail_ + buffer_.size();
+
+	size_t released = 0;
+	if (static_cast<std::ptrdiff_t>(last - first) > 0)
+	{
+		// The free run can wrap, one range either side of the end of buffer_.
+		size_t begin = bounded_index(first);
+		size_t end = begin + (last - first);
+		std::pair<size_t, size_t> ranges[] = { { begin, std::min(end, buffer_.size()) }, { 0, end > buffer_.size() ? end - buffer_.size() : 0 } };
+
+		uintptr_t page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+		for (auto const &range : ranges)
+		{
+			// Whole pages inside the range only, the slots either side may be in use.
+			uintptr_t page_begin = (reinterpret_cast<uintptr_t>(buffer_.data() + range.first) + page_size - 1) & ~(page_size - 1);
+			uintptr_t page_end = reinterpret_cast<uintptr_t>(buffer_.data() + range.second) & ~(page_size - 1);
+			if (range.first < range.second && page_begin < page_end && madvise(reinterpret_cast<void*>(page_begin), page_end - page_begin, MADV_DONTNEED) == 0)
+				released += page_end - page_begin;
+		}
+	}
+
+	++release_epoch_;
+	size_upper_bound_.fetch_sub(capacity);
+	++release_epoch_;
+	return released;
+#else
+	return 0;
+#endif
+}
+
+template <class T, class Traits>
+size_t queue<T, Traits>::bounded_index(size_t unbounded_index) const
 {
 	return unbounded_index % buffer_.size();
 }
 
-template<class T>
-inline void queue<T>::push_impl(T&& t)
+// Whether the queue is closed and pops have reserved every item pushed before that, only called by a pop that found none left.  A pop waiting on an
+// item another pop has been admitted to but not yet reserved sees the reservation on a later try.
+template <class T, class Traits>
+bool queue<T, Traits>::drained() const
+{
+	size_t index = close_index_;
+	return index != not_closed && front_lead_ == index;
+}
+
+template <class T, class Traits>
+inline bool queue<T, Traits>::push_impl(T&& t)
 {
-	// Reserve slot index for insertion.
-	size_t safe_index = bounded_index(back_lead_.fetch_add(1));
+	// Reserve slot index for insertion, an index reserved after close is never published (or waited on), give back the room and fail.
+	size_t unbounded_index = back_lead_.fetch_add(1);
+	if ((unbounded_index & closed_mark) != 0)
+	{
+		size_upper_bound_.fetch_sub(1);
+		return false;
+	}
+	size_t safe_index = bounded_index(unbounded_index);
 	assert(safe_index < buffer_.size());
 	auto &slot = buffer_[safe_index];
 
-	// Set the value.
-	slot = std::move(t);
+	// Warm a slot a later push will get, on a large buffer it would otherwise be a cache miss under the reservation.
+	if (Traits::prefetch_distance != 0)
+		detail::prefetch_for_write(&buffer_[bounded_index(unbounded_index + Traits::prefetch_distance)]);
+
+	// Set the value, streamed values have to be visible before the trailing edge publishes them.
+	if (streaming_stores)
+	{
+		slot.stream_assign(t);
+		detail::stream_fence();
+	}
+	else
+	{
+		put_slot(slot, t, relocate_items_tag());
+	}
 
 	// Wait on trailing edge, then inc it.
 	for (uint32_t wait_count = 0; bounded_index(back_trail_) != safe_index; ++ wait_count)
 	{
-		if ((wait_count % detail::concurrency) + 1 == detail::concurrency)
+		if ((wait_count % Traits::concurrency) + 1 == Traits::concurrency)
 			std::this_thread::yield(); // Deal with oversubscription...
 	}
 	back_trail_.fetch_add(1);
 
 	// Increment lower bound (no need to check size, it is dependant on that being established previously by check on size upper bound).
 	size_lower_bound_.fetch_add(1);
+	return true;
 }
 
-template<class T>
-inline T queue<T>::pop_impl()
+// take gets the value out of the reserved slot as a Result.
+template <class T, class Traits>
+template <class Result, class Take>
+inline Result queue<T, Traits>::pop_impl(Take take)
 {
 	// Reserve slot index for removal.
-	size_t safe_index = bounded_index(front_lead_.fetch_add(1));
+	size_t unbounded_index = front_lead_.fetch_add(1);
+	size_t safe_index = bounded_index(unbounded_index);
 	assert(safe_index < buffer_.size());
 	auto &slot = buffer_[safe_index];
 
+	if (Traits::prefetch_distance != 0)
+		detail::prefetch_for_read(&buffer_[bounded_index(unbounded_index + Traits::prefetch_distance)]);
+
 	// Get the value.
-	T t{ slot.release() };
+	Result r = take(slot);
 
 	// Wait on trailing edge, then inc it.
 	for (uint32_t wait_count = 0; bounded_index(front_trail_) != safe_index; ++wait_count)
 	{
-		if ((wait_count % detail::concurrency) + 1 == detail::concurrency)
+		if ((wait_count % Traits::concurrency) + 1 == Traits::concurrency)
 			std::this_thread::yield(); // Deal with oversubscription...
 	}
 	front_trail_.fetch_add(1);
@@ -385,6 +1156,146 @@ inline T queue<T>::pop_impl()
 	// Increment upper bound (no need to check size, it is dependant on that being established previously by check on size lower bound).
 	size_upper_bound_.fetch_sub(1);
 
+	return r;
+}
+
+template <class T, class Traits>
+template <class InputIt>
+inline bool queue<T, Traits>::push_batch_impl(InputIt first, size_t count)
+{
+	// Reserve a contiguous run of slot indices for insertion, all before the close or all after it.
+	size_t unbounded_index = back_lead_.fetch_add(count);
+	if ((unbounded_index & closed_mark) != 0)
+	{
+		size_upper_bound_.fetch_sub(static_cast<queue_size_t>(count));
+		return false;
+	}
+	size_t safe_index = bounded_index(unbounded_index);
+
+	// Set the values.
+	write_slots(unbounded_index, first, count, bulk_copy_tag<InputIt>());
+
+	// Wait on trailing edge, then move it past the whole run.
+	for (uint32_t wait_count = 0; bounded_index(back_trail_) != safe_index; ++wait_count)
+	{
+		if ((wait_count % Traits::concurrency) + 1 == Traits::concurrency)
+			std::this_thread::yield(); // Deal with oversubscription...
+	}
+	back_trail_.fetch_add(count);
+
+	size_lower_bound_.fetch_add(static_cast<queue_size_t>(count));
+	return true;
+}
+
+template <class T, class Traits>
+template <class OutputIt>
+inline void queue<T, Traits>::pop_batch_impl(OutputIt out, size_t count)
+{
+	// Reserve a contiguous run of slot indices for removal.
+	size_t unbounded_index = front_lead_.fetch_add(count);
+	size_t safe_index = bounded_index(unbounded_index);
+
+	// Get the values.
+	read_slots(unbounded_index, out, count, bulk_copy_tag<OutputIt>());
+
+	// Wait on trailing edge, then move it past the whole run.
+	for (uint32_t wait_count = 0; bounded_index(front_trail_) != safe_index; ++wait_count)
+	{
+		if ((wait_count % Traits::concurrency) + 1 == Traits::concurrency)
+			std::this_thread::yield(); // Deal with oversubscription...
+	}
+	front_trail_.fetch_add(count);
+
+	size_upper_bound_.fetch_sub(static_cast<queue_size_t>(count));
+}
+
+template <class T, class Traits>
+template <class InputIt>
+inline void queue<T, Traits>::write_slots(size_t unbounded_index, InputIt first, size_t count, std::false_type)
+{
+	for (size_t i = 0; i != count; ++i, ++first)
+	{
+		if (streaming_stores)
+			buffer_[bounded_index(unbounded_index + i)].stream_assign(*first);
+		else
+			buffer_[bounded_index(unbounded_index + i)] = std::move(*first);
+	}
+	if (streaming_stores)
+		detail::stream_fence();
+}
+
+// The run wraps at most once, so it is copied as the part up to the end of the buffer then the rest from the start.
+template <class T, class Traits>
+inline void queue<T, Traits>::write_slots(size_t unbounded_index, T const *first, size_t count, std::true_type)
+{
+	size_t index = bounded_index(unbounded_index);
+	size_t head = std::min(count, buffer_.size() - index);
+	detail::copy_items(&buffer_[index].get(), first, head);
+	if (head != count)
+		detail::copy_items(&buffer_[0].get(), first + head, count - head);
+}
+
+template <class T, class Traits>
+template <class OutputIt>
+inline void queue<T, Traits>::read_slots(size_t unbounded_index, OutputIt out, size_t count, std::false_type)
+{
+	// Into a T* a trivially relocatable T is relocated over the (destroyed) item already there.
+	typedef std::integral_constant<bool, is_trivially_relocatable<T>::value && std::is_same<OutputIt, T*>::value> relocate_tag;
+	for (size_t i = 0; i != count; ++i, ++out)
+	{
+		take_slot(buffer_[bounded_index(unbounded_index + i)], out, relocate_tag());
+	}
+}
+
+template <class T, class Traits>
+inline void queue<T, Traits>::read_slots(size_t unbounded_index, T *out, size_t count, std::true_type)
+{
+	size_t index = bounded_index(unbounded_index);
+	size_t head = std::min(count, buffer_.size() - index);
+	detail::copy_items(out, &buffer_[index].get(), head);
+	if (head != count)
+		detail::copy_items(out + head, &buffer_[0].get(), count - head);
+}
+
+template <class T, class Traits>
+template <class OutputIt>
+inline void queue<T, Traits>::take_slot(slot_t &slot, OutputIt out, std::false_type)
+{
+	*out = slot.release();
+}
+
+template <class T, class Traits>
+inline void queue<T, Traits>::take_slot(slot_t &slot, T *out, std::true_type)
+{
+	out->~T();
+	slot.relocate_to(out);
+}
+
+template <class T, class Traits>
+inline void queue<T, Traits>::put_slot(slot_t &slot, T &t, std::false_type)
+{
+	slot = std::move(t);
+}
+
+template <class T, class Traits>
+inline void queue<T, Traits>::put_slot(slot_t &slot, T &t, std::true_type)
+{
+	slot.relocate_assign(t);
+}
+
+template <class T, class Traits>
+inline T queue<T, Traits>::release_slot(slot_t &slot, std::false_type)
+{
+	return slot.release();
+}
+
+// Relocated over a default constructed T (which only gives the bytes a lifetime to end), returned in place so the item's bytes are copied once.
+template <class T, class Traits>
+inline T queue<T, Traits>::release_slot(slot_t &slot, std::true_type)
+{
+	T t;
+	t.~T();
+	slot.relocate_to(&t);
 	return t;
 }
 
@@ -0,0 +1,400 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_QUEUE_ADAPTER_HPP
+#define GUARUNTEED_MPMC_QUEUE_ADAPTER_HPP
+
+
+#include "adaptive_queue.hpp"
+#include "baseline_queues.hpp"
+#include "flat_combining_queue.hpp"
+#include "numa_queue.hpp"
+#include "packed_queue.hpp"
+#include "percpu_queue.hpp"
+#include "queue.hpp"
+#include "ticket_queue.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <utility>
+#include <boost/lockfree/queue.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+
+
+// Uniform access to a queue implementation for the benchmark scenarios, so each scenario is written once.  An adapter is a specialization of
+// queue_adapter<Queue> with only static members:
+//
+//   value_type                                     element type of the queue
+//   name()                                         short name without spaces, used in output and as the results file scenario prefix
+//   supports(producer count, consumer count)       false for thread counts the implementation isn't safe for (spsc)
+//   single_thread_capacity(q, capacity)            the most items one thread can push without a pop before push blocks, for a queue
+//                                                  constructed with capacity (less than capacity for queues split into per thread lanes)
+//   counts_rmw                                     true when the implementation counts its atomic RMWs under GUARUNTEED_MPMC_COUNT_RMW
+//   fifo                                           false when items from one producer can be popped out of order (percpu_queue, adaptive_queue,
+//                                                  numa_queue)
+//   push(q, value_type&&)                          blocks while full
+//   try_push(q, value_type&, attempts)             false when full
+//   pop(q)                                         blocks while empty
+//   try_pop(q, value_type&, attempts)              false when empty
+//   push_batch(q, value_type*, count)              blocks until all count items are pushed
+//   try_pop_batch(q, value_type*, max, attempts)   returns the number of items popped, up to max
+//
+// Queues constructed from a capacity.  Adding an implementation to the benchmarks is a specialization plus an entry in the harness's queue list.
+template <class Queue>
+struct queue_adapter;
+
+
+namespace detail
+{
+	// For implementations with queue's own interface, batches become loops of single operations.
+	template <class Queue>
+	struct native_queue_adapter
+	{
+		typedef typename Queue::value_type value_type;
+
+		static const bool counts_rmw = false;
+		static const bool fifo = true;
+
+		static bool supports(size_t, size_t)
+		{
+			return true;
+		}
+
+		static size_t single_thread_capacity(Queue const &, size_t capacity)
+		{
+			return capacity;
+		}
+
+		static void push(Queue &q, value_type &&v)
+		{
+			q.push(std::move(v));
+		}
+
+		static bool try_push(Queue &q, value_type &v, uint16_t attempts)
+		{
+			return q.try_push(v, attempts);
+		}
+
+		static value_type pop(Queue &q)
+		{
+			return q.pop();
+		}
+
+		static bool try_pop(Queue &q, value_type &v, uint16_t attempts)
+		{
+			typename Queue::optional_t ot = q.try_pop(attempts);
+			if (!ot)
+				return false;
+			v = ot.release();
+			return true;
+		}
+
+		static void push_batch(Queue &q, value_type *first, size_t count)
+		{
+			for (size_t i = 0; i != count; ++i)
+				q.push(std::move(first[i]));
+		}
+
+		static size_t try_pop_batch(Queue &q, value_type *out, size_t max_count, uint16_t attempts)
+		{
+			size_t count = 0;
+			while (count != max_count && try_pop(q, out[count], count == 0 ? attempts : 0))
+				++count;
+			return count;
+		}
+	};
+
+	// For boost::lockfree style queues, push(v)/pop(v) returning false when full/empty, blocking operations spin (and yield) on those.
+	template <class Queue>
+	struct lockfree_queue_adapter
+	{
+		typedef typename Queue::value_type value_type;
+
+		static const bool counts_rmw = false;
+		static const bool fifo = true;
+
+		static size_t single_thread_capacity(Queue const &, size_t capacity)
+		{
+			return capacity;
+		}
+
+		static void push(Queue &q, value_type &&v)
+		{
+			for (uint32_t wait_count = 0; !q.push(v); ++wait_count)
+			{
+				if ((wait_count % detail::concurrency) + 1 == detail::concurrency)
+					std::this_thread::yield();
+			}
+		}
+
+		static bool try_push(Queue &q, value_type &v, uint16_t attempts)
+		{
+			for (uint16_t attempt = 0; !q.push(v); ++attempt)
+			{
+				if (attempt == attempts)
+					return false;
+			}
+			return true;
+		}
+
+		static value_type pop(Queue &q)
+		{
+			value_type v;
+			for (uint32_t wait_count = 0; !q.pop(v); ++wait_count)
+			{
+				if ((wait_count % detail::concurrency) + 1 == detail::concurrency)
+					std::this_thread::yield();
+			}
+			return v;
+		}
+
+		static bool try_pop(Queue &q, value_type &v, uint16_t attempts)
+		{
+			for (uint16_t attempt = 0; !q.pop(v); ++attempt)
+			{
+				if (attempt == attempts)
+					return false;
+			}
+			return true;
+		}
+	};
+}
+
+
+template <class T, class Traits>
+struct queue_adapter<queue<T, Traits>> : detail::native_queue_adapter<queue<T, Traits>>
+{
+	static const bool counts_rmw = true;
+
+	static char const* name()
+	{
+		return "queue";
+	}
+
+	static void push_batch(queue<T, Traits> &q, T *first, size_t count)
+	{
+		// Batches larger than the queue go in capacity sized pieces.
+		for (size_t offset = 0; offset != count; )
+		{
+			size_t n = std::min(count - offset, q.capacity());
+			q.push_batch(first + offset, n);
+			offset += n;
+		}
+	}
+
+	static size_t try_pop_batch(queue<T, Traits> &q, T *out, size_t max_count, uint16_t attempts)
+	{
+		return q.try_pop_batch(out, max_count, attempts);
+	}
+};
+
+template <class T, class Traits>
+struct queue_adapter<ticket_queue<T, Traits>> : detail::native_queue_adapter<ticket_queue<T, Traits>>
+{
+	static const bool counts_rmw = true;
+
+	static char const* name()
+	{
+		return "ticket_queue";
+	}
+
+	static void push_batch(ticket_queue<T, Traits> &q, T *first, size_t count)
+	{
+		for (size_t offset = 0; offset != count; )
+		{
+			size_t n = std::min(count - offset, q.capacity());
+			q.push_batch(first + offset, n);
+			offset += n;
+		}
+	}
+
+	static size_t try_pop_batch(ticket_queue<T, Traits> &q, T *out, size_t max_count, uint16_t attempts)
+	{
+		return q.try_pop_batch(out, max_count, attempts);
+	}
+};
+
+template <class T, class Traits, class Index>
+struct queue_adapter<packed_queue<T, Traits, Index>> : detail::native_queue_adapter<packed_queue<T, Traits, Index>>
+{
+	static const bool counts_rmw = true;
+
+	static char const* name()
+	{
+		return "packed_queue";
+	}
+
+	static void push_batch(packed_queue<T, Traits, Index> &q, T *first, size_t count)
+	{
+		for (size_t offset = 0; offset != count; )
+		{
+			size_t n = std::min(count - offset, q.capacity());
+			q.push_batch(first + offset, n);
+			offset += n;
+		}
+	}
+
+	static size_t try_pop_batch(packed_queue<T, Traits, Index> &q, T *out, size_t max_count, uint16_t attempts)
+	{
+		return q.try_pop_batch(out, max_count, attempts);
+	}
+};
+
+template <class T, class Traits>
+struct queue_adapter<percpu_queue<T, Traits>> : detail::native_queue_adapter<percpu_queue<T, Traits>>
+{
+	static const bool counts_rmw = true;
+	static const bool fifo = false;
+
+	static char const* name()
+	{
+		return "percpu_queue";
+	}
+
+	static size_t single_thread_capacity(percpu_queue<T, Traits> const &q, size_t capacity)
+	{
+		return std::min(capacity, q.lane_capacity());
+	}
+
+	static size_t try_pop_batch(percpu_queue<T, Traits> &q, T *out, size_t max_count, uint16_t attempts)
+	{
+		return q.try_pop_batch(out, max_count, attempts);
+	}
+};
+
+template <class T, class Traits>
+struct queue_adapter<adaptive_queue<T, Traits>> : detail::native_queue_adapter<adaptive_queue<T, Traits>>
+{
+	static const bool counts_rmw = true;
+	static const bool fifo = false;
+
+	static char const* name()
+	{
+		return "adaptive_queue";
+	}
+
+	static size_t single_thread_capacity(adaptive_queue<T, Traits> const &q, size_t capacity)
+	{
+		return std::min(capacity, q.lane_capacity());
+	}
+};
+
+template <class T, class Traits>
+struct queue_adapter<numa_queue<T, Traits>> : detail::native_queue_adapter<numa_queue<T, Traits>>
+{
+	static const bool counts_rmw = true;
+	static const bool fifo = false;
+
+	static char const* name()
+	{
+		return "numa_queue";
+	}
+
+	static size_t single_thread_capacity(numa_queue<T, Traits> const &q, size_t capacity)
+	{
+		return std::min(capacity, q.node_capacity());
+	}
+};
+
+template <class T, class Traits>
+struct queue_adapter<flat_combining_queue<T, Traits>> : detail::native_queue_adapter<flat_combining_queue<T, Traits>>
+{
+	static char const* name()
+	{
+		return "flat_combining_queue";
+	}
+};
+
+template <class T>
+struct queue_adapter<locked_queue<T>> : detail::native_queue_adapter<locked_queue<T>>
+{
+	static char const* name()
+	{
+		return "mutex_deque";
+	}
+};
+
+template <class T>
+struct queue_adapter<blocking_queue<T>> : detail::native_queue_adapter<blocking_queue<T>>
+{
+	static char const* name()
+	{
+		return "mutex_condvar";
+	}
+};
+
+template <class T, class... Options>
+struct queue_adapter<boost::lockfree::queue<T, Options...>> : detail::lockfree_queue_adapter<boost::lockfree::queue<T, Options...>>
+{
+	typedef boost::lockfree::queue<T, Options...> queue_type;
+	typedef detail::lockfree_queue_adapter<queue_type> base;
+
+	static char const* name()
+	{
+		return "boost_queue";
+	}
+
+	static bool supports(size_t, size_t)
+	{
+		return true;
+	}
+
+	static void push_batch(queue_type &q, T *first, size_t count)
+	{
+		for (size_t i = 0; i != count; ++i)
+			base::push(q, std::move(first[i]));
+	}
+
+	static size_t try_pop_batch(queue_type &q, T *out, size_t max_count, uint16_t attempts)
+	{
+		size_t count = 0;
+		while (count != max_count && base::try_pop(q, out[count], count == 0 ? attempts : 0))
+			++count;
+		return count;
+	}
+};
+
+// spsc_queue has native batch operations, but only one producer and one consumer.
+template <class T, class... Options>
+struct queue_adapter<boost::lockfree::spsc_queue<T, Options...>> : detail::lockfree_queue_adapter<boost::lockfree::spsc_queue<T, Options...>>
+{
+	typedef boost::lockfree::spsc_queue<T, Options...> queue_type;
+
+	static char const* name()
+	{
+		return "boost_spsc";
+	}
+
+	static bool supports(size_t producer_count, size_t consumer_count)
+	{
+		return producer_count == 1 && consumer_count == 1;
+	}
+
+	static void push_batch(queue_type &q, T *first, size_t count)
+	{
+		for (uint32_t wait_count = 0; count != 0; ++wait_count)
+		{
+			size_t n = q.push(first, count);
+			first += n;
+			count -= n;
+			if (n == 0 && (wait_count % detail::concurrency) + 1 == detail::concurrency)
+				std::this_thread::yield();
+		}
+	}
+
+	static size_t try_pop_batch(queue_type &q, T *out, size_t max_count, uint16_t attempts)
+	{
+		for (uint16_t attempt = 0; ; ++attempt)
+		{
+			size_t n = q.pop(out, max_count);
+			if (n != 0 || attempt == attempts || max_count == 0)
+				return n;
+		}
+	}
+};
+
+#endif // GUARUNTEED_MPMC_QUEUE_ADAPTER_HPP
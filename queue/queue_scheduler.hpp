@@ -0,0 +1,347 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_QUEUE_SCHEDULER_HPP
+#define GUARUNTEED_MPMC_QUEUE_SCHEDULER_HPP
+
+
+#include "queue.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+// Sender/receiver (P2300 style) scheduling onto threads fed by a queue.  There is no std::execution to plug into yet, so the customization points are
+// plain member functions: a sender has connect(receiver), an operation state has start(), and a receiver has set_value(), set_error(std::exception_ptr)
+// and set_stopped().  Operation states may be moved before start() but not after, they are what the queue points to, which is why scheduling doesn't
+// allocate.
+
+namespace detail
+{
+	// Intrusive unit of work, embedded in an operation state.
+	struct queue_task
+	{
+		void (*execute)(queue_task*);
+	};
+
+	// Bulk work is split into at most this many chunks, they live inside the bulk operation state.
+	static const size_t max_bulk_chunks = 64;
+}
+
+
+class queue_scheduler;
+
+
+// Owns the worker threads and the queue of tasks feeding them.  Work scheduled before destruction is run before the workers exit.
+class queue_context
+{
+public:
+	queue_context(size_t, size_t = 1024);
+	~queue_context();
+
+	queue_context(queue_context const&) = delete;
+	queue_context& operator=(queue_context const&) = delete;
+
+	queue_scheduler get_scheduler();
+	size_t worker_count() const;
+
+	void enqueue(detail::queue_task*);
+	void enqueue_batch(detail::queue_task**, size_t);
+
+private:
+	void run();
+
+	queue<detail::queue_task*> queue_;
+	std::vector<std::thread> workers_;
+};
+
+
+class queue_scheduler
+{
+public:
+	template <class Receiver>
+	class schedule_operation : private detail::queue_task
+	{
+	public:
+		schedule_operation(queue_context *context, Receiver r) : context_(context), receiver_(std::move(r))
+		{
+			execute = &schedule_operation::run;
+		}
+
+		schedule_operation(schedule_operation&&) = default;
+
+		void start()
+		{
+			context_->enqueue(this);
+		}
+
+	private:
+		static void run(detail::queue_task *t)
+		{
+			schedule_operation *op = static_cast<schedule_operation*>(t);
+			try
+			{
+				op->receiver_.set_value();
+			}
+			catch (...)
+			{
+				op->receiver_.set_error(std::current_exception());
+			}
+		}
+
+		queue_context *context_;
+		Receiver receiver_;
+	};
+
+	// Completes with set_value() on one of the context's worker threads.
+	class schedule_sender
+	{
+	public:
+		explicit schedule_sender(queue_context *context) : context_(context) {}
+
+		template <class Receiver>
+		schedule_operation<Receiver> connect(Receiver r) const
+		{
+			return schedule_operation<Receiver>(context_, std::move(r));
+		}
+
+	private:
+		queue_context *context_;
+	};
+
+	template <class Receiver, class F>
+	class bulk_operation
+	{
+	public:
+		bulk_operation(queue_context *context, size_t shape, F fn, Receiver r) : context_(context), shape_(shape), fn_(std::move(fn)), receiver_(std::move(r)), remaining_(0), failed_(false) {}
+
+		bulk_operation(bulk_operation &&o) : context_(o.context_), shape_(o.shape_), fn_(std::move(o.fn_)), receiver_(std::move(o.receiver_)), remaining_(0), failed_(false) {}
+
+		// Splits [0, shape) into one chunk per worker (at most max_bulk_chunks) and pushes them all with one batch push.
+		void start()
+		{
+			if (shape_ == 0)
+			{
+				receiver_.set_value();
+				return;
+			}
+
+			size_t count = std::min(std::min(shape_, context_->worker_count()), detail::max_bulk_chunks);
+			detail::queue_task *tasks[detail::max_bulk_chunks];
+			remaining_ = count;
+			for (size_t i = 0; i != count; ++i)
+			{
+				chunks_[i].execute = &bulk_operation::run;
+				chunks_[i].owner = this;
+				chunks_[i].begin = shape_ * i / count;
+				chunks_[i].end = shape_ * (i + 1) / count;
+				tasks[i] = &chunks_[i];
+			}
+			context_->enqueue_batch(tasks, count);
+		}
+
+	private:
+		struct chunk : detail::queue_task
+		{
+			bulk_operation *owner;
+			size_t begin;
+			size_t end;
+		};
+
+		static void run(detail::queue_task *t)
+		{
+			chunk *c = static_cast<chunk*>(t);
+			bulk_operation *op = c->owner;
+			try
+			{
+				for (size_t i = c->begin; i != c->end && !op->failed_; ++i)
+					op->fn_(i);
+			}
+			catch (...)
+			{
+				bool expected = false;
+				if (op->failed_.compare_exchange_strong(expected, true))
+					op->error_ = std::current_exception();
+			}
+
+			// The last chunk to finish completes the operation.
+			if (op->remaining_.fetch_sub(1) == 1)
+			{
+				if (op->failed_)
+					op->receiver_.set_error(op->error_);
+				else
+					op->receiver_.set_value();
+			}
+		}
+
+		queue_context *context_;
+		size_t shape_;
+		F fn_;
+		Receiver receiver_;
+		chunk chunks_[detail::max_bulk_chunks];
+		std::atomic_size_t remaining_;
+		std::atomic_bool failed_;
+		std::exception_ptr error_;
+	};
+
+	// Calls fn(i) for every i in [0, shape) on the context's workers, then completes with set_value() on the worker that finished last.
+	template <class F>
+	class bulk_sender
+	{
+	public:
+		bulk_sender(queue_context *context, size_t shape, F fn) : context_(context), shape_(shape), fn_(std::move(fn)) {}
+
+		template <class Receiver>
+		bulk_operation<Receiver, F> connect(Receiver r) const
+		{
+			return bulk_operation<Receiver, F>(context_, shape_, fn_, std::move(r));
+		}
+
+	private:
+		queue_context *context_;
+		size_t shape_;
+		F fn_;
+	};
+
+	explicit queue_scheduler(queue_context *context) : context_(context) {}
+
+	schedule_sender schedule() const
+	{
+		return schedule_sender(context_);
+	}
+
+	template <class F>
+	bulk_sender<F> bulk(size_t shape, F fn) const
+	{
+		return bulk_sender<F>(context_, shape, std::move(fn));
+	}
+
+	bool operator==(queue_scheduler const &other) const
+	{
+		return context_ == other.context_;
+	}
+
+	bool operator!=(queue_scheduler const &other) const
+	{
+		return context_ != other.context_;
+	}
+
+private:
+	queue_context *context_;
+};
+
+
+namespace detail
+{
+	struct sync_wait_state
+	{
+		std::atomic_bool done{ false };
+		std::exception_ptr error;
+	};
+
+	struct sync_wait_receiver
+	{
+		sync_wait_state *state;
+
+		void set_value()
+		{
+			state->done = true;
+		}
+
+		void set_error(std::exception_ptr e)
+		{
+			state->error = e;
+			state->done = true;
+		}
+
+		void set_stopped()
+		{
+			state->done = true;
+		}
+	};
+}
+
+
+// Starts the sender and blocks the calling thread until it completes, rethrowing its error if it completed with one.
+template <class Sender>
+void sync_wait(Sender const &sender)
+{
+	detail::sync_wait_state state;
+	auto op = sender.connect(detail::sync_wait_receiver{ &state });
+	op.start();
+
+	for (uint32_t wait_count = 0; !state.done; ++wait_count)
+	{
+		if ((wait_count % detail::concurrency) + 1 == detail::concurrency)
+			std::this_thread::yield();
+	}
+
+	if (state.error)
+		std::rethrow_exception(state.error);
+}
+
+
+inline queue_context::queue_context(size_t worker_count, size_t capacity) : queue_(capacity)
+{
+	if (worker_count == 0)
+		throw std::invalid_argument("specified worker count is zero - context must have at least one worker");
+
+	for (size_t i = 0; i != worker_count; ++i)
+		workers_.emplace_back(&queue_context::run, this);
+}
+
+// A null task tells a worker to exit, one per worker after everything already queued.
+inline queue_context::~queue_context()
+{
+	for (size_t i = 0; i != workers_.size(); ++i)
+		enqueue(nullptr);
+	for (auto &w : workers_)
+		w.join();
+}
+
+inline queue_scheduler queue_context::get_scheduler()
+{
+	return queue_scheduler(this);
+}
+
+inline size_t queue_context::worker_count() const
+{
+	return workers_.size();
+}
+
+inline void queue_context::enqueue(detail::queue_task *t)
+{
+	queue_.push(std::move(t));
+}
+
+inline void queue_context::enqueue_batch(detail::queue_task **tasks, size_t count)
+{
+	// Batches larger than the queue go in capacity sized pieces.
+	for (size_t offset = 0; offset != count; )
+	{
+		size_t n = std::min(count - offset, queue_.capacity());
+		queue_.push_batch(tasks + offset, n);
+		offset += n;
+	}
+}
+
+inline void queue_context::run()
+{
+	for (;;)
+	{
+		detail::queue_task *t = queue_.pop();
+		if (t == nullptr)
+			return;
+		t->execute(t);
+	}
+}
+
+#endif // GUARUNTEED_MPMC_QUEUE_SCHEDULER_HPP
@@ -0,0 +1,269 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_TASK_GRAPH_HPP
+#define GUARUNTEED_MPMC_TASK_GRAPH_HPP
+
+
+#include "queue.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+
+// A DAG of tasks, tasks run once all the tasks they depend on have completed.
+class task_graph
+{
+public:
+	typedef size_t task_id;
+
+	// Cost is only used to find the critical path, it is in whatever unit the caller likes as long as it is consistent.
+	task_id add_task(std::function<void()>, double = 1.0);
+	void add_dependency(task_id, task_id);
+
+	size_t size() const;
+
+private:
+	friend class task_graph_executor;
+
+	struct node
+	{
+		std::function<void()> fn;
+		double cost;
+		std::vector<task_id> successors;
+		uint32_t predecessors;
+	};
+
+	std::vector<node> nodes_;
+};
+
+
+enum class task_scheduling
+{
+	fifo,           // Ready tasks run in the order they became ready.
+	critical_path   // Ready tasks on the longest remaining (cost weighted) path to an exit run first.
+};
+
+
+// Runs a task_graph on a set of worker threads.  Each task has an atomic count of unfinished dependencies, the worker that completes the last
+// dependency of a task pushes it onto a ready queue, there are no waves or barriers.  Critical path scheduling splits the ready queue into
+// priority levels by the length of the path from each task to the end of the graph, workers drain higher levels first.
+class task_graph_executor
+{
+public:
+	task_graph_executor(size_t, task_scheduling = task_scheduling::fifo, size_t = 4);
+
+	void run(task_graph const&);
+
+private:
+	typedef task_graph::task_id task_id;
+
+	std::vector<size_t> priority_levels(task_graph const&) const;
+	void worker(task_graph const&, std::vector<size_t> const&);
+	bool try_pop(task_id&);
+
+	size_t worker_count_;
+	task_scheduling scheduling_;
+	size_t level_count_;
+
+	// Per run state.
+	std::vector<detail::aligned_ptr<queue<task_id>>> ready_;
+	std::unique_ptr<std::atomic<uint32_t>[]> pending_dependencies_;
+	alignas(detail::cache_line_size) std::atomic_size_t remaining_;
+	alignas(detail::cache_line_size) std::atomic_bool failed_;
+	std::exception_ptr error_;
+};
+
+
+inline task_graph::task_id task_graph::add_task(std::function<void()> fn, double cost)
+{
+	node n;
+	n.fn = std::move(fn);
+	n.cost = cost;
+	n.predecessors = 0;
+	nodes_.push_back(std::move(n));
+	return nodes_.size() - 1;
+}
+
+// Task after won't start before task before has completed.
+inline void task_graph::add_dependency(task_id before, task_id after)
+{
+	if (before >= nodes_.size() || after >= nodes_.size())
+		throw std::out_of_range("task id is not part of the graph");
+	else if (before == after)
+		throw std::invalid_argument("a task can not depend on itself");
+
+	nodes_[before].successors.push_back(after);
+	++nodes_[after].predecessors;
+}
+
+inline size_t task_graph::size() const
+{
+	return nodes_.size();
+}
+
+
+inline task_graph_executor::task_graph_executor(size_t worker_count, task_scheduling scheduling, size_t level_count)
+	: worker_count_(worker_count), scheduling_(scheduling), level_count_(scheduling == task_scheduling::fifo ? 1 : level_count), remaining_(0), failed_(false)
+{
+	if (worker_count_ == 0)
+		throw std::invalid_argument("specified worker count is zero - executor must have at least one worker");
+	else if (level_count_ == 0)
+		throw std::invalid_argument("specified priority level count is zero - executor must have at least one ready queue");
+}
+
+// Blocks until every task has run, rethrows the first exception thrown by a task (no further tasks are started once a task has thrown).
+inline void task_graph_executor::run(task_graph const &graph)
+{
+	size_t count = graph.size();
+	if (count == 0)
+		return;
+
+	std::vector<size_t> levels = priority_levels(graph);
+
+	// Every task is pushed exactly once, so ready queues that can hold the whole graph never block a push.
+	ready_.clear();
+	for (size_t i = 0; i != level_count_; ++i)
+		ready_.emplace_back(detail::make_aligned<queue<task_id>>(count));
+
+	pending_dependencies_.reset(new std::atomic<uint32_t>[count]);
+	for (size_t i = 0; i != count; ++i)
+	{
+		pending_dependencies_[i].store(graph.nodes_[i].predecessors, std::memory_order_relaxed);
+		if (graph.nodes_[i].predecessors == 0)
+		{
+			task_id id = i;
+			ready_[levels[i]]->push(std::move(id));
+		}
+	}
+
+	remaining_ = count;
+	failed_ = false;
+	error_ = nullptr;
+
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i != worker_count_; ++i)
+		workers.emplace_back(&task_graph_executor::worker, this, std::cref(graph), std::cref(levels));
+	for (auto &w : workers)
+		w.join();
+
+	if (error_)
+		std::rethrow_exception(error_);
+}
+
+// Assigns each task its ready queue, 0 is drained first.  Also rejects graphs with cycles, which would never complete.
+inline std::vector<size_t> task_graph_executor::priority_levels(task_graph const &graph) const
+{
+	size_t count = graph.size();
+
+	// Kahn's algorithm for a topological order.
+	std::vector<task_id> order;
+	order.reserve(count);
+	std::vector<uint32_t> predecessors(count);
+	for (size_t i = 0; i != count; ++i)
+	{
+		predecessors[i] = graph.nodes_[i].predecessors;
+		if (predecessors[i] == 0)
+			order.push_back(i);
+	}
+	for (size_t i = 0; i != order.size(); ++i)
+	{
+		for (task_id s : graph.nodes_[order[i]].successors)
+		{
+			if (--predecessors[s] == 0)
+				order.push_back(s);
+		}
+	}
+	if (order.size() != count)
+		throw std::invalid_argument("task graph contains a cycle");
+
+	std::vector<size_t> levels(count, 0);
+	if (scheduling_ == task_scheduling::fifo)
+		return levels;
+
+	// The rank of a task is the cost of the longest path from the task to an exit of the graph, including the task itself.
+	std::vector<double> rank(count, 0.0);
+	double max_rank = 0.0;
+	for (size_t i = count; i != 0; --i)
+	{
+		task_id t = order[i - 1];
+		double longest = 0.0;
+		for (task_id s : graph.nodes_[t].successors)
+			longest = std::max(longest, rank[s]);
+		rank[t] = graph.nodes_[t].cost + longest;
+		max_rank = std::max(max_rank, rank[t]);
+	}
+
+	if (max_rank <= 0.0)
+		return levels;
+
+	for (size_t i = 0; i != count; ++i)
+	{
+		size_t level = static_cast<size_t>((1.0 - rank[i] / max_rank) * static_cast<double>(level_count_));
+		levels[i] = std::min(level, level_count_ - 1);
+	}
+	return levels;
+}
+
+inline void task_graph_executor::worker(task_graph const &graph, std::vector<size_t> const &levels)
+{
+	for (uint32_t idle_count = 0; remaining_ != 0 && !failed_; )
+	{
+		task_id t;
+		if (!try_pop(t))
+		{
+			if ((++idle_count % detail::concurrency) == 0)
+				std::this_thread::yield();
+			continue;
+		}
+		idle_count = 0;
+
+		try
+		{
+			graph.nodes_[t].fn();
+		}
+		catch (...)
+		{
+			bool expected = false;
+			if (failed_.compare_exchange_strong(expected, true))
+				error_ = std::current_exception();
+			return;
+		}
+
+		for (task_id s : graph.nodes_[t].successors)
+		{
+			if (pending_dependencies_[s].fetch_sub(1) == 1)
+			{
+				task_id ready = s;
+				ready_[levels[s]]->push(std::move(ready));
+			}
+		}
+		remaining_.fetch_sub(1);
+	}
+}
+
+inline bool task_graph_executor::try_pop(task_id &t)
+{
+	for (auto &ready : ready_)
+	{
+		queue<task_id>::optional_t ot = ready->try_pop(0);
+		if (ot)
+		{
+			t = *ot;
+			return true;
+		}
+	}
+	return false;
+}
+
+#endif // GUARUNTEED_MPMC_TASK_GRAPH_HPP
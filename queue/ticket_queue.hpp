@@ -0,0 +1,311 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_TICKET_QUEUE_HPP
+#define GUARUNTEED_MPMC_TICKET_QUEUE_HPP
+
+
+#include "queue.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+
+// Bounded MPMC queue with the same interface and guarantees as queue, but one atomic read-modify-write per operation instead of four.  Rather than
+// separate size bounds and trailing edges, each slot carries a sequence that says which ticket it is waiting for: the push ticket t while it is
+// empty and t + 1 once that push has filled it, and after the pop the slot moves on to the push ticket t + capacity.
+//
+// A push takes a ticket from back_ (the one RMW), waits for its slot's sequence to come round to the ticket, writes the value and publishes it
+// with a plain release store of the sequence.  A pop mirrors that on front_.  Fullness and emptiness fall out of the sequences: a ticket whose
+// slot is still a lap behind is a push into a full queue (or a pop from an empty one) and waits the way an admission does in queue.  Sequences
+// are only compared for equality and step with the tickets, so both wrap around the range of size_t together.  Items are still handed
+// over in ticket order, so FIFO order per producer holds, and an admitted operation never fails.  Unlike queue an operation only ever waits on
+// the one slot it holds a ticket for, not on the trailing edge of everyone admitted before it.
+//
+// The try operations only take a ticket (with a compare exchange) once the slot is seen ready, so a failed try takes no RMW at all.
+template <class T, class Traits = detail::queue_traits<>>
+class ticket_queue
+{
+public:
+
+	typedef T value_type;
+	typedef detail::optional<T> optional_t;
+
+	ticket_queue(size_t);
+
+	void push(T&&);
+	bool try_push(T&, uint16_t);
+	T pop();
+	optional_t try_pop(uint16_t);
+
+	template <class InputIt>
+	void push_batch(InputIt, size_t);
+	template <class OutputIt>
+	size_t try_pop_batch(OutputIt, size_t, uint16_t);
+
+	size_t size() const;
+	size_t empty() const;
+	size_t capacity() const;
+
+private:
+	typedef detail::rmw_atomic<size_t> atomic_ticket_t;
+
+	struct slot
+	{
+		std::atomic<size_t> sequence{ 0 };
+		optional_t value;
+	};
+
+	static size_t checked_capacity(size_t);
+
+	size_t bounded_index(size_t) const;
+	void wait_for_sequence(slot const&, size_t) const;
+
+	// Next ticket for a push, every push up to (not including) it has been admitted.
+	alignas(Traits::cache_line_size) atomic_ticket_t back_;
+
+	// Next ticket for a pop.
+	alignas(Traits::cache_line_size) atomic_ticket_t front_;
+
+	// A buffer sized for holding elements of queue, with each element's sequence.
+	alignas(Traits::cache_line_size) std::vector<slot> slots_;
+};
+
+
+template <class T, class Traits>
+ticket_queue<T, Traits>::ticket_queue(size_t capacity) : back_(0), front_(0), slots_(checked_capacity(capacity))
+{
+	for (size_t i = 0; i != slots_.size(); ++i)
+		slots_[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+// The same rounding and limits as queue, a ticket's slot depends on the capacity dividing evenly into the range of size_t.
+template <class T, class Traits>
+size_t ticket_queue<T, Traits>::checked_capacity(size_t capacity)
+{
+	capacity = detail::queue_size<size_t>::round_up_to_power_of_2(capacity);
+	if (capacity > detail::queue_size<size_t>::max_capacity)
+		throw std::invalid_argument("specified capacity is larger than max allowable capacity of queue");
+	else if (capacity == 0)
+		throw std::invalid_argument("specified capacity is zero - queue must have non zero capacity");
+	return capacity;
+}
+
+template <class T, class Traits>
+void ticket_queue<T, Traits>::push(T&& t)
+{
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	size_t ticket = back_.fetch_add(1);
+	GUARUNTEED_MPMC_TRACE_END(push, 1);
+
+	slot &s = slots_[bounded_index(ticket)];
+	wait_for_sequence(s, ticket);
+	s.value = std::move(t);
+	s.sequence.store(ticket + 1, std::memory_order_release);
+}
+
+template <class T, class Traits>
+bool ticket_queue<T, Traits>::try_push(T &t, uint16_t attempts)
+{
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	// Only failures that saw the queue full count as attempts, losing the ticket to another push means the queue moved on.
+	uint16_t attempt = 0;
+	size_t ticket = back_.load(std::memory_order_acquire);
+	for (;;)
+	{
+		slot &s = slots_[bounded_index(ticket)];
+		if (s.sequence.load(std::memory_order_acquire) == ticket)
+		{
+			if (back_.compare_exchange_weak(ticket, ticket + 1))
+			{
+				GUARUNTEED_MPMC_TRACE_END(push, 1);
+				s.value = std::move(t);
+				s.sequence.store(ticket + 1, std::memory_order_release);
+				return true;
+			}
+		}
+		else
+		{
+			size_t previous = ticket;
+			ticket = back_.load(std::memory_order_acquire);
+			if (ticket == previous)
+			{
+				if (attempt == attempts)
+					return false;
+				++attempt;
+			}
+		}
+	}
+}
+
+template <class T, class Traits>
+T ticket_queue<T, Traits>::pop()
+{
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	size_t ticket = front_.fetch_add(1);
+	GUARUNTEED_MPMC_TRACE_END(pop, 1);
+
+	slot &s = slots_[bounded_index(ticket)];
+	wait_for_sequence(s, ticket + 1);
+	T t{ s.value.release() };
+	s.sequence.store(ticket + slots_.size(), std::memory_order_release);
+	return t;
+}
+
+template <class T, class Traits>
+typename ticket_queue<T, Traits>::optional_t ticket_queue<T, Traits>::try_pop(uint16_t attempts)
+{
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	uint16_t attempt = 0;
+	size_t ticket = front_.load(std::memory_order_acquire);
+	for (;;)
+	{
+		slot &s = slots_[bounded_index(ticket)];
+		if (s.sequence.load(std::memory_order_acquire) == ticket + 1)
+		{
+			if (front_.compare_exchange_weak(ticket, ticket + 1))
+			{
+				GUARUNTEED_MPMC_TRACE_END(pop, 1);
+				optional_t ot(s.value.release());
+				s.sequence.store(ticket + slots_.size(), std::memory_order_release);
+				return ot;
+			}
+		}
+		else
+		{
+			size_t previous = ticket;
+			ticket = front_.load(std::memory_order_acquire);
+			if (ticket == previous)
+			{
+				if (attempt == attempts)
+					return optional_t();
+				++attempt;
+			}
+		}
+	}
+}
+
+// Pushes count items as one contiguous run of tickets taken with a single RMW, each item then waits only for its own slot.  As with queue the
+// batch may not be larger than the capacity.
+template <class T, class Traits>
+template <class InputIt>
+void ticket_queue<T, Traits>::push_batch(InputIt first, size_t count)
+{
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	if (count > slots_.size())
+		throw std::invalid_argument("specified batch is larger than the capacity of queue");
+	else if (count == 0)
+		return;
+
+	size_t ticket = back_.fetch_add(count);
+	GUARUNTEED_MPMC_TRACE_END(push, count);
+
+	for (size_t i = 0; i != count; ++i, ++first)
+	{
+		slot &s = slots_[bounded_index(ticket + i)];
+		wait_for_sequence(s, ticket + i);
+		s.value = std::move(*first);
+		s.sequence.store(ticket + i + 1, std::memory_order_release);
+	}
+}
+
+// Pops up to max_count items, the run of consecutive filled slots at the front taken with one compare exchange, returns the number of items
+// written to out.
+template <class T, class Traits>
+template <class OutputIt>
+size_t ticket_queue<T, Traits>::try_pop_batch(OutputIt out, size_t max_count, uint16_t attempts)
+{
+	GUARUNTEED_MPMC_TRACE_BEGIN;
+
+	max_count = std::min(max_count, slots_.size());
+	uint16_t attempt = 0;
+	size_t count = 0;
+	size_t ticket = front_.load(std::memory_order_acquire);
+	for (;;)
+	{
+		count = 0;
+		while (count != max_count && slots_[bounded_index(ticket + count)].sequence.load(std::memory_order_acquire) == ticket + count + 1)
+			++count;
+
+		if (count != 0)
+		{
+			if (front_.compare_exchange_weak(ticket, ticket + count))
+				break;
+		}
+		else
+		{
+			size_t previous = ticket;
+			ticket = front_.load(std::memory_order_acquire);
+			if (ticket == previous)
+			{
+				if (attempt == attempts || max_count == 0)
+					return 0;
+				++attempt;
+			}
+		}
+	}
+
+	GUARUNTEED_MPMC_TRACE_END(pop, count);
+	for (size_t i = 0; i != count; ++i, ++out)
+	{
+		slot &s = slots_[bounded_index(ticket + i)];
+		*out = s.value.release();
+		s.sequence.store(ticket + i + slots_.size(), std::memory_order_release);
+	}
+	return count;
+}
+
+// Pushes admitted less pops admitted, so like queue::size it includes pushes still writing (and is 0 while pops are waiting).
+template <class T, class Traits>
+size_t ticket_queue<T, Traits>::size() const
+{
+	size_t front = front_.load(std::memory_order_acquire);
+	size_t back = back_.load(std::memory_order_acquire);
+	std::ptrdiff_t difference = static_cast<std::ptrdiff_t>(back - front);
+	return difference > 0 ? static_cast<size_t>(difference) : 0;
+}
+
+template <class T, class Traits>
+size_t ticket_queue<T, Traits>::empty() const
+{
+	size_t front = front_.load(std::memory_order_acquire);
+	return slots_[bounded_index(front)].sequence.load(std::memory_order_acquire) != front + 1;
+}
+
+template <class T, class Traits>
+size_t ticket_queue<T, Traits>::capacity() const
+{
+	return slots_.size();
+}
+
+template <class T, class Traits>
+size_t ticket_queue<T, Traits>::bounded_index(size_t ticket) const
+{
+	return ticket % slots_.size();
+}
+
+template <class T, class Traits>
+inline void ticket_queue<T, Traits>::wait_for_sequence(slot const &s, size_t sequence) const
+{
+	for (uint32_t wait_count = 0; s.sequence.load(std::memory_order_acquire) != sequence; ++wait_count)
+	{
+		if ((wait_count % Traits::concurrency) + 1 == Traits::concurrency)
+			std::this_thread::yield(); // Deal with oversubscription...
+	}
+}
+
+#endif // GUARUNTEED_MPMC_TICKET_QUEUE_HPP
@@ -0,0 +1,362 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_TRACE_HPP
+#define GUARUNTEED_MPMC_TRACE_HPP
+
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+
+// Capture of push/pop arrival times per thread, and replay of a captured trace against a queue.  Capture is compiled into queue.hpp only when
+// GUARUNTEED_MPMC_TRACE is defined, and then only records between trace_start() and trace_stop().  Each thread appends to its own fixed size
+// buffer, events that don't fit are counted rather than recorded, so recording never allocates or locks after a thread's first event.
+
+enum class trace_op : uint8_t
+{
+	push,
+	pop
+};
+
+// Time is nanoseconds since trace_start(), taken when the operation was called (not when it was admitted, a push blocked on a full queue
+// records when the item arrived).  Count is the number of items, more than one for batch operations.
+struct trace_event
+{
+	uint64_t time;
+	uint32_t count;
+	trace_op op;
+};
+
+// A loaded trace, one list of events per recording thread in the order that thread made them.
+struct queue_trace
+{
+	std::vector<std::vector<trace_event>> threads;
+	uint64_t dropped;   // Events lost to full thread buffers while recording.
+};
+
+
+namespace detail
+{
+	struct trace_buffer
+	{
+		explicit trace_buffer(size_t capacity) : events(new trace_event[capacity]), capacity(capacity), size(0), dropped(0) {}
+
+		std::unique_ptr<trace_event[]> events;
+		size_t capacity;
+		std::atomic_size_t size;
+		std::atomic<uint64_t> dropped;
+	};
+
+	// Buffers outlive their threads (and are reused by later traces) so a trace can be dumped after the recording threads have exited.
+	struct trace_registry
+	{
+		std::mutex mutex;
+		std::vector<std::unique_ptr<trace_buffer>> buffers;
+		std::atomic_bool recording{ false };
+		std::atomic<void const*> queue{ nullptr };
+		std::chrono::steady_clock::time_point start;
+		size_t events_per_thread = 1 << 20;
+	};
+
+	inline trace_registry& trace_state()
+	{
+		static trace_registry registry;
+		return registry;
+	}
+
+	inline trace_buffer* trace_thread_buffer()
+	{
+		static thread_local trace_buffer *buffer = nullptr;
+		if (buffer == nullptr)
+		{
+			trace_registry &registry = trace_state();
+			std::lock_guard<std::mutex> lock(registry.mutex);
+			registry.buffers.emplace_back(new trace_buffer(registry.events_per_thread));
+			buffer = registry.buffers.back().get();
+		}
+		return buffer;
+	}
+
+	// Called on entry to push/pop, zero when not recording this queue.
+	inline uint64_t trace_now(void const *q)
+	{
+		trace_registry &registry = trace_state();
+		if (!registry.recording.load(std::memory_order_relaxed))
+			return 0;
+		void const *filter = registry.queue.load(std::memory_order_relaxed);
+		if (filter != nullptr && filter != q)
+			return 0;
+
+		// Zero means not recording, so the very first nanosecond is reported as one.
+		uint64_t t = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - registry.start).count();
+		return t == 0 ? 1 : t;
+	}
+
+	// Called once the operation has succeeded.
+	inline void trace_record(uint64_t time, trace_op op, size_t count)
+	{
+		if (time == 0 || count == 0)
+			return;
+
+		trace_buffer *buffer = trace_thread_buffer();
+		size_t i = buffer->size.load(std::memory_order_relaxed);
+		if (i == buffer->capacity)
+		{
+			buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		buffer->events[i].time = time;
+		buffer->events[i].count = static_cast<uint32_t>(count);
+		buffer->events[i].op = op;
+		buffer->size.store(i + 1, std::memory_order_release);
+	}
+
+	static const char trace_magic[4] = { 'G', 'M', 'Q', 'T' };
+	static const uint32_t trace_version = 1;
+}
+
+
+// Starts recording, discarding anything recorded before.  When q isn't null only operations on that queue are recorded (the replay driver assumes a
+// trace of one queue).  The per thread buffer size only applies to threads that haven't recorded before.
+inline void trace_start(void const *q = nullptr, size_t events_per_thread = 1 << 20)
+{
+	detail::trace_registry &registry = detail::trace_state();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.recording = false;
+	for (auto &buffer : registry.buffers)
+	{
+		buffer->size = 0;
+		buffer->dropped = 0;
+	}
+	registry.events_per_thread = events_per_thread;
+	registry.queue = q;
+	registry.start = std::chrono::steady_clock::now();
+	registry.recording = true;
+}
+
+inline void trace_stop()
+{
+	detail::trace_state().recording = false;
+}
+
+// Writes the recorded events, threads that recorded nothing are left out.  The format is native endian and meant to be replayed on the same kind
+// of machine it was captured on.
+inline void trace_dump(std::ostream &os)
+{
+	detail::trace_registry &registry = detail::trace_state();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	uint32_t thread_count = 0;
+	uint64_t dropped = 0;
+	for (auto &buffer : registry.buffers)
+	{
+		if (buffer->size != 0)
+			++thread_count;
+		dropped += buffer->dropped;
+	}
+
+	os.write(detail::trace_magic, sizeof(detail::trace_magic));
+	os.write(reinterpret_cast<char const*>(&detail::trace_version), sizeof(detail::trace_version));
+	os.write(reinterpret_cast<char const*>(&thread_count), sizeof(thread_count));
+	os.write(reinterpret_cast<char const*>(&dropped), sizeof(dropped));
+	for (auto &buffer : registry.buffers)
+	{
+		uint64_t size = buffer->size.load(std::memory_order_acquire);
+		if (size == 0)
+			continue;
+		os.write(reinterpret_cast<char const*>(&size), sizeof(size));
+		os.write(reinterpret_cast<char const*>(buffer->events.get()), static_cast<std::streamsize>(size * sizeof(trace_event)));
+	}
+}
+
+inline queue_trace trace_load(std::istream &is)
+{
+	char magic[sizeof(detail::trace_magic)];
+	uint32_t version = 0;
+	uint32_t thread_count = 0;
+	queue_trace trace;
+	trace.dropped = 0;
+
+	is.read(magic, sizeof(magic));
+	is.read(reinterpret_cast<char*>(&version), sizeof(version));
+	is.read(reinterpret_cast<char*>(&thread_count), sizeof(thread_count));
+	is.read(reinterpret_cast<char*>(&trace.dropped), sizeof(trace.dropped));
+	if (!is || std::memcmp(magic, detail::trace_magic, sizeof(magic)) != 0)
+		throw std::invalid_argument("stream does not hold a queue trace");
+	else if (version != detail::trace_version)
+		throw std::invalid_argument("queue trace version is not supported");
+
+	trace.threads.resize(thread_count);
+	for (auto &events : trace.threads)
+	{
+		uint64_t size = 0;
+		is.read(reinterpret_cast<char*>(&size), sizeof(size));
+		events.resize(static_cast<size_t>(size));
+		is.read(reinterpret_cast<char*>(events.data()), static_cast<std::streamsize>(size * sizeof(trace_event)));
+		if (!is)
+			throw std::invalid_argument("queue trace is truncated");
+	}
+	return trace;
+}
+
+
+struct replay_result
+{
+	double seconds;
+	uint64_t pushes;
+	uint64_t pops;
+	uint64_t prefilled;         // Items pushed before the replay started, the most pops the trace ever ran ahead of its pushes.
+	uint64_t drained;           // Items still in the queue after the last replayed pop, removed so blocked pushes could finish.
+	double mean_lateness;       // Nanoseconds an event started after its recorded time, on average.  Grows when the queue can't keep up.
+	double max_lateness;
+};
+
+
+// Replays a trace against q (any queue of size_t with push(size_t&&), pop(), try_pop(uint16_t) and capacity()) with one thread per recorded
+// thread, each starting its events at their recorded times divided by speed.  A thread that falls behind runs its events back to back until it
+// catches up, the lateness is reported rather than hidden.  A trace usually starts with items already in the queue, and a thread can pop before it
+// pushes, so the queue is first filled with the largest number of pops that ran ahead of the pushes (in time order across all threads), otherwise
+// replay could block forever on an empty queue.
+template <class Queue>
+replay_result replay_trace(queue_trace const &trace, Queue &q, double speed = 1.0)
+{
+	typedef std::chrono::steady_clock clock;
+
+	if (speed <= 0.0)
+		throw std::invalid_argument("specified replay speed is not positive");
+
+	std::vector<std::vector<trace_event>> const &threads = trace.threads;
+	replay_result result = {};
+
+	// The largest running deficit of pops over pushes, in time order across all threads.  Pops sort before pushes recorded at the same time, a
+	// thread's own pop then push can't be reordered.
+	struct op_ref
+	{
+		uint64_t time;
+		bool push;
+		uint32_t count;
+	};
+	std::vector<op_ref> ops;
+	for (auto const &events : threads)
+	{
+		for (auto const &e : events)
+		{
+			ops.push_back(op_ref{ e.time, e.op == trace_op::push, e.count });
+			if (e.op == trace_op::push)
+				result.pushes += e.count;
+			else
+				result.pops += e.count;
+		}
+	}
+	std::stable_sort(ops.begin(), ops.end(), [](op_ref const &a, op_ref const &b) { return a.time < b.time || (a.time == b.time && !a.push && b.push); });
+	int64_t balance = 0;
+	for (auto const &op : ops)
+	{
+		balance += op.push ? static_cast<int64_t>(op.count) : -static_cast<int64_t>(op.count);
+		result.prefilled = std::max(result.prefilled, static_cast<uint64_t>(std::max<int64_t>(0, -balance)));
+	}
+	if (result.prefilled > q.capacity())
+		throw std::invalid_argument("queue is too small to hold the items the trace pops ahead of its pushes");
+	for (uint64_t i = 0; i != result.prefilled; ++i)
+	{
+		size_t v = static_cast<size_t>(i);
+		q.push(std::move(v));
+	}
+
+	std::atomic_size_t ready(0);
+	std::atomic_size_t finished(0);
+	std::atomic<uint64_t> pops_remaining(result.pops);
+	std::atomic_bool go(false);
+	std::vector<double> mean_lateness(threads.size(), 0.0);
+	std::vector<double> max_lateness(threads.size(), 0.0);
+	clock::time_point start;
+
+	auto replay = [&](size_t thread_index)
+	{
+		++ready;
+		while (!go)
+			std::this_thread::yield();
+
+		double total = 0.0;
+		size_t count = 0;
+		for (auto const &e : threads[thread_index])
+		{
+			if (e.count == 0)
+				continue;
+
+			// Long gaps sleep, short ones spin, yielding here would hand the core to a thread spinning in the queue and wreck the timing.
+			auto due = start + std::chrono::nanoseconds(static_cast<int64_t>(static_cast<double>(e.time) / speed));
+			for (auto now = clock::now(); now < due; now = clock::now())
+			{
+				if (due - now > std::chrono::microseconds(200))
+					std::this_thread::sleep_for(due - now - std::chrono::microseconds(100));
+			}
+			double lateness = std::chrono::duration<double, std::nano>(clock::now() - due).count();
+			total += lateness;
+			max_lateness[thread_index] = std::max(max_lateness[thread_index], lateness);
+			++count;
+
+			for (uint32_t i = 0; i != e.count; ++i)
+			{
+				if (e.op == trace_op::push)
+				{
+					size_t v = i;
+					q.push(std::move(v));
+				}
+				else
+				{
+					q.pop();
+				}
+			}
+			if (e.op == trace_op::pop)
+				pops_remaining.fetch_sub(e.count);
+		}
+		mean_lateness[thread_index] = count != 0 ? total / static_cast<double>(count) : 0.0;
+		++finished;
+	};
+
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i != threads.size(); ++i)
+		workers.emplace_back(replay, i);
+	while (ready != workers.size())
+		std::this_thread::yield();
+	start = clock::now();
+	go = true;
+
+	// Once every replayed pop is done, whatever remains is drained so pushes blocked on a full queue can complete.
+	while (finished != workers.size())
+	{
+		if (pops_remaining == 0 && q.try_pop(0))
+			++result.drained;
+		else
+			std::this_thread::yield();
+	}
+	for (auto &w : workers)
+		w.join();
+	while (q.try_pop(0))
+		++result.drained;
+
+	result.seconds = std::chrono::duration<double>(clock::now() - start).count();
+	for (size_t i = 0; i != threads.size(); ++i)
+	{
+		result.mean_lateness += mean_lateness[i] / static_cast<double>(threads.size());
+		result.max_lateness = std::max(result.max_lateness, max_lateness[i]);
+	}
+	return result;
+}
+
+#endif // GUARUNTEED_MPMC_TRACE_HPP
@@ -0,0 +1,196 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_TUNER_HPP
+#define GUARUNTEED_MPMC_TUNER_HPP
+
+
+#include "queue.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+
+// Searches capacity, cache_line_size and concurrency (the spin budget before a yield) for a workload shape on the local machine, and writes the
+// winner out as a configuration header for GUARUNTEED_MPMC_CONFIG_HEADER.  The search is staged rather than exhaustive: capacity is picked first
+// with the default traits, then every traits candidate is measured at that capacity.  Each point is the median of several repetitions, one
+// descheduled run shouldn't pick the configuration.
+
+struct tuner_workload
+{
+	size_t producer_count;
+	size_t consumer_count;
+	size_t producer_iterations;
+	size_t repetitions;
+};
+
+struct tuner_measurement
+{
+	size_t capacity;
+	size_t cache_line_size;
+	uint32_t concurrency;
+	double items_per_second;    // Median over the repetitions.
+};
+
+
+namespace detail
+{
+	// Measures the workload on a fresh queue with the given traits each repetition, run returns the items / second of one.
+	template <class Traits, class Run>
+	tuner_measurement tuner_measure(size_t capacity, tuner_workload const &workload, Run const &run)
+	{
+		std::vector<double> rates;
+		for (size_t i = 0; i != workload.repetitions; ++i)
+		{
+			queue<size_t, Traits> q(capacity);
+			rates.push_back(run(q, workload));
+		}
+		std::sort(rates.begin(), rates.end());
+
+		tuner_measurement m;
+		m.capacity = capacity;
+		m.cache_line_size = Traits::cache_line_size;
+		m.concurrency = Traits::concurrency;
+		m.items_per_second = rates[rates.size() / 2];
+		return m;
+	}
+}
+
+
+// Run is the benchmark harness's scenario, a function object with a template <class Queue> double operator()(Queue&, tuner_workload const&)
+// that runs the workload once through the queue, verifying the items, and returns items / second.  The tuner only searches, so its numbers come
+// from the same (checked) runs as every other benchmark.
+template <class Run>
+class queue_tuner
+{
+public:
+	queue_tuner(tuner_workload const&, std::vector<size_t> const&, Run = Run());
+
+	tuner_measurement tune(std::ostream*);
+
+	void write_config(std::ostream&) const;
+
+	std::vector<tuner_measurement> const& measurements() const;
+
+private:
+	typedef tuner_measurement (*measure_fn)(size_t, tuner_workload const&, Run const&);
+
+	static bool faster(tuner_measurement const&, tuner_measurement const&);
+
+	tuner_workload workload_;
+	std::vector<size_t> capacities_;
+	std::vector<tuner_measurement> measurements_;
+	tuner_measurement best_;
+	Run run_;
+};
+
+
+template <class Run>
+queue_tuner<Run>::queue_tuner(tuner_workload const &workload, std::vector<size_t> const &capacities, Run run) : workload_(workload), capacities_(capacities), best_(), run_(run)
+{
+	if (workload_.producer_count == 0 || workload_.consumer_count == 0)
+		throw std::invalid_argument("specified producer or consumer count is zero - workload must have at least one of each");
+	else if (workload_.repetitions == 0)
+		throw std::invalid_argument("specified repetition count is zero - each point must be measured at least once");
+	else if (capacities_.empty())
+		throw std::invalid_argument("no capacity candidates specified");
+}
+
+// Runs both stages, progress goes to log when it isn't null.  Returns the best configuration found.
+template <class Run>
+tuner_measurement queue_tuner<Run>::tune(std::ostream *log)
+{
+	// Traits are compile time, so the candidates are a fixed table of instantiations.
+	static const measure_fn candidates[] =
+	{
+		&detail::tuner_measure<detail::queue_traits<64, 16>, Run>,
+		&detail::tuner_measure<detail::queue_traits<64, 64>, Run>,
+		&detail::tuner_measure<detail::queue_traits<64, 256>, Run>,
+		&detail::tuner_measure<detail::queue_traits<64, 1024>, Run>,
+		&detail::tuner_measure<detail::queue_traits<64, 4096>, Run>,
+		&detail::tuner_measure<detail::queue_traits<128, 16>, Run>,
+		&detail::tuner_measure<detail::queue_traits<128, 64>, Run>,
+		&detail::tuner_measure<detail::queue_traits<128, 256>, Run>,
+		&detail::tuner_measure<detail::queue_traits<128, 1024>, Run>,
+		&detail::tuner_measure<detail::queue_traits<128, 4096>, Run>
+	};
+
+	measurements_.clear();
+
+	auto record = [&](tuner_measurement const &m)
+	{
+		measurements_.push_back(m);
+		if (log != nullptr)
+			*log << "capacity " << m.capacity << " cache line " << m.cache_line_size << " concurrency " << m.concurrency << " @ " << static_cast<uint64_t>(m.items_per_second) << " items / second" << std::endl;
+	};
+
+	// Stage one, capacity with the default traits.
+	tuner_measurement best_capacity = {};
+	for (size_t capacity : capacities_)
+	{
+		tuner_measurement m = detail::tuner_measure<detail::queue_traits<>>(capacity, workload_, run_);
+		record(m);
+		if (faster(m, best_capacity))
+			best_capacity = m;
+	}
+
+	// Stage two, traits at the chosen capacity.
+	best_ = best_capacity;
+	for (measure_fn measure : candidates)
+	{
+		tuner_measurement m = measure(best_capacity.capacity, workload_, run_);
+		record(m);
+		if (faster(m, best_))
+			best_ = m;
+	}
+
+	return best_;
+}
+
+// Writes a header defining the configuration macros queue.hpp reads, with the measurements behind the choice as comments.  Values already
+// defined on the command line win.
+template <class Run>
+void queue_tuner<Run>::write_config(std::ostream &os) const
+{
+	if (measurements_.empty())
+		throw std::logic_error("queue_tuner::write_config called before tune");
+
+	os << "// Generated by 'queue tune', the measurements are specific to the host it was run on.\n";
+	os << "// Workload: " << workload_.producer_count << " producers, " << workload_.consumer_count << " consumers, " << workload_.producer_iterations
+		<< " items per producer, median of " << workload_.repetitions << " repetitions.\n";
+	os << "//\n";
+	os << "//   capacity  cache line  concurrency   items / second\n";
+	for (auto const &m : measurements_)
+	{
+		char line[96];
+		std::snprintf(line, sizeof(line), "// %10zu  %10zu  %11u  %15.0f%s\n", m.capacity, m.cache_line_size, static_cast<unsigned>(m.concurrency), m.items_per_second,
+			m.capacity == best_.capacity && m.cache_line_size == best_.cache_line_size && m.concurrency == best_.concurrency ? "  <--" : "");
+		os << line;
+	}
+	os << "\n";
+	os << "#if !defined(GUARUNTEED_MPMC_CACHE_LINE_SIZE)\n#define GUARUNTEED_MPMC_CACHE_LINE_SIZE " << best_.cache_line_size << "\n#endif\n\n";
+	os << "#if !defined(GUARUNTEED_MPMC_CONCURRENCY)\n#define GUARUNTEED_MPMC_CONCURRENCY " << best_.concurrency << "\n#endif\n\n";
+	os << "// Not read by queue.hpp, capacity is a constructor argument.\n";
+	os << "#if !defined(GUARUNTEED_MPMC_RECOMMENDED_CAPACITY)\n#define GUARUNTEED_MPMC_RECOMMENDED_CAPACITY " << best_.capacity << "\n#endif\n";
+}
+
+template <class Run>
+std::vector<tuner_measurement> const& queue_tuner<Run>::measurements() const
+{
+	return measurements_;
+}
+
+template <class Run>
+bool queue_tuner<Run>::faster(tuner_measurement const &a, tuner_measurement const &b)
+{
+	return a.items_per_second > b.items_per_second;
+}
+
+#endif // GUARUNTEED_MPMC_TUNER_HPP
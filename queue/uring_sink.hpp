@@ -0,0 +1,494 @@
+//  (C) Copyright 2015 Ben McCart
+//  Use, modification and distribution are subject to the Boost Software License,
+//  Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt).
+
+
+#ifndef GUARUNTEED_MPMC_URING_SINK_HPP
+#define GUARUNTEED_MPMC_URING_SINK_HPP
+
+
+// io_uring is linux only, on other platforms this header is empty.
+#if defined(__linux__)
+
+#include "queue.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace detail
+{
+	// Serializes T by copying its bytes, returns 0 when the item doesn't fit in the remaining room.
+	template <class T>
+	struct raw_serializer
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "raw_serializer requires a trivially copyable type, supply a serializer for T");
+
+		size_t operator()(T const &t, char *out, size_t room) const
+		{
+			if (room < sizeof(T))
+				return 0;
+
+			std::memcpy(out, &t, sizeof(T));
+			return sizeof(T);
+		}
+	};
+
+	// Minimal io_uring wrapper on top of the raw system calls (there is no dependency on liburing), only what the sink needs: a single submitter
+	// and a single reaper, which are the same thread.
+	class uring
+	{
+	public:
+		explicit uring(unsigned entries);
+		~uring();
+
+		uring(uring const&) = delete;
+		uring& operator=(uring const&) = delete;
+
+		bool register_buffers(::iovec const*, unsigned);
+		void prepare_write(int fd, void const *data, unsigned length, uint64_t offset, int buffer_index, uint64_t user_data);
+		void submit(unsigned wait_for);
+
+		template <class F>
+		unsigned reap(F&&);
+
+	private:
+		void unmap();
+
+		int fd_;
+		unsigned pending_;
+
+		void *sq_ring_;
+		size_t sq_ring_size_;
+		unsigned *sq_head_;
+		unsigned *sq_tail_;
+		unsigned *sq_mask_;
+		unsigned *sq_array_;
+		::io_uring_sqe *sqes_;
+		size_t sqes_size_;
+
+		void *cq_ring_;
+		size_t cq_ring_size_;
+		unsigned *cq_head_;
+		unsigned *cq_tail_;
+		unsigned *cq_mask_;
+		::io_uring_cqe *cqes_;
+	};
+
+	inline uring::uring(unsigned entries) : fd_(-1), pending_(0), sq_ring_(MAP_FAILED), sqes_(static_cast<::io_uring_sqe*>(MAP_FAILED)), cq_ring_(MAP_FAILED)
+	{
+		::io_uring_params params;
+		std::memset(&params, 0, sizeof(params));
+		fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+		if (fd_ < 0)
+			throw std::system_error(errno, std::generic_category(), "io_uring_setup failed");
+
+		sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(::io_uring_cqe);
+		bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (single_mmap)
+			sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+		sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+		cq_ring_ = single_mmap ? sq_ring_ : ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+		sqes_size_ = params.sq_entries * sizeof(::io_uring_sqe);
+		void *sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+		if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes == MAP_FAILED)
+		{
+			int error = errno;
+			if (sqes != MAP_FAILED)
+				::munmap(sqes, sqes_size_);
+			unmap();
+			throw std::system_error(error, std::generic_category(), "io_uring mmap failed");
+		}
+		sqes_ = static_cast<::io_uring_sqe*>(sqes);
+
+		char *sq = static_cast<char*>(sq_ring_);
+		sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+		sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+		sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+		sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+		char *cq = static_cast<char*>(cq_ring_);
+		cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+		cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+		cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+		cqes_ = reinterpret_cast<::io_uring_cqe*>(cq + params.cq_off.cqes);
+	}
+
+	inline uring::~uring()
+	{
+		unmap();
+	}
+
+	inline void uring::unmap()
+	{
+		if (sqes_ != MAP_FAILED)
+			::munmap(sqes_, sqes_size_);
+		if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+			::munmap(cq_ring_, cq_ring_size_);
+		if (sq_ring_ != MAP_FAILED)
+			::munmap(sq_ring_, sq_ring_size_);
+		if (fd_ >= 0)
+			::close(fd_);
+	}
+
+	// Registering buffers pins them, which can fail under a low RLIMIT_MEMLOCK, in which case plain (unregistered) writes are used.
+	inline bool uring::register_buffers(::iovec const *buffers, unsigned count)
+	{
+		return ::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+	}
+
+	// Queues a write, buffer_index < 0 means the buffer isn't registered.
+	inline void uring::prepare_write(int fd, void const *data, unsigned length, uint64_t offset, int buffer_index, uint64_t user_data)
+	{
+		unsigned tail = *sq_tail_;
+		unsigned index = tail & *sq_mask_;
+		::io_uring_sqe &sqe = sqes_[index];
+		std::memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = buffer_index < 0 ? IORING_OP_WRITE : IORING_OP_WRITE_FIXED;
+		sqe.fd = fd;
+		sqe.addr = reinterpret_cast<uint64_t>(data);
+		sqe.len = length;
+		sqe.off = offset;
+		sqe.buf_index = static_cast<uint16_t>(buffer_index < 0 ? 0 : buffer_index);
+		sqe.user_data = user_data;
+		sq_array_[index] = index;
+
+		__atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+		++pending_;
+	}
+
+	// Submits everything prepared so far, blocking until at least wait_for completions are available.
+	inline void uring::submit(unsigned wait_for)
+	{
+		while (pending_ != 0 || wait_for != 0)
+		{
+			unsigned flags = wait_for != 0 ? IORING_ENTER_GETEVENTS : 0;
+			int result = static_cast<int>(::syscall(__NR_io_uring_enter, fd_, pending_, wait_for, flags, nullptr, 0));
+			if (result < 0)
+			{
+				if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+					continue;
+				throw std::system_error(errno, std::generic_category(), "io_uring_enter failed");
+			}
+
+			pending_ -= static_cast<unsigned>(result);
+			wait_for = 0;
+		}
+	}
+
+	// Calls f(user_data, result) for each available completion, returns the number of completions.
+	template <class F>
+	inline unsigned uring::reap(F &&f)
+	{
+		unsigned head = *cq_head_;
+		unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+		unsigned count = 0;
+		for (; head != tail; ++head, ++count)
+		{
+			::io_uring_cqe const &cqe = cqes_[head & *cq_mask_];
+			f(cqe.user_data, cqe.res);
+		}
+		__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+		return count;
+	}
+}
+
+
+// Drains a queue<T> in batches into a set of registered buffers and appends them to a file with io_uring.  Draining the queue into the next free buffer
+// overlaps with the writes in flight, and buffers are recycled as their writes complete.  Serializer is called as size_t(T const&, char *out, size_t room)
+// and returns the number of bytes written, or 0 when the item doesn't fit.  Only one thread may drive a sink.
+template <class T, class Serializer = detail::raw_serializer<T>>
+class uring_sink
+{
+public:
+	uring_sink(queue<T>&, int, size_t = 8, size_t = 64 * 1024, Serializer = Serializer());
+	~uring_sink();
+
+	uring_sink(uring_sink const&) = delete;
+	uring_sink& operator=(uring_sink const&) = delete;
+
+	size_t drain(size_t, uint16_t);
+	void run(std::atomic_bool const&, size_t = 256);
+	void flush();
+
+	uint64_t items() const;
+	uint64_t bytes_written() const;
+	uint64_t writes() const;
+
+private:
+	struct buffer
+	{
+		char *data;
+		size_t used;
+		size_t written;
+		uint64_t offset;
+	};
+
+	void submit_current();
+	void submit(size_t);
+	void complete(uint64_t, int);
+	void acquire_buffer();
+
+	queue<T> &source_;
+	int fd_;
+	Serializer serializer_;
+	size_t buffer_size_;
+	bool registered_;
+
+	std::vector<buffer> buffers_;
+	std::vector<size_t> free_;
+	size_t current_;
+	size_t in_flight_;
+	uint64_t offset_;
+	int error_;
+
+	uint64_t items_;
+	uint64_t bytes_written_;
+	uint64_t writes_;
+
+	detail::uring ring_;
+};
+
+
+template <class T, class Serializer>
+uring_sink<T, Serializer>::uring_sink(queue<T> &source, int fd, size_t buffer_count, size_t buffer_size, Serializer serializer)
+	: source_(source), fd_(fd), serializer_(serializer), buffer_size_(buffer_size), registered_(false), current_(0), in_flight_(0), offset_(0), error_(0),
+	items_(0), bytes_written_(0), writes_(0), ring_(static_cast<unsigned>(detail::queue_size<size_t>::round_up_to_power_of_2(buffer_count)))
+{
+	if (buffer_count < 2)
+		throw std::invalid_argument("specified buffer count is less than two - a sink needs a buffer to fill while another is written");
+	else if (buffer_size == 0 || buffer_size > std::numeric_limits<unsigned>::max())
+		throw std::invalid_argument("specified buffer size is zero or too large for a single write");
+
+	off_t position = ::lseek(fd, 0, SEEK_CUR);
+	offset_ = position < 0 ? 0 : static_cast<uint64_t>(position);
+
+	std::vector<::iovec> iov(buffer_count);
+	buffers_.resize(buffer_count);
+	for (size_t i = 0; i != buffer_count; ++i)
+	{
+		void *data = nullptr;
+		if (::posix_memalign(&data, 4096, buffer_size) != 0)
+		{
+			for (size_t j = 0; j != i; ++j)
+				std::free(buffers_[j].data);
+			throw std::bad_alloc();
+		}
+
+		buffers_[i].data = static_cast<char*>(data);
+		buffers_[i].used = 0;
+		buffers_[i].written = 0;
+		buffers_[i].offset = 0;
+		iov[i].iov_base = data;
+		iov[i].iov_len = buffer_size;
+	}
+
+	registered_ = ring_.register_buffers(iov.data(), static_cast<unsigned>(buffer_count));
+
+	// Buffer 0 is the first one filled.
+	for (size_t i = buffer_count; i != 1; --i)
+		free_.push_back(i - 1);
+}
+
+template <class T, class Serializer>
+uring_sink<T, Serializer>::~uring_sink()
+{
+	try
+	{
+		flush();
+	}
+	catch (...)
+	{
+	}
+
+	for (auto &b : buffers_)
+		std::free(b.data);
+}
+
+// Pops up to max_items items (try_pop with the given attempts) into the buffers, submitting buffers as they fill.  Returns the number of items drained.
+template <class T, class Serializer>
+size_t uring_sink<T, Serializer>::drain(size_t max_items, uint16_t attempts)
+{
+	if (error_ != 0)
+		throw std::system_error(error_, std::generic_category(), "io_uring write failed");
+
+	size_t count = 0;
+	for (; count != max_items; ++count)
+	{
+		typename queue<T>::optional_t item = source_.try_pop(attempts);
+		if (!item)
+			break;
+
+		buffer &b = buffers_[current_];
+		size_t size = serializer_(*item, b.data + b.used, buffer_size_ - b.used);
+		if (size == 0)
+		{
+			submit_current();
+			buffer &next = buffers_[current_];
+			size = serializer_(*item, next.data, buffer_size_);
+			if (size == 0)
+				throw std::length_error("serialized item is larger than the sink buffer size");
+			next.used = size;
+		}
+		else
+		{
+			b.used += size;
+		}
+		++items_;
+	}
+
+	// Hand a partially filled buffer to the kernel when the queue runs dry and nothing is in flight, otherwise keep filling while the writes complete.
+	if (count != max_items && in_flight_ == 0 && buffers_[current_].used != 0)
+		submit_current();
+
+	ring_.reap([this](uint64_t user_data, int result) { complete(user_data, result); });
+	return count;
+}
+
+// Drains the queue until stop is raised and the queue is empty, then flushes.
+template <class T, class Serializer>
+void uring_sink<T, Serializer>::run(std::atomic_bool const &stop, size_t batch_size)
+{
+	for (uint32_t idle_count = 0; ; )
+	{
+		if (drain(batch_size, 0) != 0)
+		{
+			idle_count = 0;
+			continue;
+		}
+
+		if (stop && source_.empty())
+			break;
+
+		if ((++idle_count % detail::concurrency) == 0)
+			std::this_thread::yield();
+	}
+
+	flush();
+}
+
+// Writes out the partially filled buffer and waits for every write in flight.
+template <class T, class Serializer>
+void uring_sink<T, Serializer>::flush()
+{
+	if (buffers_[current_].used != 0)
+		submit_current();
+
+	while (in_flight_ != 0)
+	{
+		ring_.submit(1);
+		ring_.reap([this](uint64_t user_data, int result) { complete(user_data, result); });
+	}
+
+	if (error_ != 0)
+		throw std::system_error(error_, std::generic_category(), "io_uring write failed");
+}
+
+template <class T, class Serializer>
+uint64_t uring_sink<T, Serializer>::items() const
+{
+	return items_;
+}
+
+template <class T, class Serializer>
+uint64_t uring_sink<T, Serializer>::bytes_written() const
+{
+	return bytes_written_;
+}
+
+template <class T, class Serializer>
+uint64_t uring_sink<T, Serializer>::writes() const
+{
+	return writes_;
+}
+
+// Submits the current buffer and moves on to a free one, waiting for a completion if all of them are in flight.
+template <class T, class Serializer>
+void uring_sink<T, Serializer>::submit_current()
+{
+	buffer &b = buffers_[current_];
+	b.written = 0;
+	b.offset = offset_;
+	offset_ += b.used;
+	++in_flight_;
+	submit(current_);
+
+	acquire_buffer();
+}
+
+template <class T, class Serializer>
+void uring_sink<T, Serializer>::submit(size_t index)
+{
+	buffer &b = buffers_[index];
+	unsigned length = static_cast<unsigned>(b.used - b.written);
+	ring_.prepare_write(fd_, b.data + b.written, length, b.offset + b.written, registered_ ? static_cast<int>(index) : -1, index);
+	++writes_;
+	ring_.submit(0);
+}
+
+template <class T, class Serializer>
+void uring_sink<T, Serializer>::complete(uint64_t user_data, int result)
+{
+	buffer &b = buffers_[static_cast<size_t>(user_data)];
+	if (result < 0)
+	{
+		error_ = -result;
+	}
+	else
+	{
+		bytes_written_ += static_cast<uint64_t>(result);
+		b.written += static_cast<size_t>(result);
+
+		// Short write, the rest goes at the offset reserved for it.
+		if (b.written != b.used && result != 0)
+		{
+			submit(static_cast<size_t>(user_data));
+			return;
+		}
+		else if (b.written != b.used)
+		{
+			error_ = EIO;
+		}
+	}
+
+	b.used = 0;
+	--in_flight_;
+	free_.push_back(static_cast<size_t>(user_data));
+}
+
+template <class T, class Serializer>
+void uring_sink<T, Serializer>::acquire_buffer()
+{
+	ring_.reap([this](uint64_t user_data, int result) { complete(user_data, result); });
+	while (free_.empty())
+	{
+		ring_.submit(1);
+		ring_.reap([this](uint64_t user_data, int result) { complete(user_data, result); });
+	}
+
+	current_ = free_.back();
+	free_.pop_back();
+}
+
+#endif // defined(__linux__)
+
+#endif // GUARUNTEED_MPMC_URING_SINK_HPP